@@ -0,0 +1,341 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Allocation guard for checking the FIFO service path.
+ *
+ * Build the library with PI2C_ALLOC_GUARD defined, link this file in and
+ * link with -ldl. While a thread is inside bsc_i2c_read_poll() or
+ * bsc_i2c_write(), including its tx_callback, any allocation or stdio call
+ * aborts the program with the name of the offender. Run it under a
+ * debugger, or with core dumps enabled, to see who called it.
+ *
+ * The service path itself still sleeps between FIFO services, writes the
+ * event eventfd and reads the slave device or UIO interrupt. So open(),
+ * read(), write() and the sleeps only abort when called from a tx_callback.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+
+#define BOOT_HEAP_LEN (4096) ///< For dlsym(), which may allocate before we can
+
+// Defined in pi2cslave.c
+extern __thread unsigned pi2c_in_service;
+extern __thread unsigned pi2c_in_callback;
+
+static void * (*next_malloc)(size_t);
+static void * (*next_calloc)(size_t, size_t);
+static void * (*next_realloc)(void *, size_t);
+static void (*next_free)(void *);
+static int (*next_posix_memalign)(void **, size_t, size_t);
+static void * (*next_aligned_alloc)(size_t, size_t);
+static int (*next_vfprintf)(FILE *, const char *, va_list);
+static int (*next_fputs)(const char *, FILE *);
+static size_t (*next_fwrite)(const void *, size_t, size_t, FILE *);
+static void (*next_perror)(const char *);
+static FILE * (*next_fopen)(const char *, const char *);
+static void * (*next_mmap)(void *, size_t, int, int, int, off_t);
+static int (*next_puts)(const char *);
+static int (*next_putchar)(int);
+static int (*next_open)(const char *, int, ...);
+static ssize_t (*next_read)(int, void *, size_t);
+static ssize_t (*next_write)(int, const void *, size_t);
+static int (*next_usleep)(useconds_t);
+static int (*next_nanosleep)(const struct timespec *, struct timespec *);
+
+static __thread bool resolving = false;
+static uint8_t boot_heap[BOOT_HEAP_LEN] __attribute__((aligned(16)));
+static size_t boot_used = 0;
+
+// Write straight to the kernel, the usual ways of printing are what we trap.
+static void report(const char * str)
+{
+    syscall(SYS_write, STDERR_FILENO, str, strlen(str));
+}
+
+static void trap(unsigned depth, const char * what)
+{
+    if (depth == 0) {
+        return;
+    }
+    report("pi2c_alloc_guard: service path called ");
+    report(what);
+    report("\n");
+    abort();
+}
+
+static void check(const char * what)
+{
+    trap(pi2c_in_service, what);
+}
+
+static void check_callback(const char * what)
+{
+    trap(pi2c_in_callback, what);
+}
+
+static void resolve()
+{
+    resolving = true;
+    next_malloc = dlsym(RTLD_NEXT, "malloc");
+    next_calloc = dlsym(RTLD_NEXT, "calloc");
+    next_realloc = dlsym(RTLD_NEXT, "realloc");
+    next_free = dlsym(RTLD_NEXT, "free");
+    next_posix_memalign = dlsym(RTLD_NEXT, "posix_memalign");
+    next_aligned_alloc = dlsym(RTLD_NEXT, "aligned_alloc");
+    next_vfprintf = dlsym(RTLD_NEXT, "vfprintf");
+    next_fputs = dlsym(RTLD_NEXT, "fputs");
+    next_fwrite = dlsym(RTLD_NEXT, "fwrite");
+    next_perror = dlsym(RTLD_NEXT, "perror");
+    next_fopen = dlsym(RTLD_NEXT, "fopen");
+    next_mmap = dlsym(RTLD_NEXT, "mmap");
+    next_puts = dlsym(RTLD_NEXT, "puts");
+    next_putchar = dlsym(RTLD_NEXT, "putchar");
+    next_open = dlsym(RTLD_NEXT, "open");
+    next_read = dlsym(RTLD_NEXT, "read");
+    next_write = dlsym(RTLD_NEXT, "write");
+    next_usleep = dlsym(RTLD_NEXT, "usleep");
+    next_nanosleep = dlsym(RTLD_NEXT, "nanosleep");
+    resolving = false;
+}
+
+static void * boot_alloc(size_t len)
+{
+    size_t start = (boot_used + 15) & ~(size_t)15;
+    if (len > BOOT_HEAP_LEN - start) {
+        return NULL;
+    }
+    boot_used = start + len;
+    return boot_heap + start; // Static, so already zeroed
+}
+
+static bool from_boot_heap(void * ptr)
+{
+    return (uint8_t *)ptr >= boot_heap && (uint8_t *)ptr < boot_heap + BOOT_HEAP_LEN;
+}
+
+void * malloc(size_t len)
+{
+    check("malloc");
+    if (!next_malloc) {
+        if (resolving) {
+            return boot_alloc(len);
+        }
+        resolve();
+    }
+    return next_malloc(len);
+}
+
+void * calloc(size_t count, size_t len)
+{
+    check("calloc");
+    if (!next_calloc) {
+        if (resolving) {
+            return boot_alloc(count * len);
+        }
+        resolve();
+    }
+    return next_calloc(count, len);
+}
+
+void * realloc(void * ptr, size_t len)
+{
+    check("realloc");
+    if (!next_realloc) {
+        resolve();
+    }
+    if (from_boot_heap(ptr)) {
+        void * moved = next_malloc(len);
+        if (moved) {
+            memcpy(moved, ptr, len < BOOT_HEAP_LEN ? len : BOOT_HEAP_LEN);
+        }
+        return moved;
+    }
+    return next_realloc(ptr, len);
+}
+
+void free(void * ptr)
+{
+    check("free");
+    if (ptr == NULL || from_boot_heap(ptr)) {
+        return;
+    }
+    if (!next_free) {
+        resolve();
+    }
+    next_free(ptr);
+}
+
+int posix_memalign(void ** out, size_t align, size_t len)
+{
+    check("posix_memalign");
+    if (!next_posix_memalign) {
+        resolve();
+    }
+    return next_posix_memalign(out, align, len);
+}
+
+void * aligned_alloc(size_t align, size_t len)
+{
+    check("aligned_alloc");
+    if (!next_aligned_alloc) {
+        resolve();
+    }
+    return next_aligned_alloc(align, len);
+}
+
+int vfprintf(FILE * stream, const char * fmt, va_list args)
+{
+    check("vfprintf");
+    if (!next_vfprintf) {
+        resolve();
+    }
+    return next_vfprintf(stream, fmt, args);
+}
+
+int fprintf(FILE * stream, const char * fmt, ...)
+{
+    check("fprintf");
+    va_list args;
+    va_start(args, fmt);
+    int ret = vfprintf(stream, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+int printf(const char * fmt, ...)
+{
+    check("printf");
+    va_list args;
+    va_start(args, fmt);
+    int ret = vfprintf(stdout, fmt, args);
+    va_end(args);
+    return ret;
+}
+
+int fputs(const char * str, FILE * stream)
+{
+    check("fputs");
+    if (!next_fputs) {
+        resolve();
+    }
+    return next_fputs(str, stream);
+}
+
+size_t fwrite(const void * ptr, size_t len, size_t count, FILE * stream)
+{
+    check("fwrite");
+    if (!next_fwrite) {
+        resolve();
+    }
+    return next_fwrite(ptr, len, count, stream);
+}
+
+void perror(const char * str)
+{
+    check("perror");
+    if (!next_perror) {
+        resolve();
+    }
+    next_perror(str);
+}
+
+FILE * fopen(const char * path, const char * mode)
+{
+    check("fopen");
+    if (!next_fopen) {
+        resolve();
+    }
+    return next_fopen(path, mode);
+}
+
+void * mmap(void * addr, size_t len, int prot, int flags, int fd, off_t off)
+{
+    check("mmap");
+    if (!next_mmap) {
+        resolve();
+    }
+    return next_mmap(addr, len, prot, flags, fd, off);
+}
+
+int puts(const char * str)
+{
+    check("puts");
+    if (!next_puts) {
+        resolve();
+    }
+    return next_puts(str);
+}
+
+int putchar(int c)
+{
+    check("putchar");
+    if (!next_putchar) {
+        resolve();
+    }
+    return next_putchar(c);
+}
+
+int open(const char * path, int flags, ...)
+{
+    check_callback("open");
+    if (!next_open) {
+        resolve();
+    }
+    mode_t mode = 0;
+    if (flags & (O_CREAT | O_TMPFILE)) {
+        va_list args;
+        va_start(args, flags);
+        mode = va_arg(args, mode_t);
+        va_end(args);
+    }
+    return next_open(path, flags, mode);
+}
+
+ssize_t read(int fd, void * buf, size_t len)
+{
+    check_callback("read");
+    if (!next_read) {
+        resolve();
+    }
+    return next_read(fd, buf, len);
+}
+
+ssize_t write(int fd, const void * buf, size_t len)
+{
+    check_callback("write");
+    if (!next_write) {
+        resolve();
+    }
+    return next_write(fd, buf, len);
+}
+
+int usleep(useconds_t us)
+{
+    check_callback("usleep");
+    if (!next_usleep) {
+        resolve();
+    }
+    return next_usleep(us);
+}
+
+int nanosleep(const struct timespec * req, struct timespec * rem)
+{
+    check_callback("nanosleep");
+    if (!next_nanosleep) {
+        resolve();
+    }
+    return next_nanosleep(req, rem);
+}
@@ -0,0 +1,266 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Prometheus metrics endpoint, see pi2c_metrics.h.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "pi2cslave.h"
+#include "pi2c_metrics.h"
+
+#define ACCEPT_POLL_MS  (200)     ///< How often the exporter checks it should stop
+#define REQUEST_WAIT_MS (100)     ///< How long to wait for a request before answering anyway
+#define SCRAPE_LEN      (16384)   ///< Longest scrape
+#define TAG             "pi2c_metrics"
+
+static atomic_bool metrics_run = false;
+static pthread_t metrics_thread;
+static int listen_fd = -1;
+static struct sockaddr_un sock_addr;
+
+struct scrape {
+    char * buf;
+    size_t len;
+    size_t used;
+};
+
+static void put(struct scrape * out, const char * fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    size_t room = (out->used < out->len) ? out->len - out->used : 0;
+    int n = vsnprintf(room ? out->buf + out->used : NULL, room, fmt, args);
+    va_end(args);
+    if (n > 0) {
+        out->used += n;
+    }
+}
+
+static void put_metric(struct scrape * out, const char * type, const char * name, const char * help,
+                       double val)
+{
+    put(out, "# HELP pi2cslave_%s %s\n# TYPE pi2cslave_%s %s\npi2cslave_%s %.9g\n",
+        name, help, name, type, name, val);
+}
+
+// Upper bound of a turnaround bucket, in seconds
+static double bucket_le(unsigned bucket)
+{
+    return (double)(1u << bucket) / 1e6;
+}
+
+size_t pi2c_metrics_format(char * buf, size_t len)
+{
+    struct scrape out = {buf, len, 0};
+    struct bsc_i2c_metrics m;
+    struct bsc_i2c_diag diag;
+    struct bsc_i2c_tx_stats tx;
+    struct bsc_i2c_resync_stats resync;
+    struct bsc_i2c_watchdog_stats watchdog;
+    bsc_i2c_get_metrics(&m);
+    bsc_i2c_get_diag(&diag);
+    bsc_i2c_get_tx_stats(&tx);
+    bsc_i2c_get_resync_stats(&resync);
+    bsc_i2c_get_watchdog_stats(&watchdog);
+
+    put_metric(&out, "counter", "write_calls_total", "Calls to bsc_i2c_write(), one per reply served",
+               m.write_calls);
+    put_metric(&out, "counter", "master_reads_total", "Replies the master read at least one byte of",
+               m.master_reads);
+    put_metric(&out, "counter", "rx_bytes_total", "Bytes read from the master", m.rx_bytes);
+    put_metric(&out, "counter", "tx_bytes_total", "Bytes the master read", tx.bytes);
+    put_metric(&out, "counter", "underruns_total", "TX FIFO underruns", diag.underruns);
+    put_metric(&out, "counter", "overruns_total", "RX FIFO overruns", diag.overruns);
+    put_metric(&out, "counter", "flush_toggles_total", "TXE toggles made to flush the TX FIFO",
+               m.flush_toggles);
+    put_metric(&out, "counter", "flush_giveups_total", "TX FIFO flushes given up on", m.flush_giveups);
+    put_metric(&out, "counter", "tx_wakeups_total", "Times bsc_i2c_write() woke up to service the FIFO",
+               tx.wakeups);
+    put_metric(&out, "counter", "tx_interrupts_total", "Of those, times woken by the TX or RX interrupt",
+               tx.interrupts);
+    put_metric(&out, "counter", "corrupt_writes_total", "Master writes discarded as corrupt",
+               resync.corrupt);
+    put_metric(&out, "counter", "watchdog_resets_total", "BSC resets by the hang watchdog",
+               watchdog.resets);
+    put_metric(&out, "gauge", "max_service_gap_seconds", "Worst time between two TX FIFO services",
+               diag.max_service_gap_us / 1e6);
+    put_metric(&out, "gauge", "uptime_seconds", "Time since init_bsc_i2c_slv()", diag.uptime_s);
+
+    // Bucket counts are read one by one while the service thread may add to
+    // them, so derive the count from the buckets to keep them consistent.
+    uint64_t count = 0;
+    put(&out, "# HELP pi2cslave_turnaround_seconds Time from bsc_i2c_write() to the first byte queued\n"
+              "# TYPE pi2cslave_turnaround_seconds histogram\n");
+    for (unsigned i = 0; i < BSC_TURNAROUND_BUCKETS - 1; i++) {
+        count += m.turnaround[i];
+        put(&out, "pi2cslave_turnaround_seconds_bucket{le=\"%.6f\"} %llu\n", bucket_le(i),
+            (unsigned long long)count);
+    }
+    count += m.turnaround[BSC_TURNAROUND_BUCKETS - 1];
+    put(&out, "pi2cslave_turnaround_seconds_bucket{le=\"+Inf\"} %llu\n", (unsigned long long)count);
+    put(&out, "pi2cslave_turnaround_seconds_sum %.6f\n", m.turnaround_sum_us / 1e6);
+    put(&out, "pi2cslave_turnaround_seconds_count %llu\n", (unsigned long long)count);
+
+    // Quantiles since start, as the upper bound of the bucket holding them.
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    put(&out, "# HELP pi2cslave_turnaround_quantile_seconds Turnaround quantiles since start, "
+              "to a power of 2 us\n# TYPE pi2cslave_turnaround_quantile_seconds gauge\n");
+    for (unsigned q = 0; count && q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+        uint64_t rank = quantiles[q] * count;
+        uint64_t seen = 0;
+        unsigned i = 0;
+        for (; i < BSC_TURNAROUND_BUCKETS - 1; i++) {
+            seen += m.turnaround[i];
+            if (seen > rank) {
+                break;
+            }
+        }
+        // Past the last bound, the best we can say is the last bound.
+        double le = bucket_le(i < BSC_TURNAROUND_BUCKETS - 1 ? i : BSC_TURNAROUND_BUCKETS - 2);
+        put(&out, "pi2cslave_turnaround_quantile_seconds{quantile=\"%g\"} %.6f\n", quantiles[q], le);
+    }
+    return out.used;
+}
+
+static bool send_all(int fd, const char * buf, size_t len)
+{
+    while (len) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+static void serve(int fd)
+{
+    static char scrape[SCRAPE_LEN];
+    char req[512];
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    ssize_t n = 0;
+    if (poll(&pfd, 1, REQUEST_WAIT_MS) > 0) {
+        n = recv(fd, req, sizeof(req), MSG_DONTWAIT);
+    }
+    size_t len = pi2c_metrics_format(scrape, sizeof(scrape));
+    if (len >= sizeof(scrape)) {
+        len = sizeof(scrape) - 1;
+    }
+    if (n >= 4 && memcmp(req, "GET ", 4) == 0) {
+        char head[128];
+        int head_len = snprintf(head, sizeof(head),
+                                "HTTP/1.0 200 OK\r\n"
+                                "Content-Type: text/plain; version=0.0.4\r\n"
+                                "Content-Length: %zu\r\n\r\n", len);
+        if (!send_all(fd, head, head_len)) {
+            return;
+        }
+    }
+    send_all(fd, scrape, len);
+}
+
+static void * metrics_main(void * unused)
+{
+    (void)unused;
+    // Only run when nothing else wants the CPU, the service thread above all.
+    struct sched_param param = {0};
+    pthread_setschedparam(pthread_self(), SCHED_IDLE, &param);
+
+    while (atomic_load_explicit(&metrics_run, memory_order_relaxed)) {
+        struct pollfd pfd = {.fd = listen_fd, .events = POLLIN};
+        if (poll(&pfd, 1, ACCEPT_POLL_MS) <= 0) {
+            continue;
+        }
+        int fd = accept4(listen_fd, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        serve(fd);
+        close(fd);
+    }
+    return NULL;
+}
+
+bool pi2c_metrics_start(const char * path)
+{
+    if (atomic_load(&metrics_run)) {
+        fprintf(stderr, TAG ": The exporter is already running\n");
+        return false;
+    }
+    memset(&sock_addr, 0, sizeof(sock_addr));
+    sock_addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sock_addr.sun_path)) {
+        fprintf(stderr, TAG ": Socket path too long: %s\n", path);
+        return false;
+    }
+    strcpy(sock_addr.sun_path, path);
+
+    // Replace a socket left by an earlier run, but nothing else.
+    struct stat st;
+    if (lstat(path, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, TAG ": Not replacing %s, it is not a socket\n", path);
+            return false;
+        }
+        if (unlink(path) < 0) {
+            perror(TAG ": Unable to remove old socket");
+            return false;
+        }
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0) {
+        perror(TAG ": Unable to create socket");
+        return false;
+    }
+    if (bind(listen_fd, (struct sockaddr *)&sock_addr, sizeof(sock_addr)) < 0 ||
+        listen(listen_fd, 4) < 0) {
+        perror(TAG ": Unable to listen on socket");
+        close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    atomic_store(&metrics_run, true);
+    int err = pthread_create(&metrics_thread, NULL, metrics_main, NULL);
+    if (err != 0) {
+        fprintf(stderr, TAG ": Unable to start exporter thread: %s\n", strerror(err));
+        atomic_store(&metrics_run, false);
+        close(listen_fd);
+        listen_fd = -1;
+        unlink(path);
+        return false;
+    }
+    return true;
+}
+
+void pi2c_metrics_stop()
+{
+    if (!atomic_exchange(&metrics_run, false)) {
+        return;
+    }
+    pthread_join(metrics_thread, NULL);
+    close(listen_fd);
+    listen_fd = -1;
+    unlink(sock_addr.sun_path);
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/**
+ * @file pi2c_metrics.h
+ * @brief Prometheus metrics endpoint on a local Unix socket
+ *
+ * Link pi2c_metrics.c to serve the library's counters in the Prometheus
+ * text exposition format. An exporter thread, running at the idle
+ * scheduling class, answers each connection with one scrape. Plain HTTP
+ * GET requests get an HTTP response, anything else gets the bare text, so
+ * both an HTTP scraper and `socat - UNIX-CONNECT:path` work.
+ *
+ * The exporter only reads counters without locking, see
+ * bsc_i2c_get_metrics(), so scrapes can never stall the FIFO service loop.
+ */
+#ifndef __PI2C_METRICS_H__
+#define __PI2C_METRICS_H__
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * @brief Start the exporter thread
+ *
+ * @param path Socket path. An existing socket at path is replaced, anything
+ *             else there is left alone and makes the start fail.
+ *
+ * @return false on error, if path is taken by something other than a
+ *         socket, or if the exporter is already running, true otherwise
+ */
+bool pi2c_metrics_start(const char * path);
+/**
+ * @brief Stop the exporter thread and remove its socket
+ */
+void pi2c_metrics_stop();
+/**
+ * @brief Format the metrics as one scrape would return them
+ *
+ * @param buf Buffer to write to
+ * @param len Length of buf
+ *
+ * @return Length of the text, which was cut short if it is len or more
+ */
+size_t pi2c_metrics_format(char * buf, size_t len);
+
+#endif // ! __PI2C_METRICS_H__
@@ -0,0 +1,72 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/**
+ * @file pi2c_mmio.h
+ * @brief Register access helpers for the BCM peripherals
+ *
+ * All peripheral register accesses go through mmio_read() and mmio_write().
+ * They are plain volatile accesses, with no barrier of their own. The BCM
+ * peripherals only guarantee ordering within one peripheral, so
+ * mmio_barrier() must be called when a thread switches from one peripheral
+ * to another (BSC to GPIO and back). Accesses within one peripheral need no
+ * barrier, and neither does a context switch, which implies one.
+ *
+ * Building with PI2C_SIM defined routes every access and barrier to the
+ * simulated peripherals in pi2c_sim.c instead, so the library runs
+ * off-target.
+ */
+#ifndef __PI2C_MMIO_H__
+#define __PI2C_MMIO_H__
+
+#include <stdint.h>
+
+#ifdef PI2C_SIM
+uint32_t pi2c_sim_read(volatile uint32_t * reg);
+void pi2c_sim_write(volatile uint32_t * reg, uint32_t val);
+void pi2c_sim_barrier();
+#endif
+
+/**
+ * @brief Read one peripheral register
+ */
+static inline uint32_t mmio_read(volatile uint32_t * reg)
+{
+#ifdef PI2C_SIM
+    return pi2c_sim_read(reg);
+#else
+    return *reg;
+#endif
+}
+
+/**
+ * @brief Write one peripheral register
+ */
+static inline void mmio_write(volatile uint32_t * reg, uint32_t val)
+{
+#ifdef PI2C_SIM
+    pi2c_sim_write(reg, val);
+#else
+    *reg = val;
+#endif
+}
+
+/**
+ * @brief Order all earlier peripheral accesses before all later ones
+ */
+static inline void mmio_barrier()
+{
+#ifdef PI2C_SIM
+    pi2c_sim_barrier();
+#elif defined(__aarch64__) || (defined(__arm__) && __ARM_ARCH >= 7)
+    __asm__ volatile("dmb sy" ::: "memory");
+#elif defined(__arm__)
+    // ARMv6 (BCM2835) has no dmb instruction, use the CP15 equivalent.
+    __asm__ volatile("mcr p15, 0, %0, c7, c10, 5" :: "r"(0) : "memory");
+#else
+    __sync_synchronize();
+#endif
+}
+
+#endif // ! __PI2C_MMIO_H__
@@ -0,0 +1,643 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <sys/eventfd.h>
+
+#include "pi2cslave.h"
+#include "pi2c_sim.h"
+
+#define BSC_REGS  (BSC_LEN / sizeof(uint32_t))
+#define GPIO_REGS (GPIO_LEN / sizeof(uint32_t))
+#define DMA_CHAN_REGS (DMA_CHAN_LEN / sizeof(uint32_t))
+#define DMA_REGS  (DMA_CHANNELS * DMA_CHAN_REGS)
+
+#define DMA_POOL_LEN  (1 << 20)
+#define DMA_POOL_BUS  (0xC0000000) ///< Bus address of the pool, like the uncached alias
+#define DMA_ALIGN     (32)
+#define DMA_BSC_DR    (BCM_BUS_IO_BASE + BSC_OFFSET + BSC_DR * sizeof(uint32_t))
+#define DMA_MAX_WORDS (1 << 16) ///< Words one dma_run() moves, so memory copy loops end
+#define STUCK_TOGGLES (4 * FIFO_LEN) ///< TXE toggles a PI2C_SIM_FAULT_STUCK_TX fault ignores
+
+struct fault_state {
+    unsigned after;    ///< Fire at this many more opportunities, 0 when not scheduled
+    uint32_t rate_ppm; ///< Chance of firing at each opportunity
+    bool active;       ///< Injected and not yet recovered from
+    uint64_t since;    ///< pi2c_now() when injected
+    struct pi2c_sim_fault_stats stats;
+};
+
+struct sim_fifo {
+    uint8_t data[FIFO_LEN];
+    unsigned head;
+    unsigned count;
+};
+
+// The register arrays only give the library distinct addresses to access.
+// BSC state lives in `sim`, GPIO registers are plain memory.
+static uint32_t bsc_regs[BSC_REGS];
+static uint32_t gpio_regs[GPIO_REGS];
+static uint32_t dma_regs[DMA_REGS];
+
+static uint32_t dma_pool[DMA_POOL_LEN / sizeof(uint32_t)];
+static size_t dma_pool_used = 0;
+static unsigned dma_pool_allocs = 0;
+
+static pthread_mutex_t sim_lock = PTHREAD_MUTEX_INITIALIZER;
+static _Atomic uint64_t access_reads;  ///< Kept across pi2c_sim_reset(), benches take differences
+static _Atomic uint64_t access_writes;
+static _Atomic uint64_t access_barriers;
+static int irq_fds[PI2C_SIM_IRQ_LISTENERS] = {-1, -1}; ///< Kept across pi2c_sim_reset()
+static struct {
+    struct sim_fifo rx;
+    struct sim_fifo tx;
+    bool shift_full;    ///< A TX byte has been pulled from the FIFO to send
+    uint8_t shift;
+    bool rx_busy;
+    bool tx_busy;
+    uint32_t rsr;
+    uint32_t cr;
+    uint32_t ris;       ///< Latched interrupts, INT_*
+    bool tx_low;        ///< TX FIFO at or below its IFLS level
+    bool rx_high;       ///< RX FIFO at or above its IFLS level
+    bool irq_line;
+    uint32_t regs[BSC_REGS]; ///< Registers with no side effects
+    bool dma_load[DMA_CHANNELS]; ///< CONBLK_AD was written, load it on activation
+    struct fault_state faults[PI2C_SIM_FAULT_COUNT];
+    unsigned stuck_toggles; ///< TXE toggles left to ignore
+    uint32_t rng;
+} sim;
+
+static bool fifo_push(struct sim_fifo * fifo, uint8_t byte)
+{
+    if (fifo->count == FIFO_LEN) {
+        return false;
+    }
+    fifo->data[(fifo->head + fifo->count) % FIFO_LEN] = byte;
+    fifo->count++;
+    return true;
+}
+
+static bool fifo_pop(struct sim_fifo * fifo, uint8_t * byte)
+{
+    if (fifo->count == 0) {
+        return false;
+    }
+    *byte = fifo->data[fifo->head];
+    fifo->head = (fifo->head + 1) % FIFO_LEN;
+    fifo->count--;
+    return true;
+}
+
+// xorshift32, good enough to pick when faults fire
+static uint32_t sim_random()
+{
+    uint32_t x = sim.rng ? sim.rng : 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sim.rng = x;
+    return x;
+}
+
+// Called at each opportunity for a fault to happen. Returns true if it
+// fires now. Only one fault of each kind is in flight at a time.
+static bool fault_fires(enum pi2c_sim_fault kind)
+{
+    struct fault_state * fault = &sim.faults[kind];
+    if (fault->active) {
+        return false;
+    }
+    bool fire = false;
+    if (fault->after && --fault->after == 0) {
+        fire = true;
+    } else if (fault->rate_ppm && sim_random() % 1000000 < fault->rate_ppm) {
+        fire = true;
+    }
+    if (fire) {
+        fault->active = true;
+        fault->since = pi2c_now();
+        fault->stats.injected++;
+        fault->stats.transactions_hit++;
+    }
+    return fire;
+}
+
+static void fault_recovered(enum pi2c_sim_fault kind)
+{
+    struct fault_state * fault = &sim.faults[kind];
+    if (!fault->active) {
+        return;
+    }
+    uint64_t took = pi2c_now() - fault->since;
+    fault->active = false;
+    fault->stats.recovered++;
+    fault->stats.total_recovery_ns += took;
+    if (took > fault->stats.max_recovery_ns) {
+        fault->stats.max_recovery_ns = took;
+    }
+}
+
+static void fault_lost_bytes(enum pi2c_sim_fault kind, unsigned bytes)
+{
+    if (sim.faults[kind].active) {
+        sim.faults[kind].stats.bytes_lost += bytes;
+    }
+}
+
+// Like the real BSC, keep one byte pulled out of the TX FIFO ready to send
+// whenever TX is enabled.
+static void load_shift()
+{
+    if (!sim.shift_full && (sim.cr & CR_TXE)) {
+        sim.shift_full = fifo_pop(&sim.tx, &sim.shift);
+    }
+}
+
+static uint32_t read_fr()
+{
+    uint32_t fr = (sim.rx.count << FR_RXFLEVEL_OFF) | (sim.tx.count << FR_TXFLEVEL_OFF);
+    fr |= sim.rx_busy ? FR_RXBUSY : 0;
+    fr |= sim.tx_busy ? FR_TXBUSY : 0;
+    fr |= (sim.tx.count == 0) ? FR_TXFE : 0;
+    fr |= (sim.rx.count == FIFO_LEN) ? FR_RXFF : 0;
+    fr |= (sim.tx.count == FIFO_LEN) ? FR_TXFF : 0;
+    fr |= (sim.rx.count == 0) ? FR_RXFE : 0;
+    return fr;
+}
+
+static void write_cr(uint32_t val)
+{
+    uint32_t old = sim.cr;
+    sim.cr = val;
+    if (val & CR_BRK) {
+        // BRK clears RX, but as on the real part, leaves TX alone.
+        memset(&sim.rx, 0, sizeof(sim.rx));
+        sim.rx_busy = false;
+        sim.tx_busy = false;
+        fault_recovered(PI2C_SIM_FAULT_ABORT);
+    }
+    if ((old & CR_TXE) && !(val & CR_TXE)) {
+        if (sim.stuck_toggles == 0 && fault_fires(PI2C_SIM_FAULT_STUCK_TX)) {
+            sim.stuck_toggles = STUCK_TOGGLES;
+        }
+        if (sim.stuck_toggles) {
+            sim.stuck_toggles--;
+        } else {
+            // Undocumented: disabling TX drops the byte loaded to send.
+            sim.shift_full = false;
+        }
+    }
+    load_shift();
+    if (!sim.shift_full && sim.tx.count == 0) {
+        // Flushed, so whatever the master reads next is fresh.
+        fault_recovered(PI2C_SIM_FAULT_NO_READBACK);
+        if (sim.stuck_toggles == 0) {
+            fault_recovered(PI2C_SIM_FAULT_STUCK_TX);
+        }
+    }
+}
+
+// Translate a bus address to the word it names. The BSC data register is
+// handled by the callers, anything else outside the pool is a bus error.
+static uint32_t * dma_word(uint32_t bus)
+{
+    if (bus < DMA_POOL_BUS || bus - DMA_POOL_BUS >= DMA_POOL_LEN || (bus & 3)) {
+        return NULL;
+    }
+    return &dma_pool[(bus - DMA_POOL_BUS) / sizeof(uint32_t)];
+}
+
+// Load the control block at `bus` into a channel, or stop it if bus is 0.
+static void dma_load_cb(uint32_t * chan, uint32_t bus)
+{
+    if (bus == 0) {
+        chan[DMA_CS] = (chan[DMA_CS] & ~DMA_CS_ACTIVE) | DMA_CS_END;
+        return;
+    }
+    uint32_t * cb = dma_word(bus);
+    if (cb == NULL || (bus & (DMA_ALIGN - 1))) {
+        chan[DMA_CS] = (chan[DMA_CS] & ~DMA_CS_ACTIVE) | DMA_CS_ERROR;
+        return;
+    }
+    chan[DMA_CONBLK_AD] = bus;
+    chan[DMA_TI] = cb[0];
+    chan[DMA_SOURCE_AD] = cb[1];
+    chan[DMA_DEST_AD] = cb[2];
+    chan[DMA_TXFR_LEN] = cb[3];
+    chan[DMA_STRIDE] = cb[4];
+    chan[DMA_NEXTCONBK] = cb[5];
+}
+
+static bool dreq_ready(uint32_t ti)
+{
+    if (!(ti & (DMA_TI_SRC_DREQ | DMA_TI_DEST_DREQ))) {
+        return true;
+    }
+    switch ((ti >> DMA_TI_PERMAP_OFF) & 0x1F) {
+        case DMA_DREQ_BSC_TX:
+            return (sim.regs[BSC_DMACR] & DMACR_TXDMAE) && sim.tx.count < FIFO_LEN;
+        case DMA_DREQ_BSC_RX:
+            return (sim.regs[BSC_DMACR] & DMACR_RXDMAE) && sim.rx.count > 0;
+        default:
+            return false;
+    }
+}
+
+// Move one word for a channel. Returns false on a bus error.
+static bool dma_move(uint32_t * chan)
+{
+    uint32_t ti = chan[DMA_TI];
+    uint32_t word = 0;
+    uint8_t byte;
+    if (ti & DMA_TI_SRC_IGNORE) {
+        word = 0;
+    } else if (chan[DMA_SOURCE_AD] == DMA_BSC_DR) {
+        word = fifo_pop(&sim.rx, &byte) ? byte : 0;
+    } else {
+        uint32_t * src = dma_word(chan[DMA_SOURCE_AD]);
+        if (src == NULL) {
+            return false;
+        }
+        word = *src;
+    }
+    if (chan[DMA_DEST_AD] == DMA_BSC_DR) {
+        fifo_push(&sim.tx, word & 0xFF);
+        load_shift();
+    } else {
+        uint32_t * dest = dma_word(chan[DMA_DEST_AD]);
+        if (dest == NULL) {
+            return false;
+        }
+        *dest = word;
+    }
+    chan[DMA_SOURCE_AD] += (ti & DMA_TI_SRC_INC) ? sizeof(uint32_t) : 0;
+    chan[DMA_DEST_AD] += (ti & DMA_TI_DEST_INC) ? sizeof(uint32_t) : 0;
+    chan[DMA_TXFR_LEN] -= sizeof(uint32_t);
+    return true;
+}
+
+// Like the PL011 the BSC interrupts are modeled on, a FIFO crossing its
+// IFLS level latches its interrupt, which stays until cleared through ICR
+// or until the FIFO crosses back.
+static void update_irq()
+{
+    uint32_t ifls = sim.regs[BSC_IFLS];
+    bool tx_low = sim.tx.count <= IFLS_LEVEL_BYTES((ifls & IFLS_TXIFLSEL) >> IFLS_TXIFLSEL_OFF);
+    bool rx_high = sim.rx.count >= IFLS_LEVEL_BYTES((ifls & IFLS_RXIFLSEL) >> IFLS_RXIFLSEL_OFF);
+    if (tx_low && !sim.tx_low) {
+        sim.ris |= INT_TX;
+    } else if (!tx_low) {
+        sim.ris &= ~INT_TX;
+    }
+    if (rx_high && !sim.rx_high) {
+        sim.ris |= INT_RX;
+    } else if (!rx_high) {
+        sim.ris &= ~INT_RX;
+    }
+    if (sim.rsr & RSR_OE) {
+        sim.ris |= INT_OE;
+    }
+    sim.tx_low = tx_low;
+    sim.rx_high = rx_high;
+
+    bool line = (sim.ris & sim.regs[BSC_IMSC]) != 0;
+    for (unsigned i = 0; line && !sim.irq_line && i < PI2C_SIM_IRQ_LISTENERS; i++) {
+        if (irq_fds[i] >= 0) {
+            eventfd_write(irq_fds[i], 1);
+        }
+    }
+    sim.irq_line = line;
+}
+
+// Run every active channel for as long as its DREQ allows, then update the
+// interrupts. Called with the lock held whenever FIFO or DMA state changes.
+static void dma_run()
+{
+    for (unsigned c = 0; c < DMA_CHANNELS; c++) {
+        uint32_t * chan = &dma_regs[c * DMA_CHAN_REGS];
+        for (unsigned n = 0; n < DMA_MAX_WORDS && (chan[DMA_CS] & DMA_CS_ACTIVE); n++) {
+            if (chan[DMA_TXFR_LEN] < sizeof(uint32_t)) {
+                dma_load_cb(chan, chan[DMA_NEXTCONBK]);
+                continue;
+            }
+            if (!dreq_ready(chan[DMA_TI])) {
+                break;
+            }
+            if (!dma_move(chan)) {
+                chan[DMA_CS] = (chan[DMA_CS] & ~DMA_CS_ACTIVE) | DMA_CS_ERROR;
+            }
+        }
+    }
+    update_irq();
+}
+
+static void dma_write_reg(unsigned idx, uint32_t val)
+{
+    unsigned c = idx / DMA_CHAN_REGS;
+    uint32_t * chan = &dma_regs[c * DMA_CHAN_REGS];
+    switch (idx % DMA_CHAN_REGS) {
+        case DMA_CS:
+            if (val & DMA_CS_RESET) {
+                memset(chan, 0, DMA_CHAN_LEN);
+                sim.dma_load[c] = false;
+                break;
+            }
+            if (val & DMA_CS_ABORT) {
+                dma_load_cb(chan, chan[DMA_NEXTCONBK]);
+            }
+            // END, INT and ERROR are cleared by writing 1.
+            chan[DMA_CS] &= ~(val & (DMA_CS_END | DMA_CS_INT | DMA_CS_ERROR));
+            chan[DMA_CS] = (chan[DMA_CS] & ~DMA_CS_ACTIVE) | (val & DMA_CS_ACTIVE);
+            if ((val & DMA_CS_ACTIVE) && sim.dma_load[c]) {
+                sim.dma_load[c] = false;
+                dma_load_cb(chan, chan[DMA_CONBLK_AD]);
+            }
+            break;
+        case DMA_CONBLK_AD:
+            chan[DMA_CONBLK_AD] = val;
+            sim.dma_load[c] = true;
+            break;
+        default:
+            // The rest are loaded from control blocks, not written.
+            break;
+    }
+    dma_run();
+}
+
+void pi2c_sim_map(volatile uint32_t ** bsc, volatile uint32_t ** gpio, volatile uint32_t ** dma)
+{
+    *bsc = bsc_regs;
+    *gpio = gpio_regs;
+    *dma = dma_regs;
+}
+
+int pi2c_sim_irq_fd(unsigned listener)
+{
+    if (listener >= PI2C_SIM_IRQ_LISTENERS) {
+        return -1;
+    }
+    pthread_mutex_lock(&sim_lock);
+    if (irq_fds[listener] < 0) {
+        irq_fds[listener] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return irq_fds[listener];
+}
+
+void pi2c_sim_reset()
+{
+    pthread_mutex_lock(&sim_lock);
+    memset(&sim, 0, sizeof(sim));
+    memset(gpio_regs, 0, sizeof(gpio_regs));
+    memset(dma_regs, 0, sizeof(dma_regs));
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void * pi2c_sim_dma_alloc(size_t len, uint32_t * bus)
+{
+    pthread_mutex_lock(&sim_lock);
+    size_t start = (dma_pool_used + DMA_ALIGN - 1) & ~(size_t)(DMA_ALIGN - 1);
+    void * mem = NULL;
+    if (len <= DMA_POOL_LEN - start) {
+        mem = (uint8_t *)dma_pool + start;
+        *bus = DMA_POOL_BUS + start;
+        dma_pool_used = start + len;
+        dma_pool_allocs++;
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return mem;
+}
+
+void pi2c_sim_dma_free(void * mem)
+{
+    if (mem == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&sim_lock);
+    // A bump allocator, the pool is reclaimed once everything is freed.
+    if (--dma_pool_allocs == 0) {
+        dma_pool_used = 0;
+    }
+    pthread_mutex_unlock(&sim_lock);
+}
+
+uint32_t pi2c_sim_read(volatile uint32_t * reg)
+{
+    uint32_t val;
+    atomic_fetch_add_explicit(&access_reads, 1, memory_order_relaxed);
+    if (reg >= dma_regs && reg < dma_regs + DMA_REGS) {
+        pthread_mutex_lock(&sim_lock);
+        val = *reg;
+        pthread_mutex_unlock(&sim_lock);
+        return val;
+    }
+    if (reg < bsc_regs || reg >= bsc_regs + BSC_REGS) {
+        return *reg;
+    }
+
+    uint8_t byte;
+    pthread_mutex_lock(&sim_lock);
+    switch (reg - bsc_regs) {
+        case BSC_DR:
+            val = fifo_pop(&sim.rx, &byte) ? byte : 0;
+            dma_run();
+            break;
+        case BSC_RSR:
+            val = sim.rsr;
+            break;
+        case BSC_CR:
+            val = sim.cr;
+            break;
+        case BSC_FR:
+            val = read_fr();
+            break;
+        case BSC_RIS:
+            val = sim.ris;
+            break;
+        case BSC_MIS:
+            val = sim.ris & sim.regs[BSC_IMSC];
+            break;
+        default:
+            val = sim.regs[reg - bsc_regs];
+            break;
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return val;
+}
+
+void pi2c_sim_write(volatile uint32_t * reg, uint32_t val)
+{
+    atomic_fetch_add_explicit(&access_writes, 1, memory_order_relaxed);
+    if (reg >= dma_regs && reg < dma_regs + DMA_REGS) {
+        pthread_mutex_lock(&sim_lock);
+        dma_write_reg(reg - dma_regs, val);
+        pthread_mutex_unlock(&sim_lock);
+        return;
+    }
+    if (reg < bsc_regs || reg >= bsc_regs + BSC_REGS) {
+        *reg = val;
+        return;
+    }
+
+    pthread_mutex_lock(&sim_lock);
+    switch (reg - bsc_regs) {
+        case BSC_DR:
+            fifo_push(&sim.tx, val & 0xFF);
+            load_shift();
+            break;
+        case BSC_RSR:
+            // Error bits are cleared by writing them as 0.
+            sim.rsr &= val;
+            if (!(sim.rsr & RSR_OE)) {
+                fault_recovered(PI2C_SIM_FAULT_RX_OVERRUN);
+            }
+            if (!(sim.rsr & RSR_UE)) {
+                fault_recovered(PI2C_SIM_FAULT_TX_UNDERRUN);
+            }
+            break;
+        case BSC_CR:
+            write_cr(val);
+            break;
+        case BSC_FR:
+        case BSC_RIS:
+        case BSC_MIS:
+            break;
+        case BSC_ICR:
+            sim.ris &= ~val;
+            break;
+        default:
+            sim.regs[reg - bsc_regs] = val;
+            break;
+    }
+    dma_run();
+    pthread_mutex_unlock(&sim_lock);
+}
+
+bool pi2c_sim_master_start(uint8_t addr, bool read)
+{
+    pthread_mutex_lock(&sim_lock);
+    bool ack = (sim.cr & CR_EN) && (sim.cr & CR_I2C) &&
+               addr == (sim.regs[BSC_SLV] & 0x7F);
+    // A new start condition gets the slave out of an aborted transaction.
+    fault_recovered(PI2C_SIM_FAULT_ABORT);
+    for (int kind = 0; kind < PI2C_SIM_FAULT_COUNT; kind++) {
+        if (sim.faults[kind].active) {
+            sim.faults[kind].stats.transactions_hit++;
+        }
+    }
+    if (ack && read && fault_fires(PI2C_SIM_FAULT_NO_READBACK)) {
+        // The master went away instead of reading back.
+        ack = false;
+    }
+    if (ack) {
+        sim.rx_busy = !read;
+        sim.tx_busy = read;
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return ack;
+}
+
+bool pi2c_sim_master_write_byte(uint8_t byte)
+{
+    pthread_mutex_lock(&sim_lock);
+    bool ack = false;
+    if (sim.rx_busy && (sim.cr & CR_RXE)) {
+        if (fault_fires(PI2C_SIM_FAULT_ABORT)) {
+            // The master stopped clocking mid byte, the bus stays busy.
+            fault_lost_bytes(PI2C_SIM_FAULT_ABORT, 1);
+        } else {
+            bool overrun = fault_fires(PI2C_SIM_FAULT_RX_OVERRUN);
+            ack = !overrun && fifo_push(&sim.rx, byte);
+            if (!ack) {
+                sim.rsr |= RSR_OE;
+                fault_lost_bytes(PI2C_SIM_FAULT_RX_OVERRUN, 1);
+            }
+        }
+        dma_run();
+    }
+    pthread_mutex_unlock(&sim_lock);
+    return ack;
+}
+
+uint8_t pi2c_sim_master_read_byte(bool * underrun)
+{
+    pthread_mutex_lock(&sim_lock);
+    uint8_t byte = 0;
+    bool empty = !sim.shift_full;
+    if (sim.tx_busy && fault_fires(PI2C_SIM_FAULT_ABORT)) {
+        // The master stopped clocking mid byte, the bus stays busy.
+        fault_lost_bytes(PI2C_SIM_FAULT_ABORT, 1);
+        empty = true;
+    } else if (empty || fault_fires(PI2C_SIM_FAULT_TX_UNDERRUN)) {
+        // An injected underrun loses the byte in the shift register.
+        empty = true;
+        sim.shift_full = false;
+        sim.rsr |= RSR_UE;
+        fault_lost_bytes(PI2C_SIM_FAULT_TX_UNDERRUN, 1);
+    } else {
+        byte = sim.shift;
+        fault_lost_bytes(PI2C_SIM_FAULT_STUCK_TX, 1);
+        sim.shift_full = false;
+    }
+    load_shift();
+    dma_run();
+    pthread_mutex_unlock(&sim_lock);
+    if (underrun) {
+        *underrun = empty;
+    }
+    return byte;
+}
+
+void pi2c_sim_master_stop()
+{
+    pthread_mutex_lock(&sim_lock);
+    // After an abort there is no stop condition on the bus.
+    if (!sim.faults[PI2C_SIM_FAULT_ABORT].active) {
+        sim.rx_busy = false;
+        sim.tx_busy = false;
+    }
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void pi2c_sim_schedule_fault(enum pi2c_sim_fault kind, unsigned after)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim.faults[kind].after = after;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void pi2c_sim_random_faults(enum pi2c_sim_fault kind, uint32_t rate_ppm, uint32_t seed)
+{
+    pthread_mutex_lock(&sim_lock);
+    sim.faults[kind].rate_ppm = rate_ppm;
+    if (seed) {
+        sim.rng = seed;
+    }
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void pi2c_sim_get_fault_stats(enum pi2c_sim_fault kind, struct pi2c_sim_fault_stats * out)
+{
+    pthread_mutex_lock(&sim_lock);
+    *out = sim.faults[kind].stats;
+    pthread_mutex_unlock(&sim_lock);
+}
+
+void pi2c_sim_barrier()
+{
+    atomic_fetch_add_explicit(&access_barriers, 1, memory_order_relaxed);
+    __sync_synchronize();
+}
+
+void pi2c_sim_get_access_stats(struct pi2c_sim_access_stats * out)
+{
+    out->reads = atomic_load_explicit(&access_reads, memory_order_relaxed);
+    out->writes = atomic_load_explicit(&access_writes, memory_order_relaxed);
+    out->barriers = atomic_load_explicit(&access_barriers, memory_order_relaxed);
+}
@@ -0,0 +1,198 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/**
+ * @file pi2c_sim.h
+ * @brief Simulated BSC and GPIO peripherals for off-target builds
+ *
+ * When the library is built with PI2C_SIM defined, init_bcm_reg_mem() maps
+ * these simulated peripherals instead of /dev/mem, and every register access
+ * goes through pi2c_sim_read() and pi2c_sim_write(). The BSC model includes
+ * the 16 byte FIFOs, the busy and level flags, the RSR error bits and the TX
+ * enable toggle behavior the library relies on to flush the TX FIFO. A DMA
+ * controller model runs control block chains, paced by the BSC DREQs, as
+ * the FIFOs fill and drain.
+ *
+ * A test harness plays the I2C master with the pi2c_sim_master_*()
+ * functions, typically from its own thread, pacing bytes as it likes.
+ *
+ * Faults can be injected on a schedule or at random, and the simulator
+ * measures how long the library takes to get back to a clean state.
+ */
+#ifndef __PI2C_SIM_H__
+#define __PI2C_SIM_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/**
+ * @brief Faults the simulator can inject
+ */
+enum pi2c_sim_fault {
+    /// A master write byte is lost and RSR_OE set. Opportunity: each master
+    /// write byte. Recovered when the library clears RSR_OE.
+    PI2C_SIM_FAULT_RX_OVERRUN,
+    /// The byte about to be sent is lost and RSR_UE set. Opportunity: each
+    /// master read byte. Recovered when the library clears RSR_UE.
+    PI2C_SIM_FAULT_TX_UNDERRUN,
+    /// The master stops clocking mid byte, leaving the bus busy, and sends
+    /// no stop condition. Opportunity: each master byte. Recovered by
+    /// CR_BRK or the master's next start.
+    PI2C_SIM_FAULT_ABORT,
+    /// The master writes but never reads back: pi2c_sim_master_start() for
+    /// the read returns false. Opportunity: each master read start.
+    /// Recovered when the TX FIFO is next flushed.
+    PI2C_SIM_FAULT_NO_READBACK,
+    /// The TX FIFO won't drain: a number of TXE toggles drop nothing.
+    /// Opportunity: each TXE toggle. Recovered when the TX FIFO is next
+    /// empty after that.
+    PI2C_SIM_FAULT_STUCK_TX,
+    PI2C_SIM_FAULT_COUNT,
+};
+
+/**
+ * @brief What the simulator saw of one kind of fault
+ */
+struct pi2c_sim_fault_stats {
+    uint32_t injected;          ///< Faults injected
+    uint32_t recovered;         ///< Faults the library got back from
+    uint64_t total_recovery_ns; ///< Sum of the recovery times
+    uint64_t max_recovery_ns;   ///< Longest recovery time
+    uint32_t bytes_lost;        ///< Bytes dropped, garbled or stale while the fault was active
+    uint32_t transactions_hit;  ///< Master transactions started while the fault was active
+};
+
+/**
+ * @brief Get the simulated register blocks
+ *
+ * @param bsc Set to the simulated BSC registers
+ * @param gpio Set to the simulated GPIO registers
+ * @param dma Set to the simulated DMA controller registers
+ */
+void pi2c_sim_map(volatile uint32_t ** bsc, volatile uint32_t ** gpio, volatile uint32_t ** dma);
+
+/**
+ * @brief Allocate memory the simulated DMA controller can reach
+ *
+ * @param len Bytes to allocate
+ * @param bus Set to the bus address of the memory
+ *
+ * @return The memory, 32 byte aligned, or NULL if the pool is exhausted
+ */
+void * pi2c_sim_dma_alloc(size_t len, uint32_t * bus);
+/**
+ * @brief Free memory from pi2c_sim_dma_alloc()
+ */
+void pi2c_sim_dma_free(void * mem);
+
+#define PI2C_SIM_IRQ_LISTENERS (2) ///< Eventfds pi2c_sim_irq_fd() can hand out
+
+/**
+ * @brief Get an eventfd standing in for the BSC slave interrupt
+ *
+ * Every listener's eventfd is written each time the interrupt line,
+ * RIS & IMSC, goes from low to high, like each open file of a UIO device
+ * sees every interrupt. The library uses these in place of a UIO device,
+ * see bsc_i2c_enable_tx_irq().
+ *
+ * @param listener Which eventfd, below PI2C_SIM_IRQ_LISTENERS
+ *
+ * @return The eventfd, or -1 if it can't be created
+ */
+int pi2c_sim_irq_fd(unsigned listener);
+
+/**
+ * @brief Reset the simulated peripherals to their power on state
+ */
+void pi2c_sim_reset();
+
+/**
+ * @brief Simulated register read, see pi2c_mmio.h
+ */
+uint32_t pi2c_sim_read(volatile uint32_t * reg);
+/**
+ * @brief Simulated register write, see pi2c_mmio.h
+ */
+void pi2c_sim_write(volatile uint32_t * reg, uint32_t val);
+/**
+ * @brief Simulated barrier, see pi2c_mmio.h
+ *
+ * Orders memory like a real barrier, and counts it.
+ */
+void pi2c_sim_barrier();
+
+/**
+ * @brief Master addresses the slave, starting a transaction
+ *
+ * @param addr 7 bit address the master sends
+ * @param read true for a master read, false for a master write
+ *
+ * @return true if the slave ACKed its address, false otherwise
+ */
+bool pi2c_sim_master_start(uint8_t addr, bool read);
+/**
+ * @brief Master sends one byte during a write
+ *
+ * @return true if the byte was ACKed, false if it was lost to an RX overrun
+ *         or the slave is not receiving
+ */
+bool pi2c_sim_master_write_byte(uint8_t byte);
+/**
+ * @brief Master clocks in one byte during a read
+ *
+ * @param underrun If not NULL, set to true when the TX FIFO was empty. The
+ *                 byte returned is then 0.
+ *
+ * @return The byte the slave sent
+ */
+uint8_t pi2c_sim_master_read_byte(bool * underrun);
+/**
+ * @brief Master ends the transaction
+ */
+void pi2c_sim_master_stop();
+
+/**
+ * @brief Inject a fault at a later opportunity
+ *
+ * @param kind The fault
+ * @param after Inject it at this many opportunities from now, 1 for the
+ *              next one. 0 cancels a scheduled fault.
+ */
+void pi2c_sim_schedule_fault(enum pi2c_sim_fault kind, unsigned after);
+/**
+ * @brief Inject a fault at random opportunities
+ *
+ * @param kind The fault
+ * @param rate_ppm Chance, in parts per million, of injecting it at each
+ *                 opportunity. 0 stops random injection.
+ * @param seed Seed for the random generator shared by all faults, 0 to
+ *             leave it as it is
+ */
+void pi2c_sim_random_faults(enum pi2c_sim_fault kind, uint32_t rate_ppm, uint32_t seed);
+/**
+ * @brief Get the injection and recovery statistics of a fault
+ *
+ * Statistics, schedules and rates are cleared by pi2c_sim_reset().
+ */
+void pi2c_sim_get_fault_stats(enum pi2c_sim_fault kind, struct pi2c_sim_fault_stats * out);
+
+/**
+ * @brief Register accesses the library made through the simulator
+ */
+struct pi2c_sim_access_stats {
+    uint64_t reads;    ///< pi2c_sim_read() calls
+    uint64_t writes;   ///< pi2c_sim_write() calls
+    uint64_t barriers; ///< pi2c_sim_barrier() calls
+};
+
+/**
+ * @brief Get the register accesses made since startup
+ *
+ * Benches compare two snapshots to count the accesses of an operation.
+ * Accesses from every thread are counted.
+ */
+void pi2c_sim_get_access_stats(struct pi2c_sim_access_stats * out);
+
+#endif // ! __PI2C_SIM_H__
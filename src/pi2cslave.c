@@ -4,83 +4,812 @@
  */
 #define _GNU_SOURCE
 
+#include <errno.h>
+#include <poll.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <termios.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/eventfd.h>
 
 #include "bcm_low_level.h"
+#include "pi2c_mmio.h"
+#ifdef PI2C_SIM
+#include "pi2c_sim.h"
+#endif
 
+#define WRITE_USLEEP_INTERVAL (25)   ///< Default TX FIFO service period
+#define WRITE_USLEEP_MIN      (5)
+#define WRITE_USLEEP_MAX      (1000)
+#define BYTE_TIME_MIN_NS      (1000)    ///< ~9 MHz SCL, faster is not plausible
+#define BYTE_TIME_MAX_NS      (1000000) ///< ~9 kHz SCL, slower is not plausible
+#define BYTE_TIME_EWMA_SHIFT  (3)
+#define WRITE_TUNE_BYTES      (1)
+#define CALIBRATE_READS       (1000)
+#define CALIBRATE_SLEEPS      (20)
+#define CLOCK_NS_MAX_FOR_RX   (1000) ///< Above this, timestamps are too costly to take per RX poll
+#define PROFILE_VERSION       (1)
+#define CLOCK_SHIFT           (24)
+
+// The ARM generic timer is readable from userspace on ARMv7 and later.
+#if defined(__aarch64__) || (defined(__arm__) && __ARM_ARCH >= 7)
+#define HAVE_CNTVCT
+#endif
+#define IDLE_ACTIVITY_MASK    (FR_RXFLEVEL | FR_TXFLEVEL | FR_RXBUSY | FR_TXBUSY)
+#define IDLE_FIFO_MARGIN      (2)    ///< Bytes of FIFO kept in reserve when backed off
+#define IDLE_FAST_BYTE_NS     (9000) ///< Byte time of a 1 MHz master, assumed until measured
+#define DEV_IDLE_WAIT_US      (100000) ///< Longest bsc_i2c_idle_wait() with the slave device
+#define EVENT_IRQ_WAIT_US     (10000)  ///< Longest idle event thread sleep with the RX interrupt
+#define BSC_DR_BUS            (BCM_BUS_IO_BASE + BSC_OFFSET + BSC_DR * sizeof(uint32_t))
+#define MBOX_PROPERTY         _IOWR(100, 0, char *) ///< /dev/vcio property call
+#define MBOX_MEM_ALLOC        (0x3000C)
+#define MBOX_MEM_LOCK         (0x3000D)
+#define MBOX_MEM_UNLOCK       (0x3000E)
+#define MBOX_MEM_RELEASE      (0x3000F)
+#define MBOX_MEM_DIRECT       (0x4)    ///< Uncached, through the 0xC0000000 alias
+#define MBOX_MEM_L1_NONALLOC  (0xC)    ///< Through the 0x40000000 alias, for the BCM2835
+#define BUS_TO_PHYS(bus)      ((bus) & ~0xC0000000)
+#define FLUSH_MAX_TOGGLES     (FIFO_LEN + 2) ///< A full FIFO plus the shift register, plus one spare
+#define ARENA_ALIGN           (64)  ///< Cache line, so buffers of different threads don't share one
+#define HEAT_TIME_SHIFT       (20)  ///< Heat map times in units of ~1 ms, so a page's counters fit in 16 bytes
+#define BSC_RD(reg)           mmio_read(&bsc[reg])
+#define BSC_WR(reg, val)      mmio_write(&bsc[reg], (val))
+#define GPIO_RD(reg)          mmio_read(&gpio_reg[reg])
+#define GPIO_WR(reg, val)     mmio_write(&gpio_reg[reg], (val))
+#define DMA_RD(chan, reg)     mmio_read(&dma_reg[(chan) * DMA_CHAN_LEN / sizeof(uint32_t) + (reg)])
+#define DMA_WR(chan, reg, val) mmio_write(&dma_reg[(chan) * DMA_CHAN_LEN / sizeof(uint32_t) + (reg)], (val))
+#define GET_FR_RXFLEVEL()     ((BSC_RD(BSC_FR) & FR_RXFLEVEL) >> FR_RXFLEVEL_OFF)
+#define GET_FR_TXFLEVEL()     ((BSC_RD(BSC_FR) & FR_TXFLEVEL) >> FR_TXFLEVEL_OFF)
+#define RX_EMPTY()            (BSC_RD(BSC_FR) & FR_RXFE)
+#define RX_BUSY()             (BSC_RD(BSC_FR) & FR_RXBUSY)
+#define TX_BUSY()             (BSC_RD(BSC_FR) & FR_TXBUSY)
+
+// Metrics have a single writer, the service thread, so no read-modify-write
+// is needed. Readers get whole values, see bsc_i2c_get_metrics().
+#define METRIC_ADD(m, n)      atomic_store_explicit(&(m), atomic_load_explicit(&(m), memory_order_relaxed) + (n), \
+                                                    memory_order_relaxed)
+#define METRIC_SET(m, v)      atomic_store_explicit(&(m), (v), memory_order_relaxed)
+#define METRIC_GET(m)         atomic_load_explicit(&(m), memory_order_relaxed)
+#define TAG                   "pi2cslave"
+
+#ifndef PI2C_SIM
 static int mem_fd = -1;
+// Page mappings of the peripherals we use, see map_peripherals()
+static void * periph_maps[4] = {NULL};
+static size_t periph_map_lens[4] = {0};
+#endif
 static volatile uint32_t * bsc = NULL;
 static volatile uint32_t * gpio_reg = NULL;
+static volatile uint32_t * systimer = NULL;
+static volatile uint32_t * dma_reg = NULL;
+static int dev_fd = -1; ///< Kernel slave device, see init_bsc_i2c_dev()
+// Timestamp source, see pi2c_now()
+static enum pi2c_clock clock_source = PI2C_CLOCK_MONOTONIC;
+static uint64_t clock_epoch = 0;  ///< Counter value pi2c_now() counts from
+#ifdef HAVE_CNTVCT
+static uint32_t clock_mult = 0;   ///< Counter ticks to ns, scaled by 2^CLOCK_SHIFT
+#endif
+// SoC whose peripherals are mapped. Only used to pick addresses at init.
+static struct bcm_soc_info soc_info = {BCM_SOC_UNKNOWN, "unknown", BCM_IO_BASE};
+// Last value written to BSC_CR, so toggling TXE needs no read back
+static uint32_t cr_shadow = 0;
+static uint32_t slv_shadow = 0; ///< BSC_SLV as programmed, for watchdog resets
+static uint32_t ifls_shadow = 0;
+static uint32_t imsc_shadow = 0xf;
+static int irq_fd = -1;         ///< BSC interrupt source, see bsc_i2c_enable_tx_irq()
+static unsigned irq_tx_level = 0; ///< Bytes in the TX FIFO when the TX interrupt fires
+static size_t irq_count_len = 0;  ///< Size of the interrupt count a read of irq_fd returns
+static atomic_int event_irq_fd = -1; ///< The event thread's own listener on the interrupt
 
-#define WRITE_USLEEP_INTERVAL (25)
-#define GET_FR_RXFLEVEL()     ((bsc[BSC_FR] & FR_RXFLEVEL) >> FR_RXFLEVEL_OFF)
-#define GET_FR_TXFLEVEL()     ((bsc[BSC_FR] & FR_TXFLEVEL) >> FR_TXFLEVEL_OFF)
-#define RX_EMPTY()            (bsc[BSC_FR] & FR_RXFE)
-#define RX_BUSY()             (bsc[BSC_FR] & FR_RXBUSY)
-#define TX_BUSY()             (bsc[BSC_FR] & FR_RXBUSY)
+// Health counters. Only written by the thread servicing the FIFOs, and read
+// from any thread through the bsc_i2c_get_*() snapshots, so they are
+// atomics updated with METRIC_ADD() and METRIC_SET().
+static struct {
+    atomic_uint wakeups;
+    atomic_uint interrupts;
+    atomic_uint bytes;
+} tx_stats;
+static struct {
+    atomic_uint underruns;
+    atomic_uint overruns;
+    atomic_uint max_turnaround_us;
+    atomic_uint max_service_gap_us;
+} diag;
+static struct {
+    atomic_uint write_calls;
+    atomic_uint master_reads;
+    atomic_uint rx_bytes;
+    atomic_uint flush_toggles;
+    atomic_uint flush_giveups;
+    atomic_uint turnaround_sum_us;
+    atomic_uint turnaround[BSC_TURNAROUND_BUCKETS];
+} metrics;
+static uint64_t init_time_us = 0;
+// Diagnostic register window, served by bsc_i2c_write()
+static bool diag_enabled = false;
+static addr_t diag_base = 0;
+static uint8_t * diag_image = NULL; ///< BSC_DIAG_LEN bytes from the arena
+// Bus rate estimate and the TX FIFO service period derived from it
+static uint32_t byte_time_ns = 0;
+static bool auto_tune = false;
+static unsigned write_sleep_us = WRITE_USLEEP_INTERVAL;
+// Measured costs of the platform. All zero means uncalibrated.
+static struct bsc_i2c_profile profile;
+// Idle back off governor
+static bool idle_backoff = false;
+static unsigned idle_ceiling_us = 0; // 0 means derive from the bus rate
+struct idle_state {
+    uint32_t fr;  ///< FR activity bits at the last poll
+    unsigned us;  ///< Current wait, 0 means hot polling
+};
+static struct idle_state service_idle; ///< Governor for bsc_i2c_write() and bsc_i2c_idle_wait()
+// Service loop variant for the enabled features, see select_loops()
+static bool timing_enabled = true;
+// Cooperative stop token, checked once per FIFO burst
+static atomic_bool stop_requested = false;
+static int dev_stop_fd = -1; ///< Readable while a stop is requested, wakes slave device waits
+static bool dev_has_outq = false;  ///< The slave device reports its queued bytes with TIOCOUTQ
+static bool dev_has_flush = false; ///< The slave device drops its queued bytes on tcflush(TCOFLUSH)
+// Event notification for event loops
+static int event_fd = -1;
+static atomic_uint pending_events = 0;
+static atomic_int last_tx_count = 0;
+static pthread_t event_thread;
+static atomic_bool event_thread_run = false;
+/**
+ * @brief Memory the DMA controller can reach
+ */
+struct dma_mem {
+    void * virt;
+    uint32_t bus;    ///< Address of virt as the DMA controller sees it
+    size_t len;
+    uint32_t handle; ///< VideoCore allocation handle
+};
 
-#define TAG                   "pi2cslave"
+// Control blocks of DMA mode, at the start of dma_mem
+enum {
+    DMA_CB_RX,      ///< RX FIFO to the ring, linked to itself
+    DMA_CB_TX_HEAD, ///< Image from the read's address to the end
+    DMA_CB_TX_WRAP, ///< Whole image, linked to itself
+    DMA_CB_COUNT,
+};
+
+static bool dma_enabled = false;
+static struct bsc_i2c_dma_config dma_cfg;
+static struct dma_mem dma_mem;
+static volatile struct bcm_dma_cb * dma_cbs = NULL;
+static volatile uint32_t * dma_image = NULL; ///< One word per image byte, as DR takes them
+static volatile uint32_t * dma_ring = NULL;  ///< One word per RX byte, as DR gives them
+static uint32_t dma_image_bus = 0;
+static uint32_t dma_ring_bus = 0;
+static size_t dma_rx_tail = 0;
+
+static uint8_t * arena = NULL;   ///< Every internal buffer comes from here
+static size_t arena_len = 0;
+static size_t arena_used = 0;
+
+#ifdef PI2C_ALLOC_GUARD
+// Nonzero while this thread is in the service path, or in a tx_callback
+// called from it, see pi2c_alloc_guard.c
+__thread unsigned pi2c_in_service = 0;
+__thread unsigned pi2c_in_callback = 0;
+#define SERVICE_ENTER()       (pi2c_in_service++)
+#define SERVICE_EXIT()        (pi2c_in_service--)
+#define CALLBACK_ENTER()      (pi2c_in_callback++)
+#define CALLBACK_EXIT()       (pi2c_in_callback--)
+#else
+#define SERVICE_ENTER()
+#define SERVICE_EXIT()
+#define CALLBACK_ENTER()
+#define CALLBACK_EXIT()
+#endif
+
+static inline bool call_tx(tx_callback cb, addr_t addr, uint8_t * out)
+{
+    CALLBACK_ENTER();
+    bool ret = cb(addr, out);
+    CALLBACK_EXIT();
+    return ret;
+}
+
+static uint64_t rx_sample_time = 0;
+static bool rx_sample_busy = false;
+
+static bool rx_resync = false;        ///< Discarding the rest of a corrupt master write
+static uint64_t rx_resync_start = 0;
+static unsigned rx_resync_count = 0;  ///< Bumped each time a resync starts
+static struct {
+    atomic_uint corrupt;
+    atomic_uint bytes_discarded;
+    atomic_uint last_latency_us;
+    atomic_uint max_latency_us;
+} resync;
+static size_t rx_txn_len = 0;         ///< Bytes bsc_i2c_read_transaction() has collected
+
+static uint32_t watchdog_us = 0;      ///< 0 when the watchdog is disabled
+static uint64_t wd_key = 0;           ///< Progress and FIFO state when the stall timer started
+static uint64_t wd_stall_start = 0;   ///< 0 while not stalled
+static struct {
+    atomic_uint resets;
+    atomic_uint last_outage_us;
+    atomic_uint max_outage_us;
+} watchdog;
+
+static size_t tap_cfg_len = BSC_TAP_DEFAULT_LEN;       ///< From init_bsc_i2c_arena()
+static size_t tap_cfg_record = BSC_TAP_DEFAULT_RECORD;
+static bool tap_enabled = false;
+static uint8_t * tap_ring = NULL;     ///< From the arena, tap_len bytes
+static uint32_t tap_len = 0;          ///< A power of 2, so positions may wrap around 2^32
+static uint32_t tap_record_max = 0;
+static uint32_t tap_slot = 0;         ///< Room reserved for a record, header included
+static atomic_uint tap_head = 0;      ///< Position after the last record written
+static atomic_uint tap_claim = 0;     ///< Position the writer may write up to
+static bool tap_open_rec = false;     ///< tap_rec is being written
+static uint32_t tap_pos = 0;          ///< Position of tap_rec
+static uint8_t * tap_data = NULL;     ///< Data of tap_rec, in the ring
+static struct bsc_i2c_tap_record tap_rec;
+
+// Heat map counters. The service thread counts reads, any thread may count
+// writes and any thread may report, so they are atomics. Writes take a
+// read-modify-write, having more than one writer.
+struct heat_counters {
+    _Atomic uint32_t read_starts;
+    _Atomic uint32_t bytes_read;
+    _Atomic uint32_t writes;
+    _Atomic uint32_t last_access; ///< pi2c_now() >> HEAT_TIME_SHIFT
+};
+static size_t heat_cfg_page = BSC_HEAT_DEFAULT_PAGE; ///< From init_bsc_i2c_arena()
+static atomic_bool heat_enabled = false;
+static struct heat_counters * heat = NULL; ///< One per page, from the arena
+static unsigned heat_shift = 0;            ///< log2 of the page size
+
+static void select_loops();
+
+static uint64_t monotonic_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(__aarch64__)
+static uint64_t read_cntvct()
+{
+    uint64_t val;
+    __asm__ volatile("isb; mrs %0, cntvct_el0" : "=r"(val) :: "memory");
+    return val;
+}
+
+static uint32_t read_cntfrq()
+{
+    uint64_t val;
+    __asm__ volatile("mrs %0, cntfrq_el0" : "=r"(val));
+    return val;
+}
+#elif defined(HAVE_CNTVCT)
+static uint64_t read_cntvct()
+{
+    uint64_t val;
+    __asm__ volatile("isb; mrrc p15, 1, %Q0, %R0, c14" : "=r"(val) :: "memory");
+    return val;
+}
+
+static uint32_t read_cntfrq()
+{
+    uint32_t val;
+    __asm__ volatile("mrc p15, 0, %0, c14, c0, 0" : "=r"(val));
+    return val;
+}
+#endif
+
+#ifdef HAVE_CNTVCT
+// Convert a tick count to ns without overflowing for decades, and without a
+// 64 bit division, which is a slow library call on 32 bit ARM.
+static uint64_t ticks_to_ns(uint64_t ticks)
+{
+    uint64_t hi = (ticks >> 32) * clock_mult;
+    uint64_t lo = (ticks & 0xFFFFFFFF) * clock_mult;
+    return (hi << (32 - CLOCK_SHIFT)) + (lo >> CLOCK_SHIFT);
+}
+#endif
+
+// The BCM system timer's free running 1 MHz counter. The high word is read
+// on both sides of the low word to catch the low word wrapping.
+static uint64_t read_systimer()
+{
+    uint32_t hi = mmio_read(&systimer[ST_CHI]);
+    uint32_t lo = mmio_read(&systimer[ST_CLO]);
+    uint32_t hi2 = mmio_read(&systimer[ST_CHI]);
+    if (hi != hi2) {
+        lo = mmio_read(&systimer[ST_CLO]);
+    }
+    return ((uint64_t)hi2 << 32) | lo;
+}
+
+uint64_t pi2c_now()
+{
+    switch (clock_source) {
+#ifdef HAVE_CNTVCT
+        case PI2C_CLOCK_CNTVCT:
+            return ticks_to_ns(read_cntvct() - clock_epoch);
+#endif
+        case PI2C_CLOCK_SYSTIMER:
+            return (read_systimer() - clock_epoch) * 1000;
+        default:
+            return monotonic_ns();
+    }
+}
+
+enum pi2c_clock pi2c_clock_source()
+{
+    return clock_source;
+}
+
+bool pi2c_set_clock_source(enum pi2c_clock source)
+{
+    switch (source) {
+        case PI2C_CLOCK_MONOTONIC:
+            break;
+        case PI2C_CLOCK_SYSTIMER:
+            if (systimer == NULL) {
+                return false;
+            }
+            clock_epoch = read_systimer();
+            break;
+        case PI2C_CLOCK_CNTVCT:
+#ifdef HAVE_CNTVCT
+        {
+            uint32_t freq = read_cntfrq();
+            if (freq == 0) {
+                return false;
+            }
+            clock_mult = (1000000000ULL << CLOCK_SHIFT) / freq;
+            clock_epoch = read_cntvct();
+            break;
+        }
+#else
+            return false;
+#endif
+        default:
+            return false;
+    }
+    clock_source = source;
+    return true;
+}
+
+static uint64_t now_us()
+{
+    return pi2c_now() / 1000;
+}
+
+static const struct bcm_soc_info known_socs[] = {
+    {BCM_SOC_2835, "bcm2835", BCM2835_IO_BASE},
+    {BCM_SOC_2836, "bcm2836", BCM2836_IO_BASE},
+    {BCM_SOC_2837, "bcm2837", BCM2837_IO_BASE},
+    {BCM_SOC_2711, "bcm2711", BCM2711_IO_BASE},
+};
+
+// Read a whole (small) device tree property. Returns bytes read or -1.
+static ssize_t read_dt_prop(const char * dt_dir, const char * prop, uint8_t * buf, size_t len)
+{
+    char path[256];
+    snprintf(path, sizeof(path), "%s/%s", dt_dir, prop);
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    ssize_t got = read(fd, buf, len);
+    close(fd);
+    return got;
+}
+
+static uint32_t be32(const uint8_t * buf)
+{
+    return ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+}
+
+bool bcm_detect_soc(const char * dt_dir, struct bcm_soc_info * out)
+{
+    // soc/ranges starts with the bus address of the peripherals, then their
+    // physical address. That is one cell on older SoCs, and two cells with
+    // the upper one zero on the BCM2711.
+    uint8_t ranges[12];
+    ssize_t got = read_dt_prop(dt_dir, "soc/ranges", ranges, sizeof(ranges));
+    if (got < 8) {
+        return false;
+    }
+    uint32_t io_base = be32(ranges + 4);
+    if (io_base == 0 && got >= 12) {
+        io_base = be32(ranges + 8);
+    }
+
+    // compatible is a list of NUL separated strings, such as
+    // "raspberrypi,4-model-b\0brcm,bcm2711\0"
+    char compat[256];
+    got = read_dt_prop(dt_dir, "compatible", (uint8_t *)compat, sizeof(compat) - 1);
+    compat[(got < 0) ? 0 : got] = '\0';
+    const struct bcm_soc_info * match = NULL;
+    for (ssize_t i = 0; i < got; i += strlen(compat + i) + 1) {
+        for (size_t s = 0; s < sizeof(known_socs) / sizeof(known_socs[0]); s++) {
+            const char * name = compat + i;
+            if (strncmp(name, "brcm,", 5) == 0 && strcmp(name + 5, known_socs[s].name) == 0) {
+                match = &known_socs[s];
+            }
+        }
+    }
+    if (match == NULL) {
+        for (size_t s = 0; s < sizeof(known_socs) / sizeof(known_socs[0]); s++) {
+            if (known_socs[s].io_base == io_base) {
+                match = &known_socs[s];
+            }
+        }
+    }
+
+    if (match) {
+        *out = *match;
+    } else {
+        out->soc = BCM_SOC_UNKNOWN;
+        out->name = "unknown";
+    }
+    // Trust the device tree over our table for where things actually are.
+    out->io_base = io_base;
+    return true;
+}
+
+const struct bcm_soc_info * bcm_get_soc()
+{
+    return &soc_info;
+}
+
+#ifndef PI2C_SIM
+// Map the pages holding one peripheral block, returning its registers.
+static volatile uint32_t * map_block(unsigned idx, uint32_t io_base, size_t offset, size_t len)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t start = offset & ~(page - 1);
+    size_t end = (offset + len + page - 1) & ~(page - 1);
+
+    void * map = mmap(0, end - start, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_LOCKED,
+                      mem_fd, io_base + start);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    periph_maps[idx] = map;
+    periph_map_lens[idx] = end - start;
+    return (volatile uint32_t *)((uint8_t *)map + offset - start);
+}
+
+static void unmap_peripherals()
+{
+    for (unsigned i = 0; i < sizeof(periph_maps) / sizeof(periph_maps[0]); i++) {
+        if (periph_maps[i] != NULL) {
+            munmap(periph_maps[i], periph_map_lens[i]);
+            periph_maps[i] = NULL;
+        }
+    }
+}
+
+// Map only the pages of the blocks we use, one mapping each. A single
+// window from the system timer to the BSC block would be about 2.1 MB,
+// taking in the interrupt controller, the mailboxes, the power manager and
+// watchdog, the clock manager, UART, SPI and PWM, where a stray pointer
+// write could hit them. Separate mappings cost three more mmap() calls at
+// init and nothing after: every access is the same load or store through
+// the same few pages, so TLB use doesn't change either.
+static bool map_peripherals(uint32_t io_base)
+{
+    systimer = map_block(0, io_base, ST_OFFSET, ST_LEN);
+    dma_reg = map_block(1, io_base, DMA_OFFSET, DMA_CHANNELS * DMA_CHAN_LEN);
+    gpio_reg = map_block(2, io_base, GPIO_OFFSET, GPIO_LEN);
+    bsc = map_block(3, io_base, BSC_OFFSET, BSC_LEN);
+    if (systimer == NULL || dma_reg == NULL || gpio_reg == NULL || bsc == NULL) {
+        int err = errno;
+        unmap_peripherals();
+        errno = err;
+        return false;
+    }
+    return true;
+}
+#endif
+
+// GPIO changes go through a bounded MPSC queue so only one thread at a
+// time does the read-modify-write of a GPFSEL register. Producers claim a
+// slot with a CAS on gpio_tail and publish it through its seq. Whichever
+// thread holds gpio_draining applies everything published so far as one
+// batch: the service thread between FIFO bursts, or a caller of
+// bcm_set_gpio_out() waiting for its change. The service thread never waits
+// for the queue.
+struct gpio_cmd {
+    atomic_uint seq;  ///< Position + 1 once published, + GPIO_QUEUE_LEN once free
+    uint8_t gpio;
+    uint8_t mode;     ///< GPIO_FUN_*
+    uint8_t state;    ///< Level to drive, GPIO_STATE_FLOAT to leave it
+};
+static struct gpio_cmd gpio_queue[GPIO_QUEUE_LEN];
+static atomic_uint gpio_tail = 0;    ///< Next position to claim
+static unsigned gpio_head = 0;       ///< Next position to apply, owned by the drainer
+static atomic_uint gpio_applied = 0; ///< Positions before this are in the registers
+static atomic_flag gpio_draining = ATOMIC_FLAG_INIT;
+
+static void gpio_queue_reset()
+{
+    for (unsigned i = 0; i < GPIO_QUEUE_LEN; i++) {
+        atomic_init(&gpio_queue[i].seq, i);
+    }
+    atomic_store(&gpio_tail, 0);
+    atomic_store(&gpio_applied, 0);
+    gpio_head = 0;
+}
+
+// Sets *out to the position to wait for with gpio_sync(). false if the queue is full.
+static bool gpio_enqueue(uint8_t gpio, uint8_t mode, enum gpio_state state, unsigned * out)
+{
+    unsigned pos = atomic_load_explicit(&gpio_tail, memory_order_relaxed);
+    struct gpio_cmd * cmd;
+    for (;;) {
+        cmd = &gpio_queue[pos % GPIO_QUEUE_LEN];
+        int diff = (int)(atomic_load_explicit(&cmd->seq, memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&gpio_tail, &pos, pos + 1,
+                                                      memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;
+        } else {
+            pos = atomic_load_explicit(&gpio_tail, memory_order_relaxed);
+        }
+    }
+    cmd->gpio = gpio;
+    cmd->mode = mode;
+    cmd->state = state;
+    atomic_store_explicit(&cmd->seq, pos + 1, memory_order_release);
+    *out = pos + 1;
+    return true;
+}
+
+// Apply every published command, with one store to GPCLR0, GPSET0 and each
+// GPFSEL register touched. Only called with gpio_draining held.
+static void gpio_drain()
+{
+    uint32_t fsel[GPIO_FSEL_REGS];
+    uint32_t fsel_read = 0;
+    uint32_t fsel_dirty = 0;
+    uint32_t set = 0;
+    uint32_t clr = 0;
+    unsigned head = gpio_head;
+    for (;;) {
+        struct gpio_cmd * cmd = &gpio_queue[head % GPIO_QUEUE_LEN];
+        if (atomic_load_explicit(&cmd->seq, memory_order_acquire) != head + 1) {
+            break;
+        }
+        uint32_t bit = (uint32_t)1 << cmd->gpio;
+        if (cmd->state == GPIO_STATE_LOW) {
+            clr |= bit;
+            set &= ~bit;
+        } else if (cmd->state == GPIO_STATE_HIGH) {
+            set |= bit;
+            clr &= ~bit;
+        }
+        int reg = cmd->gpio / GPIO_FUN_PER_REG;
+        int shift = (cmd->gpio % GPIO_FUN_PER_REG) * GPIO_FUN_SHIFT;
+        if (!(fsel_read & (1u << reg))) {
+            fsel[reg] = GPIO_RD(reg);
+            fsel_read |= 1u << reg;
+        }
+        fsel[reg] &= ~(GPIO_FUN_MASK << shift);
+        fsel[reg] |= (uint32_t)cmd->mode << shift;
+        fsel_dirty |= 1u << reg;
+        atomic_store_explicit(&cmd->seq, head + GPIO_QUEUE_LEN, memory_order_release);
+        head++;
+    }
+    if (head == gpio_head) {
+        return;
+    }
+    // The caller may have been using the BSC, so fence on both sides.
+    mmio_barrier();
+    // Drive the level before the pin becomes an output, so it doesn't glitch.
+    // GPSET0 and GPCLR0 are byte offsets and write only
+    if (clr) {
+        GPIO_WR(GPCLR0 / sizeof(uint32_t), clr);
+    }
+    if (set) {
+        GPIO_WR(GPSET0 / sizeof(uint32_t), set);
+    }
+    for (int reg = 0; reg < GPIO_FSEL_REGS; reg++) {
+        if (fsel_dirty & (1u << reg)) {
+            GPIO_WR(reg, fsel[reg]);
+        }
+    }
+    mmio_barrier();
+    gpio_head = head;
+    atomic_store_explicit(&gpio_applied, head, memory_order_release);
+}
+
+// Apply queued commands if no other thread is, without waiting.
+static void gpio_service()
+{
+    if (atomic_load_explicit(&gpio_applied, memory_order_relaxed) ==
+        atomic_load_explicit(&gpio_tail, memory_order_relaxed)) {
+        return;
+    }
+    if (!atomic_flag_test_and_set_explicit(&gpio_draining, memory_order_acquire)) {
+        gpio_drain();
+        atomic_flag_clear_explicit(&gpio_draining, memory_order_release);
+    }
+}
+
+// Wait until the command at pos is in the registers, draining the queue
+// ourselves unless another thread is already at it.
+static void gpio_sync(unsigned pos)
+{
+    while ((int)(atomic_load_explicit(&gpio_applied, memory_order_acquire) - pos) < 0) {
+        if (!atomic_flag_test_and_set_explicit(&gpio_draining, memory_order_acquire)) {
+            gpio_drain();
+            atomic_flag_clear_explicit(&gpio_draining, memory_order_release);
+        } else {
+            sched_yield();
+        }
+    }
+}
 
-static void * do_mmap(size_t len, off_t base)
+// Queue a command and wait for it to be applied, making room if the queue is full.
+static void gpio_apply(uint8_t gpio, uint8_t mode, enum gpio_state state)
 {
-    return mmap(0, len, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_LOCKED, mem_fd, base);
+    unsigned pos;
+    while (!gpio_enqueue(gpio, mode, state, &pos)) {
+        gpio_sync(atomic_load_explicit(&gpio_tail, memory_order_relaxed) - GPIO_QUEUE_LEN + 1);
+    }
+    gpio_sync(pos);
 }
 
 bool init_bcm_reg_mem()
 {
+#ifdef PI2C_SIM
+    pi2c_sim_reset();
+    pi2c_sim_map(&bsc, &gpio_reg, &dma_reg);
+    gpio_queue_reset();
+#else
+    if (!bcm_detect_soc(BCM_DEVICE_TREE, &soc_info)) {
+        fprintf(stderr, TAG ": Unable to detect SoC, assuming base 0x%08x\n", BCM_IO_BASE);
+    }
+
     if ((mem_fd = open("/dev/mem", O_RDWR | O_SYNC)) < 0) {
         perror(TAG ": Unable to open /dev/mem");
         return false;
     }
 
-    bsc = do_mmap(BSC_LEN, BSC_BASE);
-    if (bsc == NULL) {
-        perror(TAG ": Unable to mmap BSC memory");
+    if (!map_peripherals(soc_info.io_base)) {
+        perror(TAG ": Unable to mmap peripheral memory");
         close(mem_fd);
+        mem_fd = -1;
         return false;
     }
 
-    gpio_reg = do_mmap(GPIO_LEN, GPIO_BASE);
-    if (bsc == NULL) {
-        perror(TAG ": Unable to mmap GPIO memory");
-        munmap((void*)bsc, BSC_LEN);
-        close(mem_fd);
-        return false;
+    // Prefer the generic timer, it is finer grained than the system timer.
+    if (!pi2c_set_clock_source(PI2C_CLOCK_CNTVCT)) {
+        pi2c_set_clock_source(PI2C_CLOCK_SYSTIMER);
     }
-
+    gpio_queue_reset();
+#endif
     return true;
 }
 
 void shutdown_bcm_reg_mem()
 {
-    if (bsc != NULL) {
-        munmap((void *)bsc, BSC_LEN);
-        bsc = NULL;
-    }
-    if (gpio_reg != NULL) {
-        munmap((void *)gpio_reg, GPIO_LEN);
-        gpio_reg = NULL;
-    }
+    pi2c_set_clock_source(PI2C_CLOCK_MONOTONIC);
+#ifndef PI2C_SIM
+    unmap_peripherals();
     if (mem_fd >= 0) {
         close(mem_fd);
         mem_fd = -1;
     }
+#endif
+    bsc = NULL;
+    gpio_reg = NULL;
+    systimer = NULL;
+    dma_reg = NULL;
+}
+
+bool init_bsc_i2c_arena(const struct bsc_i2c_config * cfg)
+{
+    if (arena_used) {
+        fprintf(stderr, TAG ": The arena is in use\n");
+        return false;
+    }
+    shutdown_bsc_i2c_arena();
+
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t len = cfg->arena_len ? cfg->arena_len : BSC_ARENA_DEFAULT_LEN;
+    len = (len + page - 1) & ~(page - 1);
+    // Populate and lock it, so the service path never takes a page fault.
+    void * mem = mmap(NULL, len, PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE|MAP_LOCKED, -1, 0);
+    if (mem == MAP_FAILED) {
+        // Without root, RLIMIT_MEMLOCK may be too small. Populated is still
+        // better than nothing.
+        mem = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_POPULATE, -1, 0);
+        if (mem == MAP_FAILED) {
+            perror(TAG ": Unable to mmap the arena");
+            return false;
+        }
+        fprintf(stderr, TAG ": Unable to lock the arena, it may be paged out\n");
+    }
+    arena = mem;
+    arena_len = len;
+    arena_used = 0;
+    tap_cfg_len = cfg->tap_len ? cfg->tap_len : BSC_TAP_DEFAULT_LEN;
+    tap_cfg_record = cfg->tap_record_max ? cfg->tap_record_max : BSC_TAP_DEFAULT_RECORD;
+    heat_cfg_page = cfg->heat_page_len ? cfg->heat_page_len : BSC_HEAT_DEFAULT_PAGE;
+    return true;
+}
+
+size_t bsc_i2c_arena_used()
+{
+    return arena_used;
+}
+
+void shutdown_bsc_i2c_arena()
+{
+    diag_enabled = false;
+    diag_image = NULL;
+    tap_enabled = false;
+    tap_ring = NULL;
+    heat_enabled = false;
+    heat = NULL;
+    select_loops();
+    if (arena != NULL) {
+        munmap(arena, arena_len);
+    }
+    arena = NULL;
+    arena_len = 0;
+    arena_used = 0;
 }
 
-static void gpio_set_mode(uint32_t gpio, uint32_t mode)
+// Carve a zeroed buffer out of the arena. Only called when a feature is
+// enabled, never from the service path. Buffers are not freed one by one,
+// the whole arena is released by shutdown_bsc_i2c_arena().
+static void * arena_alloc(size_t len)
 {
-    int reg = gpio / GPIO_FUN_PER_REG;
-    int shift = (gpio % GPIO_FUN_PER_REG) * GPIO_FUN_SHIFT;
+    if (arena == NULL) {
+        struct bsc_i2c_config cfg = {0};
+        if (!init_bsc_i2c_arena(&cfg)) {
+            return NULL;
+        }
+    }
+    size_t start = (arena_used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (len > arena_len - start || start > arena_len) {
+        fprintf(stderr, TAG ": Arena exhausted, %zu of %zu bytes used, %zu more needed\n",
+                arena_used, arena_len, len);
+        return NULL;
+    }
+    arena_used = start + len;
+    memset(arena + start, 0, len);
+    return arena + start;
+}
 
-    gpio_reg[reg] &= ~(GPIO_FUN_MASK << shift);
-    gpio_reg[reg] |= mode << shift;
+// Reset the BSC and program it from the shadows.
+static void program_bsc()
+{
+    BSC_WR(BSC_CR, CR_BRK); // First reset everything
+    BSC_WR(BSC_RSR, 0);
+    BSC_WR(BSC_IFLS, ifls_shadow);
+    BSC_WR(BSC_IMSC, imsc_shadow);
+    BSC_WR(BSC_ICR, 0xf);
+    BSC_WR(BSC_SLV, slv_shadow);
+    BSC_WR(BSC_CR, cr_shadow);
+    mmio_barrier(); // BSC to whatever the caller touches next
 }
 
 bool init_bsc_i2c_slv(uint8_t i2c_addr)
@@ -91,146 +820,2053 @@ bool init_bsc_i2c_slv(uint8_t i2c_addr)
     }
 
     // Alternative function 3 is for BSC
-    gpio_set_mode(GPIO_SDA, GPIO_FUN_ALT3);
-    gpio_set_mode(GPIO_SCL, GPIO_FUN_ALT3);
-
-    bsc[BSC_CR] = CR_BRK; // First reset everything
-    bsc[BSC_RSR] = 0;
-    bsc[BSC_IMSC] = 0xf;
-    bsc[BSC_ICR] = 0xf;
+    gpio_apply(GPIO_SDA, GPIO_FUN_ALT3, GPIO_STATE_FLOAT);
+    gpio_apply(GPIO_SCL, GPIO_FUN_ALT3, GPIO_STATE_FLOAT);
+    mmio_barrier(); // GPIO to BSC
 
     // Shift addr right one to get 7 bit addr without RW bit.
-    bsc[BSC_SLV] = (i2c_addr>>1);
-    bsc[BSC_CR] = CR_TXE | CR_RXE | CR_I2C | CR_EN;
+    slv_shadow = i2c_addr>>1;
+    cr_shadow = CR_TXE | CR_RXE | CR_I2C | CR_EN;
+    program_bsc();
+
+    if (profile.clock_ns == 0) {
+        // Not calibrated, assume timestamps are cheap like they are with vDSO.
+        profile.sample_rx_rate = true;
+    }
+    memset(&diag, 0, sizeof(diag));
+    memset(&resync, 0, sizeof(resync));
+    memset(&watchdog, 0, sizeof(watchdog));
+    memset(&tx_stats, 0, sizeof(tx_stats));
+    rx_resync = false;
+    rx_txn_len = 0;
+    wd_stall_start = 0;
+    init_time_us = now_us();
+    select_loops();
 
     return true;
 }
 
-bool bcm_set_gpio_out(int gpio, enum gpio_state state)
+bool init_bsc_i2c_dev(const char * path)
 {
-    if (!gpio_reg) {
-        fprintf(stderr, TAG ": init_bcm_reg_mem() has not been called\n");
+    if (dev_fd >= 0) {
+        fprintf(stderr, TAG ": A slave device is already open\n");
         return false;
     }
-    if (gpio < 0 || gpio >= GPIO_COUNT) {
-        fprintf(stderr, TAG ": Invalid GPIO: %d\n", gpio);
+    if ((dev_fd = open(path, O_RDWR | O_NONBLOCK | O_NOCTTY | O_CLOEXEC)) < 0) {
+        fprintf(stderr, TAG ": Unable to open %s: %s\n", path, strerror(errno));
         return false;
     }
-    switch(state) {
-        case GPIO_STATE_FLOAT:
-            // Using GPIO input as a way to get the gpio to float.
-            // We have to do this because the Raspberry Pi lacks an open drain
-            // mode, which is what we would really want for this pin.
-            gpio_set_mode(gpio, GPIO_FUN_IN);
-            return true;
-        case GPIO_STATE_LOW:
-            gpio_reg[GPCLR0] |= ((uint32_t)1) << gpio;
-            gpio_set_mode(gpio, GPIO_FUN_OUT);
-            return true;
-        case GPIO_STATE_HIGH:
-            gpio_reg[GPSET0] |= ((uint32_t)1) << gpio;
-            gpio_set_mode(gpio, GPIO_FUN_OUT);
-            return true;
-        default:
-            fprintf(stderr, TAG ": Invalid GPIO state: %d\n", state);
-            return false;
+    // Without these, bsc_i2c_write() can't tell what the master read, nor
+    // drop what it didn't. Keep going, with the limits the header describes.
+    int queued;
+    dev_has_outq = ioctl(dev_fd, TIOCOUTQ, &queued) == 0;
+    dev_has_flush = tcflush(dev_fd, TCOFLUSH) == 0;
+    if (!dev_has_outq) {
+        fprintf(stderr, TAG ": %s can't report queued bytes, counting all written as sent\n", path);
+    }
+    if (!dev_has_flush) {
+        fprintf(stderr, TAG ": %s can't drop queued bytes, unread ones reach the next read\n", path);
+    }
+    if ((dev_stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        perror(TAG ": Unable to create eventfd");
+        close(dev_fd);
+        dev_fd = -1;
+        return false;
     }
+    if (bsc_i2c_stop_requested()) {
+        bsc_i2c_request_stop(); // Made before there was a device to wake
+    }
+
+    // A pty standing in for the driver must pass bytes through untouched.
+    struct termios tio;
+    if (tcgetattr(dev_fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        tcsetattr(dev_fd, TCSANOW, &tio);
+    }
+
+    memset(&diag, 0, sizeof(diag));
+    memset(&resync, 0, sizeof(resync));
+    rx_resync = false;
+    rx_txn_len = 0;
+    init_time_us = now_us();
+    select_loops();
+
+    return true;
 }
 
-void shutdown_bsc_i2c_slv()
+int bsc_i2c_dev_fd()
 {
-    bsc[BSC_CR] = 0;
+    return dev_fd;
 }
 
-bool bsc_i2c_receiving(){
-    return bsc[BSC_FR] & FR_RXBUSY;
+bool bsc_i2c_enable_diag(addr_t base)
+{
+    if ((uint32_t)base + BSC_DIAG_LEN > (uint32_t)((addr_t)~0) + 1) {
+        fprintf(stderr, TAG ": Diagnostic window at 0x%04x wraps\n", base);
+        return false;
+    }
+    if (diag_image == NULL && (diag_image = arena_alloc(BSC_DIAG_LEN)) == NULL) {
+        return false;
+    }
+    diag_base = base;
+    diag_enabled = true;
+    select_loops();
+    return true;
 }
 
-int bsc_i2c_read_poll(uint8_t * buf, size_t len)
+void bsc_i2c_disable_diag()
 {
-    pthread_testcancel();
-    if (len == 0 || buf == NULL) {
-        return 0;
+    diag_enabled = false;
+    select_loops();
+}
+
+void bsc_i2c_get_diag(struct bsc_i2c_diag * out)
+{
+    out->underruns = METRIC_GET(diag.underruns);
+    out->overruns = METRIC_GET(diag.overruns);
+    out->max_turnaround_us = METRIC_GET(diag.max_turnaround_us);
+    out->max_service_gap_us = METRIC_GET(diag.max_service_gap_us);
+    out->uptime_s = (now_us() - init_time_us) / 1000000;
+}
+
+void bsc_i2c_set_auto_tune(bool enable)
+{
+    auto_tune = enable;
+    if (!enable) {
+        write_sleep_us = WRITE_USLEEP_INTERVAL;
     }
+}
 
-    size_t read = 0;
+uint32_t bsc_i2c_byte_time_ns()
+{
+    return byte_time_ns;
+}
 
-    // Loop as long as:
-    // 1. We have room to receive data.
-    // 2. The RX fifo has data.
-    // 3. This thread has not been canceled
-    for (; len && !RX_EMPTY(); len--) {
-        pthread_testcancel();
-        if (bsc[BSC_RSR] & RSR_OE) {
-            // We overflowed. :-(
-            fprintf(stderr, TAG ": Overflow!\n");
-            bsc[BSC_RSR] &= ~RSR_OE; // Clear the overflow error
-        }
-        buf[read] = bsc[BSC_DR] & 0xFF;
-        read++;
+unsigned bsc_i2c_service_period_us()
+{
+    return write_sleep_us;
+}
+
+// Record the time from bsc_i2c_write() being called to the first byte queued.
+static void note_turnaround(uint32_t us)
+{
+    if (us > METRIC_GET(diag.max_turnaround_us)) {
+        METRIC_SET(diag.max_turnaround_us, us);
+    }
+    unsigned bucket = us ? 32 - __builtin_clz(us) : 0;
+    if (bucket >= BSC_TURNAROUND_BUCKETS) {
+        bucket = BSC_TURNAROUND_BUCKETS - 1;
     }
+    METRIC_ADD(metrics.turnaround[bucket], 1);
+    METRIC_ADD(metrics.turnaround_sum_us, us);
+}
 
-    return read;
+void bsc_i2c_get_metrics(struct bsc_i2c_metrics * out)
+{
+    out->write_calls = atomic_load_explicit(&metrics.write_calls, memory_order_relaxed);
+    out->master_reads = atomic_load_explicit(&metrics.master_reads, memory_order_relaxed);
+    out->rx_bytes = atomic_load_explicit(&metrics.rx_bytes, memory_order_relaxed);
+    out->flush_toggles = atomic_load_explicit(&metrics.flush_toggles, memory_order_relaxed);
+    out->flush_giveups = atomic_load_explicit(&metrics.flush_giveups, memory_order_relaxed);
+    out->turnaround_sum_us = atomic_load_explicit(&metrics.turnaround_sum_us, memory_order_relaxed);
+    for (unsigned i = 0; i < BSC_TURNAROUND_BUCKETS; i++) {
+        out->turnaround[i] = atomic_load_explicit(&metrics.turnaround[i], memory_order_relaxed);
+    }
 }
 
-int bsc_i2c_write(tx_callback cb, uint16_t addr)
+// Fold in one measurement of `bytes` moving through a FIFO in `elapsed` ns.
+// Only call this when the FIFO was neither empty nor full for the whole
+// interval, otherwise the bus may have been stalled and the sample is junk.
+static void note_byte_rate(uint64_t elapsed, unsigned bytes)
 {
-    pthread_testcancel();
-    int offset = 0;
+    uint64_t sample = elapsed / bytes;
+    if (sample < BYTE_TIME_MIN_NS || sample > BYTE_TIME_MAX_NS) {
+        return;
+    }
+    if (byte_time_ns == 0) {
+        byte_time_ns = sample;
+    } else {
+        byte_time_ns += ((int64_t)sample - (int64_t)byte_time_ns) >> BYTE_TIME_EWMA_SHIFT;
+    }
 
-    // Keep replying as long as the master is not writing to us.
-    while (RX_EMPTY()) {
-        pthread_testcancel();
-        // Keep the TX FIFO full
-        while ( !(bsc[BSC_FR] & FR_TXFF)) {
-            pthread_testcancel();
-            // Check for underflows
-            if (bsc[BSC_RSR] & RSR_UE) {
-                // We had an underrun happen. :-(
-                fprintf(stderr, TAG ": Underrun!\n");
-                bsc[BSC_RSR] &= ~RSR_UE; // Clear the underrun error
-            }
-            uint8_t byte;
-            if (cb(addr++, &byte)) {
-                bsc[BSC_DR] = byte;
-                offset++;
-            } else {
-                // We have used up all the data this callback has.
-                break;
-            }
+    if (auto_tune) {
+        // Wake up about every WRITE_TUNE_BYTES byte times. That notices a
+        // master writing a register address in time to flush the TX FIFO
+        // before it turns around to read, and is far within the FIFO's
+        // underrun margin.
+        unsigned period = (uint64_t)byte_time_ns * WRITE_TUNE_BYTES / 1000;
+        if (period < WRITE_USLEEP_MIN) {
+            period = WRITE_USLEEP_MIN;
+        } else if (period > WRITE_USLEEP_MAX) {
+            period = WRITE_USLEEP_MAX;
         }
-        usleep(WRITE_USLEEP_INTERVAL);
+        write_sleep_us = period;
     }
+}
 
-    // Return value is how many bytes we put in the TX FIFO minus the number of
-    // bytes that are left in it minus an additional byte which got sucked off
-    // the FIFO, ready to be sent, but never was sent.
-    int ret = offset - GET_FR_TXFLEVEL() - 1;
+static void apply_profile(const struct bsc_i2c_profile * prof)
+{
+    profile = *prof;
+    // A period shorter than the usual oversleep would be more than doubled by
+    // sleeping, so spin for those instead.
+    profile.spin_threshold_us = prof->sleep_overshoot_us;
+    profile.sample_rx_rate = prof->clock_ns <= CLOCK_NS_MAX_FOR_RX;
+}
 
-    // We need to get the TX FIFO clear, otherwise the next time the master
-    // does a read, it will get the unread leftovers from this read.
-    //
-    // The method here is a bit hacky, but it is the only one I could find. I
-    // was unable to get CR_BRK to work at all. It simply would not clear the
-    // fifo. As far as I could see, it does nothing. I found numerous places
-    // online where people reported the same issue.
-    //
-    // The method is simple, whenever TX is disabled and re-enabled, it drops
-    // the current TX byte and pops the next one out of the FIFO, so we can
-    // put this in a while loop until the TX FIFO is empty (TXFE) and then
-    // do it one more time to drop the last TX byte.
-    //
-    // Note: this behavior is undocumented as far as I can tell. The BCM2837
-    // ARM Peripherals specification document doesn't mention it. However,
-    // that spec is generally known to contain errors and omissions.
-    while (!(bsc[BSC_FR] & FR_TXFE)) {
-        bsc[BSC_CR] &= ~CR_TXE;
-        bsc[BSC_CR] |= CR_TXE;
+bool bsc_i2c_calibrate(struct bsc_i2c_profile * out)
+{
+    if (!bsc) {
+        fprintf(stderr, TAG ": init_bcm_reg_mem() has not been called\n");
+        return false;
+    }
+
+    struct bsc_i2c_profile prof = {0};
+    uint64_t start = pi2c_now();
+    for (int i = 0; i < CALIBRATE_READS; i++) {
+        (void)BSC_RD(BSC_FR);
     }
-    bsc[BSC_CR] &= ~CR_TXE;
-    bsc[BSC_CR] |= CR_TXE;
+    prof.mmio_read_ns = (pi2c_now() - start) / CALIBRATE_READS;
 
-    // When this software is first getting running, I have seen some
-    // instability. This is just a sanity check.
-    return (ret < 0) ? 0 : ret;
+    start = pi2c_now();
+    for (int i = 0; i < CALIBRATE_READS; i++) {
+        (void)pi2c_now();
+    }
+    prof.clock_ns = (pi2c_now() - start) / CALIBRATE_READS;
+
+    start = pi2c_now();
+    for (int i = 0; i < CALIBRATE_SLEEPS; i++) {
+        usleep(WRITE_USLEEP_INTERVAL);
+    }
+    uint64_t slept_us = (pi2c_now() - start) / 1000 / CALIBRATE_SLEEPS;
+    prof.sleep_overshoot_us = (slept_us > WRITE_USLEEP_INTERVAL) ?
+                              slept_us - WRITE_USLEEP_INTERVAL : 0;
+
+    apply_profile(&prof);
+    if (out) {
+        *out = profile;
+    }
+    return true;
+}
+
+void bsc_i2c_get_profile(struct bsc_i2c_profile * out)
+{
+    *out = profile;
+}
+
+void bsc_i2c_set_profile(const struct bsc_i2c_profile * prof)
+{
+    apply_profile(prof);
+}
+
+bool bsc_i2c_save_profile(const char * path)
+{
+    FILE * f = fopen(path, "w");
+    if (f == NULL) {
+        perror(TAG ": Unable to write profile");
+        return false;
+    }
+    fprintf(f, "version %d\n", PROFILE_VERSION);
+    fprintf(f, "mmio_read_ns %u\n", profile.mmio_read_ns);
+    fprintf(f, "clock_ns %u\n", profile.clock_ns);
+    fprintf(f, "sleep_overshoot_us %u\n", profile.sleep_overshoot_us);
+    if (fclose(f) != 0) {
+        perror(TAG ": Unable to write profile");
+        return false;
+    }
+    return true;
+}
+
+bool bsc_i2c_load_profile(const char * path)
+{
+    FILE * f = fopen(path, "r");
+    if (f == NULL) {
+        // A missing cache is expected on first boot, so don't complain.
+        return false;
+    }
+    struct bsc_i2c_profile prof = {0};
+    int version = 0;
+    int got = fscanf(f, "version %d mmio_read_ns %u clock_ns %u sleep_overshoot_us %u",
+                     &version, &prof.mmio_read_ns, &prof.clock_ns,
+                     &prof.sleep_overshoot_us);
+    fclose(f);
+    if (got != 4 || version != PROFILE_VERSION) {
+        fprintf(stderr, TAG ": Ignoring invalid profile %s\n", path);
+        return false;
+    }
+    apply_profile(&prof);
+    return true;
+}
+
+// Wait roughly `us` microseconds between TX FIFO services, using what
+// calibration told us about how late usleep() tends to wake up.
+static void service_wait(unsigned us)
+{
+    if (us <= profile.spin_threshold_us) {
+        uint64_t deadline = pi2c_now() + (uint64_t)us * 1000;
+        while (pi2c_now() < deadline) {
+        }
+    } else {
+        usleep(us - profile.sleep_overshoot_us);
+    }
+}
+
+// Wait for the slave device to be ready for `events`, or failed, for up to
+// `us` microseconds, -1 for no limit. A stop request ends the wait early.
+// Returns the device's revents.
+static short dev_poll(short events, int64_t us)
+{
+    struct pollfd pfd[2] = {
+        {.fd = dev_fd, .events = events},
+        {.fd = dev_stop_fd, .events = POLLIN},
+    };
+    struct timespec timeout = {.tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000};
+    if (ppoll(pfd, 2, (us < 0) ? NULL : &timeout, NULL) <= 0) {
+        return 0;
+    }
+    return pfd[0].revents;
+}
+
+// Wait up to `us` microseconds for the master to write to the slave device.
+// Returns true as soon as there is something to read, or the device failed.
+static bool dev_wait(unsigned us)
+{
+    return dev_poll(POLLIN, us) != 0;
+}
+
+void bsc_i2c_set_idle_backoff(bool enable, unsigned ceiling_us)
+{
+    idle_backoff = enable;
+    idle_ceiling_us = ceiling_us;
+    service_idle.us = 0;
+}
+
+// The longest we can sleep without a master that starts a transfer right
+// after we went to sleep running the FIFO full (RX) or empty (TX).
+static unsigned idle_ceiling()
+{
+    if (idle_ceiling_us) {
+        return idle_ceiling_us;
+    }
+    uint64_t byte_ns = byte_time_ns ? byte_time_ns : IDLE_FAST_BYTE_NS;
+    unsigned ceiling = byte_ns * (FIFO_LEN - IDLE_FIFO_MARGIN) / 1000;
+    return (ceiling > profile.sleep_overshoot_us) ?
+           ceiling - profile.sleep_overshoot_us : 0;
+}
+
+// Pick how long to wait before the next FIFO service, given a fresh read of
+// the flag register. Doubles the wait each time nothing has changed, and goes
+// straight back to the hot period on any sign of activity.
+static unsigned backoff_period(struct idle_state * idle, uint32_t fr)
+{
+    fr &= IDLE_ACTIVITY_MASK;
+    if (fr != idle->fr || (fr & (FR_RXBUSY | FR_TXBUSY))) {
+        idle->fr = fr;
+        idle->us = 0;
+        return write_sleep_us;
+    }
+    unsigned ceiling = idle_ceiling();
+    if (ceiling < write_sleep_us) {
+        ceiling = write_sleep_us;
+    }
+    idle->us = idle->us ? idle->us * 2 : write_sleep_us * 2;
+    if (idle->us > ceiling) {
+        idle->us = ceiling;
+    }
+    return idle->us;
+}
+
+// backoff_period() if idle back off is enabled, the hot period otherwise.
+static unsigned idle_period(struct idle_state * idle, uint32_t fr)
+{
+    if (!idle_backoff) {
+        return write_sleep_us;
+    }
+    return backoff_period(idle, fr);
+}
+
+void bsc_i2c_idle_wait()
+{
+    if (dev_fd >= 0) {
+        // The driver buffers what the master writes, so there is nothing to
+        // overrun. Only a stop request needs us back before data arrives.
+        dev_wait(DEV_IDLE_WAIT_US);
+        return;
+    }
+    gpio_service();
+    service_wait(idle_period(&service_idle, BSC_RD(BSC_FR)));
+}
+
+static void put_be32(uint8_t * out, uint32_t val)
+{
+    out[0] = val >> 24;
+    out[1] = val >> 16;
+    out[2] = val >> 8;
+    out[3] = val;
+}
+
+// Copy the counters into the byte image the master reads. Done once per
+// bsc_i2c_write() call so the TX loop only has to index an array.
+static void refresh_diag_image()
+{
+    struct bsc_i2c_diag snap;
+    bsc_i2c_get_diag(&snap);
+    put_be32(diag_image + 0, snap.underruns);
+    put_be32(diag_image + 4, snap.overruns);
+    put_be32(diag_image + 8, snap.max_turnaround_us);
+    put_be32(diag_image + 12, snap.max_service_gap_us);
+    put_be32(diag_image + 16, snap.uptime_s);
+}
+
+// Function select for a state, see enum gpio_state
+static uint8_t gpio_state_mode(enum gpio_state state)
+{
+    // Using GPIO input as a way to get the gpio to float.
+    // We have to do this because the Raspberry Pi lacks an open drain
+    // mode, which is what we would really want for this pin.
+    return (state == GPIO_STATE_FLOAT) ? GPIO_FUN_IN : GPIO_FUN_OUT;
+}
+
+bool bcm_set_gpio_out(int gpio, enum gpio_state state)
+{
+    if (!gpio_reg) {
+        fprintf(stderr, TAG ": init_bcm_reg_mem() has not been called\n");
+        return false;
+    }
+    if (gpio < 0 || gpio >= GPIO_COUNT) {
+        fprintf(stderr, TAG ": Invalid GPIO: %d\n", gpio);
+        return false;
+    }
+    if (state != GPIO_STATE_FLOAT && state != GPIO_STATE_LOW && state != GPIO_STATE_HIGH) {
+        fprintf(stderr, TAG ": Invalid GPIO state: %d\n", state);
+        return false;
+    }
+    gpio_apply(gpio, gpio_state_mode(state), state);
+    return true;
+}
+
+bool bcm_queue_gpio_out(int gpio, enum gpio_state state)
+{
+    if (!gpio_reg || gpio < 0 || gpio >= GPIO_COUNT ||
+        (state != GPIO_STATE_FLOAT && state != GPIO_STATE_LOW && state != GPIO_STATE_HIGH)) {
+        return false;
+    }
+    unsigned pos;
+    if (!gpio_enqueue(gpio, gpio_state_mode(state), state, &pos)) {
+        // Make room if nobody else is applying the queue, but don't wait.
+        gpio_service();
+        if (!gpio_enqueue(gpio, gpio_state_mode(state), state, &pos)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void bcm_gpio_sync()
+{
+    gpio_sync(atomic_load_explicit(&gpio_tail, memory_order_acquire));
+}
+
+volatile uint32_t * bsc_i2c_regs()
+{
+    return bsc;
+}
+
+void shutdown_bsc_i2c_slv()
+{
+    bsc_i2c_stop_event_thread();
+    bsc_i2c_stop_dma();
+    bsc_i2c_disable_tx_irq();
+    if (dev_fd >= 0) {
+        close(dev_fd);
+        dev_fd = -1;
+        close(dev_stop_fd);
+        dev_stop_fd = -1;
+        select_loops();
+        return;
+    }
+    cr_shadow = 0;
+    BSC_WR(BSC_CR, cr_shadow);
+}
+
+bool bsc_i2c_receiving(){
+    if (dev_fd >= 0) {
+        // The driver only tells us a master write has arrived, not that one
+        // is in progress.
+        return dev_wait(0);
+    }
+    return RX_BUSY();
+}
+
+// Where the RX DMA channel will write next, as an index into the ring.
+static size_t dma_rx_head()
+{
+    size_t head = (DMA_RD(dma_cfg.rx_channel, DMA_DEST_AD) - dma_ring_bus) / sizeof(uint32_t);
+    // Past the last word, the channel is about to reload its control block.
+    return (head < dma_cfg.rx_ring_len) ? head : 0;
+}
+
+static size_t dma_rx_fill()
+{
+    return (dma_rx_head() + dma_cfg.rx_ring_len - dma_rx_tail) % dma_cfg.rx_ring_len;
+}
+
+int bsc_i2c_event_fd()
+{
+    if (event_fd < 0) {
+        event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (event_fd < 0) {
+            perror(TAG ": Unable to create eventfd");
+        }
+    }
+    return event_fd;
+}
+
+// Only the first event since the last bsc_i2c_take_events() touches the
+// eventfd, so a burst of transactions costs the event loop one wakeup.
+static void post_event(unsigned events)
+{
+    unsigned old = atomic_fetch_or_explicit(&pending_events, events, memory_order_release);
+    if (old == 0 && event_fd >= 0) {
+        uint64_t one = 1;
+        if (write(event_fd, &one, sizeof(one)) < 0) {
+            // The counter can only be full if nobody is reading it, in which
+            // case there is a wakeup pending anyway.
+        }
+    }
+}
+
+unsigned bsc_i2c_take_events(int * tx_count)
+{
+    if (event_fd >= 0) {
+        uint64_t count;
+        if (read(event_fd, &count, sizeof(count)) < 0) {
+            // EAGAIN, nothing was posted since the last call.
+        }
+    }
+    unsigned events = atomic_exchange_explicit(&pending_events, 0, memory_order_acquire);
+    if (tx_count) {
+        *tx_count = atomic_load_explicit(&last_tx_count, memory_order_relaxed);
+    }
+    return events;
+}
+
+// Sleep until the RX interrupt, or us passes. fr is the flag register as
+// the caller last saw it.
+static void event_irq_wait(int fd, unsigned us, uint32_t fr)
+{
+    // Acknowledge first, so any interrupt from here on wakes us. The service
+    // thread acknowledges too, but each listener counts every interrupt.
+    BSC_WR(BSC_ICR, INT_RX);
+#ifndef PI2C_SIM
+    // The UIO driver masks the interrupt each time it fires, unmask it.
+    uint32_t unmask = 1;
+    if (write(fd, &unmask, sizeof(unmask)) < 0) {
+        post_event(BSC_EVENT_ERROR);
+    }
+#endif
+    // What arrived before the acknowledgement raises no new interrupt.
+    if ((BSC_RD(BSC_FR) & IDLE_ACTIVITY_MASK) != (fr & IDLE_ACTIVITY_MASK)) {
+        return;
+    }
+    struct pollfd pfd = {.fd = fd, .events = POLLIN};
+    struct timespec timeout = {.tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000};
+    if (ppoll(&pfd, 1, &timeout, NULL) > 0) {
+        uint64_t count;
+        if (read(fd, &count, irq_count_len) < 0) {
+            // Taken by nobody else, a failed read is retried next time.
+        }
+    }
+}
+
+static void * event_thread_main(void * unused)
+{
+    (void)unused;
+    uint32_t last_fr = FR_RXFE;
+    struct idle_state idle = {0};
+
+    while (atomic_load_explicit(&event_thread_run, memory_order_relaxed)) {
+        uint32_t fr = BSC_RD(BSC_FR);
+        // Post when data is waiting and either the master finished writing
+        // or the FIFO is half full, so a long write can't overrun it.
+        bool changed = (fr & IDLE_ACTIVITY_MASK) != (last_fr & IDLE_ACTIVITY_MASK);
+        // In DMA mode the RX FIFO drains on its own, into the ring.
+        unsigned level = dma_enabled ? dma_rx_fill() : (fr & FR_RXFLEVEL) >> FR_RXFLEVEL_OFF;
+        if (changed && level > 0 && (!(fr & FR_RXBUSY) || level >= FIFO_LEN / 2)) {
+            post_event(BSC_EVENT_RX);
+        }
+        if (BSC_RD(BSC_RSR) & (RSR_OE | RSR_UE)) {
+            post_event(BSC_EVENT_ERROR);
+        }
+        last_fr = fr;
+        // Always back off, the thread only posts events. With the RX
+        // interrupt, writes of two bytes or more wake it, so it can sleep
+        // longer once idle.
+        unsigned us = backoff_period(&idle, fr);
+        int fd = atomic_load_explicit(&event_irq_fd, memory_order_relaxed);
+        if (fd >= 0 && us > write_sleep_us) {
+            event_irq_wait(fd, EVENT_IRQ_WAIT_US, fr);
+        } else {
+            service_wait(us);
+        }
+    }
+    return NULL;
+}
+
+bool bsc_i2c_start_event_thread()
+{
+    if (dev_fd >= 0) {
+        fprintf(stderr, TAG ": Not needed with a slave device, poll bsc_i2c_dev_fd()\n");
+        return false;
+    }
+    if (!bsc) {
+        fprintf(stderr, TAG ": init_bcm_reg_mem() has not been called\n");
+        return false;
+    }
+    if (bsc_i2c_event_fd() < 0) {
+        return false;
+    }
+    atomic_store(&event_thread_run, true);
+    int err = pthread_create(&event_thread, NULL, event_thread_main, NULL);
+    if (err != 0) {
+        fprintf(stderr, TAG ": Unable to start event thread: %s\n", strerror(err));
+        atomic_store(&event_thread_run, false);
+        return false;
+    }
+    return true;
+}
+
+void bsc_i2c_stop_event_thread()
+{
+    if (atomic_exchange(&event_thread_run, false)) {
+        pthread_join(event_thread, NULL);
+    }
+}
+
+void bsc_i2c_request_stop()
+{
+    atomic_store_explicit(&stop_requested, true, memory_order_relaxed);
+    if (dev_stop_fd >= 0) {
+        uint64_t one = 1;
+        if (write(dev_stop_fd, &one, sizeof(one)) < 0) {
+            // Only fails if the counter is full, it is readable either way.
+        }
+    }
+}
+
+void bsc_i2c_clear_stop()
+{
+    atomic_store_explicit(&stop_requested, false, memory_order_relaxed);
+    if (dev_stop_fd >= 0) {
+        uint64_t count;
+        if (read(dev_stop_fd, &count, sizeof(count)) < 0) {
+            // EAGAIN, no stop was requested.
+        }
+    }
+}
+
+bool bsc_i2c_stop_requested()
+{
+    return atomic_load_explicit(&stop_requested, memory_order_relaxed);
+}
+
+static void flush_tx_fifo()
+{
+    // We need to get the TX FIFO clear, otherwise the next time the master
+    // does a read, it will get the unread leftovers from this read.
+    //
+    // The method here is a bit hacky, but it is the only one I could find. I
+    // was unable to get CR_BRK to work at all. It simply would not clear the
+    // fifo. As far as I could see, it does nothing. I found numerous places
+    // online where people reported the same issue.
+    //
+    // The method is simple, whenever TX is disabled and re-enabled, it drops
+    // the current TX byte and pops the next one out of the FIFO, so we can
+    // put this in a while loop until the TX FIFO is empty (TXFE) and then
+    // do it one more time to drop the last TX byte.
+    //
+    // Note: this behavior is undocumented as far as I can tell. The BCM2837
+    // ARM Peripherals specification document doesn't mention it. However,
+    // that spec is generally known to contain errors and omissions.
+    //
+    // Each toggle drops one byte, so if the FIFO is not empty after enough
+    // toggles for a full one, it is not draining. Give up rather than hang
+    // the service thread, the next bsc_i2c_write() tries again.
+    unsigned toggles = 0;
+    for (; !(BSC_RD(BSC_FR) & FR_TXFE); toggles++) {
+        if (toggles == FLUSH_MAX_TOGGLES) {
+            METRIC_ADD(metrics.flush_toggles, toggles);
+            METRIC_ADD(metrics.flush_giveups, 1);
+            post_event(BSC_EVENT_ERROR);
+            return;
+        }
+        BSC_WR(BSC_CR, cr_shadow & ~CR_TXE);
+        BSC_WR(BSC_CR, cr_shadow);
+    }
+    BSC_WR(BSC_CR, cr_shadow & ~CR_TXE);
+    BSC_WR(BSC_CR, cr_shadow);
+    METRIC_ADD(metrics.flush_toggles, toggles + 1);
+}
+
+void bsc_i2c_flush_tx()
+{
+    if (dev_fd >= 0) {
+        if (dev_has_flush && tcflush(dev_fd, TCOFLUSH) < 0) {
+            post_event(BSC_EVENT_ERROR);
+        }
+        return;
+    }
+    flush_tx_fifo();
+}
+
+static void flush_tx_cleanup(void * unused)
+{
+    (void)unused;
+    SERVICE_EXIT();
+    if (dma_enabled) {
+        // Stop the TX channel first, or it refills what we flush.
+        BSC_WR(BSC_DMACR, DMACR_RXDMAE);
+        mmio_barrier(); // BSC to DMA
+        DMA_WR(dma_cfg.tx_channel, DMA_CS, DMA_CS_RESET);
+        mmio_barrier(); // DMA to BSC
+    }
+    bsc_i2c_flush_tx();
+}
+
+// Sleep until the BSC interrupts or the idle ceiling passes. starved is
+// whether the TX FIFO was left short because the callback ran out of data,
+// in which case the TX interrupt won't come.
+static void irq_wait(bool starved)
+{
+    // Acknowledge first, so any interrupt from here on wakes us.
+    BSC_WR(BSC_ICR, INT_TX | INT_RX);
+#ifndef PI2C_SIM
+    // The UIO driver masks the interrupt each time it fires, unmask it.
+    uint32_t unmask = 1;
+    if (write(irq_fd, &unmask, sizeof(unmask)) < 0) {
+        post_event(BSC_EVENT_ERROR);
+    }
+#endif
+    // The master may have drained the FIFO before the acknowledgement.
+    uint32_t fr = BSC_RD(BSC_FR);
+    if (!(fr & FR_RXFE) || (!starved && ((fr & FR_TXFLEVEL) >> FR_TXFLEVEL_OFF) <= irq_tx_level)) {
+        return;
+    }
+    unsigned us = idle_ceiling();
+    struct pollfd pfd = {.fd = irq_fd, .events = POLLIN};
+    struct timespec timeout = {.tv_sec = us / 1000000, .tv_nsec = (us % 1000000) * 1000};
+    if (ppoll(&pfd, 1, &timeout, NULL) > 0) {
+        // UIO only accepts reads of its 32 bit count, the simulator's eventfd
+        // only reads of a 64 bit one.
+        uint64_t count;
+        if (read(irq_fd, &count, irq_count_len) > 0) {
+            METRIC_ADD(tx_stats.interrupts, 1);
+        }
+    }
+}
+
+bool bsc_i2c_enable_tx_irq(const char * uio_path, unsigned tx_level)
+{
+    if (!bsc) {
+        fprintf(stderr, TAG ": init_bcm_reg_mem() has not been called\n");
+        return false;
+    }
+    if (tx_level > IFLS_7_8) {
+        fprintf(stderr, TAG ": Invalid TX interrupt level %u\n", tx_level);
+        return false;
+    }
+    bsc_i2c_disable_tx_irq();
+    // One listener for the service thread, one for the event thread. Each
+    // sees every interrupt.
+#ifdef PI2C_SIM
+    (void)uio_path;
+    int fd = pi2c_sim_irq_fd(0);
+    int event_fd = pi2c_sim_irq_fd(1);
+    irq_count_len = sizeof(uint64_t);
+#else
+    int fd = open(uio_path, O_RDWR | O_CLOEXEC);
+    int event_fd = (fd >= 0) ? open(uio_path, O_RDWR | O_CLOEXEC) : -1;
+    irq_count_len = sizeof(uint32_t);
+#endif
+    if (fd < 0 || event_fd < 0) {
+        perror(TAG ": Unable to open the interrupt device");
+#ifndef PI2C_SIM
+        if (fd >= 0) {
+            close(fd);
+        }
+#endif
+        return false;
+    }
+    ifls_shadow = (tx_level << IFLS_TXIFLSEL_OFF) | (IFLS_1_8 << IFLS_RXIFLSEL_OFF);
+    imsc_shadow = INT_TX | INT_RX;
+    BSC_WR(BSC_IFLS, ifls_shadow);
+    BSC_WR(BSC_IMSC, imsc_shadow);
+    BSC_WR(BSC_ICR, 0xf);
+    mmio_barrier(); // BSC to whatever the caller touches next
+    irq_tx_level = IFLS_LEVEL_BYTES(tx_level);
+    irq_fd = fd;
+    atomic_store(&event_irq_fd, event_fd);
+    return true;
+}
+
+void bsc_i2c_disable_tx_irq()
+{
+    if (irq_fd < 0) {
+        return;
+    }
+    // A running event thread may still poll the old fd once, which only
+    // costs it one timeout.
+    int event_fd = atomic_exchange(&event_irq_fd, -1);
+#ifndef PI2C_SIM
+    close(irq_fd);
+    close(event_fd);
+#else
+    (void)event_fd;
+#endif
+    irq_fd = -1;
+    ifls_shadow = 0;
+    imsc_shadow = 0xf;
+    if (bsc) {
+        BSC_WR(BSC_IFLS, ifls_shadow);
+        BSC_WR(BSC_IMSC, imsc_shadow);
+        mmio_barrier(); // BSC to whatever the caller touches next
+    }
+}
+
+void bsc_i2c_get_tx_stats(struct bsc_i2c_tx_stats * out)
+{
+    out->wakeups = METRIC_GET(tx_stats.wakeups);
+    out->interrupts = METRIC_GET(tx_stats.interrupts);
+    out->bytes = METRIC_GET(tx_stats.bytes);
+}
+
+// Round to the 8 byte alignment of tap records.
+#define TAP_ALIGN(len)        (((len) + 7) & ~(uint32_t)7)
+
+// The tap is written by the service thread alone. A record is written in
+// place, in a slot of tap_slot bytes, and published by moving tap_head past
+// it. Before writing a slot, tap_claim is moved past it, so a subscriber can
+// tell whether the record it is reading may have been overwritten. A
+// record never starts fewer than tap_slot bytes from the end of the ring,
+// the writer and subscribers both skip to the start instead.
+
+static void tap_commit()
+{
+    tap_rec.end_ns = pi2c_now();
+    memcpy(tap_ring + (tap_pos & (tap_len - 1)), &tap_rec, sizeof(tap_rec));
+    atomic_store_explicit(&tap_head, tap_pos + TAP_ALIGN(sizeof(tap_rec) + tap_rec.len),
+                          memory_order_release);
+    tap_open_rec = false;
+}
+
+static void tap_open(uint8_t dir)
+{
+    if (tap_open_rec) {
+        tap_commit();
+    }
+    uint32_t pos = atomic_load_explicit(&tap_head, memory_order_relaxed);
+    uint32_t off = pos & (tap_len - 1);
+    if (tap_len - off < tap_slot) {
+        pos += tap_len - off;
+        off = 0;
+    }
+    atomic_store_explicit(&tap_claim, pos + tap_slot, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); // Claim before the writes to the slot
+    tap_pos = pos;
+    tap_data = tap_ring + off + sizeof(tap_rec);
+    memset(&tap_rec, 0, sizeof(tap_rec));
+    tap_rec.start_ns = pi2c_now();
+    tap_rec.dir = dir;
+    tap_open_rec = true;
+}
+
+// Add bytes read from the master to its write being recorded.
+static void tap_rx(const uint8_t * buf, size_t len)
+{
+    if (!tap_open_rec || tap_rec.dir != BSC_TAP_RX) {
+        tap_open(BSC_TAP_RX);
+    }
+    size_t keep = tap_record_max - tap_rec.len;
+    if (len > keep) {
+        tap_rec.flags |= BSC_TAP_TRUNCATED;
+    } else {
+        keep = len;
+    }
+    memcpy(tap_data + tap_rec.len, buf, keep);
+    tap_rec.len += keep;
+    tap_rec.count += len;
+}
+
+// Record the master write once it is seen to end.
+static void tap_rx_end(uint32_t fr)
+{
+    if (tap_open_rec && tap_rec.dir == BSC_TAP_RX && (fr & FR_RXFE) && !(fr & FR_RXBUSY)) {
+        tap_commit();
+    }
+}
+
+// Record a master read. The first bytes queued are already in tap_data.
+static void tap_tx_done(int sent)
+{
+    if (!tap_open_rec) {
+        return;
+    }
+    if ((uint32_t)sent > tap_record_max) {
+        tap_rec.len = tap_record_max;
+        tap_rec.flags |= BSC_TAP_TRUNCATED;
+    } else {
+        tap_rec.len = sent;
+    }
+    tap_rec.count = sent;
+    tap_commit();
+}
+
+bool bsc_i2c_enable_tap()
+{
+    if (tap_ring == NULL) {
+        size_t len = 64;
+        while (len < tap_cfg_len) {
+            len <<= 1;
+        }
+        uint32_t slot = TAP_ALIGN(sizeof(struct bsc_i2c_tap_record) + tap_cfg_record);
+        if (tap_cfg_record > UINT16_MAX || len > (1u << 31) || len < 2 * slot) {
+            fprintf(stderr, TAG ": A tap ring of %zu bytes can't hold records of %zu bytes\n",
+                    len, tap_cfg_record);
+            return false;
+        }
+        if ((tap_ring = arena_alloc(len)) == NULL) {
+            return false;
+        }
+        tap_len = len;
+        tap_record_max = tap_cfg_record;
+        tap_slot = slot;
+    }
+    tap_open_rec = false;
+    tap_enabled = true;
+    select_loops();
+    return true;
+}
+
+void bsc_i2c_disable_tap()
+{
+    tap_enabled = false;
+    select_loops();
+}
+
+void bsc_i2c_tap_subscribe(struct bsc_i2c_tap * tap)
+{
+    tap->cursor = atomic_load_explicit(&tap_head, memory_order_acquire);
+    tap->next = tap->cursor;
+    tap->overruns = 0;
+}
+
+static bool capture_write(int fd, const void * buf, size_t len)
+{
+    while (len) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf = (const uint8_t *)buf + n;
+        len -= n;
+    }
+    return true;
+}
+
+bool bsc_i2c_capture_begin(int fd)
+{
+    struct bsc_i2c_capture_header head = {
+        .magic = BSC_CAPTURE_MAGIC,
+        .version = BSC_CAPTURE_VERSION,
+        .byte_time_ns = byte_time_ns,
+        .slave_addr = slv_shadow,
+    };
+    if (!capture_write(fd, &head, sizeof(head))) {
+        perror(TAG ": Unable to write capture");
+        return false;
+    }
+    return true;
+}
+
+int bsc_i2c_capture_save(struct bsc_i2c_tap * tap, int fd)
+{
+    if (tap_ring == NULL) {
+        return 0;
+    }
+    // Room for the longest record, copied out of the ring so the service
+    // thread can't change it while it is written.
+    uint8_t * copy = malloc(sizeof(struct bsc_i2c_tap_record) + tap_record_max);
+    if (copy == NULL) {
+        perror(TAG ": Unable to allocate capture buffer");
+        return -1;
+    }
+    int saved = 0;
+    struct bsc_i2c_tap_record rec;
+    const uint8_t * data;
+    while (bsc_i2c_tap_peek(tap, &rec, &data)) {
+        memcpy(copy, &rec, sizeof(rec));
+        memcpy(copy + sizeof(rec), data, rec.len);
+        if (!bsc_i2c_tap_release(tap)) {
+            continue;
+        }
+        if (!capture_write(fd, copy, sizeof(rec) + rec.len)) {
+            perror(TAG ": Unable to write capture");
+            saved = -1;
+            break;
+        }
+        saved++;
+    }
+    free(copy);
+    return saved;
+}
+
+// Whether the writer may have overwritten the ring from pos on.
+static bool tap_lapped(uint32_t pos)
+{
+    atomic_thread_fence(memory_order_acquire); // Reads of the ring before the claim
+    return atomic_load_explicit(&tap_claim, memory_order_relaxed) - pos > tap_len;
+}
+
+bool bsc_i2c_tap_peek(struct bsc_i2c_tap * tap, struct bsc_i2c_tap_record * rec, const uint8_t ** data)
+{
+    if (tap_ring == NULL) {
+        return false;
+    }
+    for (;;) {
+        uint32_t head = atomic_load_explicit(&tap_head, memory_order_acquire);
+        if (tap->cursor == head) {
+            return false;
+        }
+        uint32_t off = tap->cursor & (tap_len - 1);
+        if (tap_len - off < tap_slot) {
+            tap->cursor += tap_len - off;
+            continue;
+        }
+        memcpy(rec, tap_ring + off, sizeof(*rec));
+        if (head - tap->cursor > tap_len || tap_lapped(tap->cursor) || rec->len > tap_record_max) {
+            // Lapped, skip to the newest records.
+            tap->overruns++;
+            tap->cursor = atomic_load_explicit(&tap_head, memory_order_acquire);
+            continue;
+        }
+        tap->next = tap->cursor + TAP_ALIGN(sizeof(*rec) + rec->len);
+        *data = tap_ring + off + sizeof(*rec);
+        return true;
+    }
+}
+
+bool bsc_i2c_tap_release(struct bsc_i2c_tap * tap)
+{
+    if (tap_lapped(tap->cursor)) {
+        tap->overruns++;
+        tap->cursor = atomic_load_explicit(&tap_head, memory_order_acquire);
+        return false;
+    }
+    tap->cursor = tap->next;
+    return true;
+}
+
+// Count a master read of sent bytes from addr on. Once per bsc_i2c_write(),
+// with a loop over the pages it crossed, usually one or two.
+static void heat_note_read(addr_t addr, uint32_t sent)
+{
+    uint32_t now = pi2c_now() >> HEAT_TIME_SHIFT;
+    uint32_t page_len = 1u << heat_shift;
+    METRIC_ADD(heat[addr >> heat_shift].read_starts, 1);
+    while (sent) {
+        // Addresses wrap, as bsc_i2c_write() increments them.
+        uint32_t n = page_len - (addr & (page_len - 1));
+        if (n > sent) {
+            n = sent;
+        }
+        struct heat_counters * page = &heat[addr >> heat_shift];
+        METRIC_ADD(page->bytes_read, n);
+        METRIC_SET(page->last_access, now);
+        addr += n;
+        sent -= n;
+    }
+}
+
+bool bsc_i2c_enable_heat_map()
+{
+    if (heat == NULL) {
+        size_t page_len = heat_cfg_page;
+        if (page_len > (size_t)((addr_t)~0) + 1 || (page_len & (page_len - 1))) {
+            fprintf(stderr, TAG ": Invalid heat map page size %zu\n", page_len);
+            return false;
+        }
+        unsigned shift = 0;
+        while ((1u << shift) < page_len) {
+            shift++;
+        }
+        size_t pages = ((size_t)((addr_t)~0) + 1) >> shift;
+        if ((heat = arena_alloc(pages * sizeof(*heat))) == NULL) {
+            return false;
+        }
+        heat_shift = shift;
+    }
+    heat_enabled = true;
+    return true;
+}
+
+void bsc_i2c_disable_heat_map()
+{
+    heat_enabled = false;
+}
+
+void bsc_i2c_reset_heat_map()
+{
+    if (heat) {
+        size_t pages = ((size_t)((addr_t)~0) + 1) >> heat_shift;
+        for (size_t i = 0; i < pages; i++) {
+            METRIC_SET(heat[i].read_starts, 0);
+            METRIC_SET(heat[i].bytes_read, 0);
+            METRIC_SET(heat[i].writes, 0);
+            METRIC_SET(heat[i].last_access, 0);
+        }
+    }
+}
+
+void bsc_i2c_heat_note_write(addr_t addr)
+{
+    if (!heat_enabled) {
+        return;
+    }
+    struct heat_counters * page = &heat[addr >> heat_shift];
+    atomic_fetch_add_explicit(&page->writes, 1, memory_order_relaxed);
+    METRIC_SET(page->last_access, pi2c_now() >> HEAT_TIME_SHIFT);
+}
+
+static int heat_compare(const void * a, const void * b, void * arg)
+{
+    const struct bsc_i2c_heat_page * pa = a;
+    const struct bsc_i2c_heat_page * pb = b;
+    uint64_t va, vb;
+    switch (*(enum bsc_i2c_heat_key *)arg) {
+        case BSC_HEAT_BY_READ_STARTS:
+            va = pa->read_starts;
+            vb = pb->read_starts;
+            break;
+        case BSC_HEAT_BY_BYTES_READ:
+            va = pa->bytes_read;
+            vb = pb->bytes_read;
+            break;
+        case BSC_HEAT_BY_WRITES:
+            va = pa->writes;
+            vb = pb->writes;
+            break;
+        case BSC_HEAT_BY_RECENT:
+            va = pa->last_access_ns;
+            vb = pb->last_access_ns;
+            break;
+        default:
+            // Lowest address first
+            va = pb->first;
+            vb = pa->first;
+            break;
+    }
+    if (va != vb) {
+        return (va > vb) ? -1 : 1;
+    }
+    return (int)pa->first - (int)pb->first;
+}
+
+size_t bsc_i2c_heat_report(struct bsc_i2c_heat_page * out, size_t max, enum bsc_i2c_heat_key key)
+{
+    if (heat == NULL || max == 0) {
+        return 0;
+    }
+    size_t pages = ((size_t)((addr_t)~0) + 1) >> heat_shift;
+    struct bsc_i2c_heat_page * all = malloc(pages * sizeof(*all));
+    if (all == NULL) {
+        perror(TAG ": Unable to allocate the heat map report");
+        return 0;
+    }
+    // Times are kept modulo 2^32 units, which is about 52 days. Take them as
+    // the most recent time matching.
+    uint64_t now = pi2c_now();
+    size_t used = 0;
+    for (size_t i = 0; i < pages; i++) {
+        uint32_t read_starts = METRIC_GET(heat[i].read_starts);
+        uint32_t bytes_read = METRIC_GET(heat[i].bytes_read);
+        uint32_t writes = METRIC_GET(heat[i].writes);
+        if (read_starts || bytes_read || writes) {
+            all[used].first = i << heat_shift;
+            all[used].read_starts = read_starts;
+            all[used].bytes_read = bytes_read;
+            all[used].writes = writes;
+            uint32_t age = (uint32_t)(now >> HEAT_TIME_SHIFT) - METRIC_GET(heat[i].last_access);
+            if ((int32_t)age < 0) {
+                age = 0; // Accessed since now was read
+            }
+            all[used].last_access_ns = now - ((uint64_t)age << HEAT_TIME_SHIFT);
+            used++;
+        }
+    }
+    qsort_r(all, used, sizeof(*all), heat_compare, &key);
+    if (used > max) {
+        used = max;
+    }
+    memcpy(out, all, used * sizeof(*all));
+    free(all);
+    return used;
+}
+
+bool bsc_i2c_save_heat_report(const char * path, enum bsc_i2c_heat_key key)
+{
+    size_t pages = heat ? ((size_t)((addr_t)~0) + 1) >> heat_shift : 1;
+    struct bsc_i2c_heat_page * report = malloc(pages * sizeof(*report));
+    if (report == NULL) {
+        perror(TAG ": Unable to allocate the heat map report");
+        return false;
+    }
+    size_t used = bsc_i2c_heat_report(report, pages, key);
+    FILE * f = fopen(path, "w");
+    if (f == NULL) {
+        perror(TAG ": Unable to write heat map report");
+        free(report);
+        return false;
+    }
+    uint64_t now = pi2c_now();
+    fprintf(f, "# first last read_starts bytes_read writes idle_ms\n");
+    for (size_t i = 0; i < used; i++) {
+        fprintf(f, "0x%04x 0x%04x %u %u %u %llu\n", report[i].first,
+                (unsigned)(report[i].first + (1u << heat_shift) - 1),
+                report[i].read_starts, report[i].bytes_read, report[i].writes,
+                (unsigned long long)((now - report[i].last_access_ns) / 1000000));
+    }
+    free(report);
+    if (fclose(f) != 0) {
+        perror(TAG ": Unable to write heat map report");
+        return false;
+    }
+    return true;
+}
+
+// Start discarding the master write in progress, up to its end.
+static void start_resync()
+{
+    if (!rx_resync) {
+        rx_resync = true;
+        rx_resync_start = pi2c_now();
+        METRIC_ADD(resync.corrupt, 1);
+        if (tap_enabled) {
+            if (!tap_open_rec || tap_rec.dir != BSC_TAP_RX) {
+                tap_open(BSC_TAP_RX);
+            }
+            tap_rec.flags |= BSC_TAP_CORRUPT;
+        }
+    }
+    rx_resync_count++;
+}
+
+// Count an RX overrun, if the sticky flag shows one, and start discarding
+// the master write it hit. Returns whether there was one.
+static bool check_overrun()
+{
+    if (!(BSC_RD(BSC_RSR) & RSR_OE)) {
+        return false;
+    }
+    // We overflowed. :-( Count it rather than print, the caller hears of it
+    // through the counters and BSC_EVENT_ERROR.
+    METRIC_ADD(diag.overruns, 1);
+    post_event(BSC_EVENT_ERROR);
+    BSC_WR(BSC_RSR, BSC_RD(BSC_RSR) & ~RSR_OE); // Clear the overflow error
+    start_resync();
+    return true;
+}
+
+// Discard what is left of a corrupt master write. Returns true once it has
+// ended, so whatever arrives next starts a new write.
+static bool resync_rx()
+{
+    // The FIFO can't mark where one write ends and the next begins. The end
+    // is a flag register read showing the FIFO empty and the bus idle at
+    // the same time. Bound the work, a busy master may keep us draining.
+    for (unsigned n = 0; n < 2 * FIFO_LEN; n++) {
+        uint32_t fr = BSC_RD(BSC_FR);
+        if (dma_enabled) {
+            mmio_barrier(); // BSC to DMA
+            size_t head = dma_rx_head();
+            METRIC_ADD(resync.bytes_discarded, (head + dma_cfg.rx_ring_len - dma_rx_tail) % dma_cfg.rx_ring_len);
+            for (; tap_enabled && dma_rx_tail != head; dma_rx_tail = (dma_rx_tail + 1) % dma_cfg.rx_ring_len) {
+                uint8_t byte = dma_ring[dma_rx_tail] & 0xFF;
+                tap_rx(&byte, 1);
+            }
+            dma_rx_tail = head;
+            mmio_barrier(); // DMA to BSC
+        } else if (!(fr & FR_RXFE)) {
+            uint8_t byte = BSC_RD(BSC_DR) & 0xFF;
+            if (tap_enabled) {
+                tap_rx(&byte, 1);
+            }
+            METRIC_ADD(resync.bytes_discarded, 1);
+            continue;
+        }
+        if (!(fr & FR_RXFE)) {
+            continue; // The DMA has yet to move these
+        }
+        if (fr & FR_RXBUSY) {
+            return false;
+        }
+        rx_resync = false;
+        if (tap_enabled) {
+            tap_rx_end(fr);
+        }
+        uint32_t latency = (pi2c_now() - rx_resync_start) / 1000;
+        METRIC_SET(resync.last_latency_us, latency);
+        if (latency > METRIC_GET(resync.max_latency_us)) {
+            METRIC_SET(resync.max_latency_us, latency);
+        }
+        return true;
+    }
+    return false;
+}
+
+// Whether the bus has been busy without progress for longer than the
+// watchdog allows. progress is anything the caller counts as progress, on
+// top of the FIFO levels changing.
+static bool watchdog_stalled(uint32_t fr, uint32_t progress)
+{
+    if (!(fr & (FR_RXBUSY | FR_TXBUSY))) {
+        wd_stall_start = 0;
+        return false;
+    }
+    uint64_t key = ((uint64_t)progress << 32) | (fr & IDLE_ACTIVITY_MASK);
+    if (wd_stall_start == 0 || key != wd_key) {
+        wd_key = key;
+        wd_stall_start = pi2c_now();
+        return false;
+    }
+    return pi2c_now() - wd_stall_start > (uint64_t)watchdog_us * 1000;
+}
+
+// Get a stuck BSC going again, the way init_bsc_i2c_slv() started it.
+static void watchdog_reset(uint32_t fr)
+{
+    program_bsc();
+    // BRK does not clear the TX FIFO, see flush_tx_fifo().
+    flush_tx_fifo();
+
+    // BRK did clear the RX FIFO, so whatever write was being collected, or
+    // discarded, is gone.
+    if ((fr & FR_RXBUSY) || rx_txn_len) {
+        METRIC_ADD(resync.corrupt, 1);
+    }
+    rx_txn_len = 0;
+    rx_resync = false;
+    rx_sample_busy = false;
+    if (tap_enabled && tap_open_rec) {
+        tap_rec.flags |= BSC_TAP_CORRUPT;
+        if (tap_rec.dir == BSC_TAP_RX) {
+            tap_commit();
+        }
+    }
+
+    uint32_t outage = (pi2c_now() - wd_stall_start) / 1000;
+    METRIC_ADD(watchdog.resets, 1);
+    METRIC_SET(watchdog.last_outage_us, outage);
+    if (outage > METRIC_GET(watchdog.max_outage_us)) {
+        METRIC_SET(watchdog.max_outage_us, outage);
+    }
+    wd_stall_start = 0;
+    post_event(BSC_EVENT_ERROR);
+}
+
+// Watchdog check for the read loops, when they have nothing to return.
+static void watchdog_rx(uint32_t progress)
+{
+    uint32_t fr = BSC_RD(BSC_FR);
+    if (watchdog_stalled(fr, progress)) {
+        watchdog_reset(fr);
+    }
+}
+
+void bsc_i2c_set_watchdog(uint32_t timeout_us)
+{
+    watchdog_us = timeout_us;
+    wd_stall_start = 0;
+}
+
+void bsc_i2c_get_watchdog_stats(struct bsc_i2c_watchdog_stats * out)
+{
+    out->resets = METRIC_GET(watchdog.resets);
+    out->last_outage_us = METRIC_GET(watchdog.last_outage_us);
+    out->max_outage_us = METRIC_GET(watchdog.max_outage_us);
+}
+
+// Generate a specialized read/write loop for each feature combination.
+#define LOOP_SUFFIX min
+#define LOOP_TIMING 0
+#define LOOP_DIAG   0
+#define LOOP_TAP    0
+#include "pi2cslave_loop.inc"
+#undef LOOP_SUFFIX
+#undef LOOP_TIMING
+#undef LOOP_DIAG
+#undef LOOP_TAP
+
+#define LOOP_SUFFIX timing
+#define LOOP_TIMING 1
+#define LOOP_DIAG   0
+#define LOOP_TAP    0
+#include "pi2cslave_loop.inc"
+#undef LOOP_SUFFIX
+#undef LOOP_TIMING
+#undef LOOP_DIAG
+#undef LOOP_TAP
+
+#define LOOP_SUFFIX diag
+#define LOOP_TIMING 0
+#define LOOP_DIAG   1
+#define LOOP_TAP    0
+#include "pi2cslave_loop.inc"
+#undef LOOP_SUFFIX
+#undef LOOP_TIMING
+#undef LOOP_DIAG
+#undef LOOP_TAP
+
+#define LOOP_SUFFIX full
+#define LOOP_TIMING 1
+#define LOOP_DIAG   1
+#define LOOP_TAP    0
+#include "pi2cslave_loop.inc"
+#undef LOOP_SUFFIX
+#undef LOOP_TIMING
+#undef LOOP_DIAG
+#undef LOOP_TAP
+
+#define LOOP_SUFFIX tap
+#define LOOP_TIMING 0
+#define LOOP_DIAG   0
+#define LOOP_TAP    1
+#include "pi2cslave_loop.inc"
+#undef LOOP_SUFFIX
+#undef LOOP_TIMING
+#undef LOOP_DIAG
+#undef LOOP_TAP
+
+#define LOOP_SUFFIX timing_tap
+#define LOOP_TIMING 1
+#define LOOP_DIAG   0
+#define LOOP_TAP    1
+#include "pi2cslave_loop.inc"
+#undef LOOP_SUFFIX
+#undef LOOP_TIMING
+#undef LOOP_DIAG
+#undef LOOP_TAP
+
+#define LOOP_SUFFIX diag_tap
+#define LOOP_TIMING 0
+#define LOOP_DIAG   1
+#define LOOP_TAP    1
+#include "pi2cslave_loop.inc"
+#undef LOOP_SUFFIX
+#undef LOOP_TIMING
+#undef LOOP_DIAG
+#undef LOOP_TAP
+
+#define LOOP_SUFFIX full_tap
+#define LOOP_TIMING 1
+#define LOOP_DIAG   1
+#define LOOP_TAP    1
+#include "pi2cslave_loop.inc"
+#undef LOOP_SUFFIX
+#undef LOOP_TIMING
+#undef LOOP_DIAG
+#undef LOOP_TAP
+
+// Indexed by LOOP_TIMING | LOOP_DIAG << 1 | LOOP_TAP << 2
+static int (* const read_poll_variants[])(uint8_t *, size_t) = {
+    read_poll_min, read_poll_timing, read_poll_diag, read_poll_full,
+    read_poll_tap, read_poll_timing_tap, read_poll_diag_tap, read_poll_full_tap,
+};
+static int (* const write_variants[])(tx_callback, uint16_t) = {
+    write_min, write_timing, write_diag, write_full,
+    write_tap, write_timing_tap, write_diag_tap, write_full_tap,
+};
+// The kernel driver services the FIFOs from its interrupt handler, so these
+// only move bytes between the caller and the device. A failed read or write
+// means the device is gone, there is no FIFO state to recover. The caller
+// gets BSC_EVENT_ERROR and errno, nothing is printed from the service path.
+static int read_poll_dev(uint8_t * buf, size_t len)
+{
+    ssize_t n = read(dev_fd, buf, len);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EINTR) {
+            return 0;
+        }
+        post_event(BSC_EVENT_ERROR);
+        return -1;
+    }
+    if (tap_enabled && n > 0) {
+        // The driver hands over each write whole.
+        tap_rx(buf, n);
+        tap_commit();
+    }
+    return n;
+}
+
+static int write_dev(tx_callback cb, uint16_t addr)
+{
+    uint8_t buf[FIFO_LEN];
+    size_t pending = 0; // Bytes taken from cb that the driver has not accepted
+    int written = 0;
+    bool more = true;
+    bool primed = false;
+    uint64_t start = timing_enabled ? pi2c_now() : 0;
+
+    if (diag_enabled) {
+        refresh_diag_image();
+    }
+    if (tap_enabled) {
+        tap_open(BSC_TAP_TX);
+    }
+
+    // Keep replying until the master writes to us, sleeping in the kernel
+    // until it does, or the driver has room for more.
+    while (!bsc_i2c_stop_requested()) {
+        pthread_testcancel();
+        METRIC_ADD(tx_stats.wakeups, 1);
+        // Give the driver all it takes. Its buffer bounds how far the
+        // callback runs ahead of the master, what the master doesn't read
+        // is dropped below if the driver can flush.
+        bool full = false;
+        bool failed = false;
+        while (!full && (more || pending)) {
+            while (more && pending < sizeof(buf)) {
+                addr_t diag_off = addr - diag_base;
+                if (diag_enabled && diag_off < BSC_DIAG_LEN) {
+                    buf[pending] = diag_image[diag_off];
+                } else if (!call_tx(cb, addr, &buf[pending])) {
+                    more = false;
+                    break;
+                }
+                addr++;
+                pending++;
+            }
+            if (!pending) {
+                break;
+            }
+            ssize_t n = write(dev_fd, buf, pending);
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                if (errno == EAGAIN) {
+                    full = true;
+                    break;
+                }
+                failed = true;
+                break;
+            }
+            if (tap_enabled && (uint32_t)written < tap_record_max) {
+                size_t keep = tap_record_max - written;
+                memcpy(tap_data + written, buf, (size_t)n < keep ? (size_t)n : keep);
+            }
+            full = (size_t)n < pending;
+            memmove(buf, buf + n, pending - n);
+            pending -= n;
+            written += n;
+        }
+        if (failed) {
+            post_event(BSC_EVENT_ERROR);
+            break;
+        }
+        if (timing_enabled && !primed && written > 0) {
+            primed = true;
+            note_turnaround((pi2c_now() - start) / 1000);
+        }
+        gpio_service();
+        if (dev_poll(full ? POLLIN | POLLOUT : POLLIN, -1) & (POLLIN | POLLERR | POLLHUP)) {
+            break;
+        }
+    }
+
+    // The driver has no shift register to account for, what it still holds
+    // is exactly what the master did not read.
+    int queued = 0;
+    if ((dev_has_outq && ioctl(dev_fd, TIOCOUTQ, &queued) < 0) ||
+        (dev_has_flush && tcflush(dev_fd, TCOFLUSH) < 0)) {
+        // The device is gone, what the master read can't be known.
+        post_event(BSC_EVENT_ERROR);
+        queued = 0;
+    }
+    int ret = written - queued;
+
+    if (ret < 0) {
+        ret = 0;
+    }
+    METRIC_ADD(tx_stats.bytes, ret);
+    if (tap_enabled) {
+        tap_tx_done(ret);
+    }
+    atomic_store_explicit(&last_tx_count, ret, memory_order_relaxed);
+    post_event(BSC_EVENT_TX_DONE);
+    return ret;
+}
+
+#ifndef PI2C_SIM
+// Make one VideoCore mailbox property call. Returns the first word of the
+// response, which is 0 on failure for every call we make.
+static uint32_t mbox_call(int fd, uint32_t tag, unsigned nargs, const uint32_t * args)
+{
+    uint32_t msg[10];
+    unsigned i = 0;
+    msg[i++] = 0; // Message size, filled in below
+    msg[i++] = 0; // Process request
+    msg[i++] = tag;
+    msg[i++] = nargs * sizeof(uint32_t); // Value buffer size
+    msg[i++] = nargs * sizeof(uint32_t); // Request size
+    for (unsigned a = 0; a < nargs; a++) {
+        msg[i++] = args[a];
+    }
+    msg[i++] = 0; // End tag
+    msg[0] = i * sizeof(uint32_t);
+    if (ioctl(fd, MBOX_PROPERTY, msg) < 0) {
+        return 0;
+    }
+    return msg[5];
+}
+
+static void mbox_release(int fd, uint32_t handle, bool locked)
+{
+    if (locked) {
+        mbox_call(fd, MBOX_MEM_UNLOCK, 1, &handle);
+    }
+    mbox_call(fd, MBOX_MEM_RELEASE, 1, &handle);
+}
+#endif
+
+// Allocate memory the DMA controller can reach. On target, the firmware
+// allocates and locks it, and we map its uncached alias through /dev/mem, so
+// neither side needs cache maintenance.
+static bool dma_alloc(struct dma_mem * mem, size_t len)
+{
+#ifdef PI2C_SIM
+    mem->virt = pi2c_sim_dma_alloc(len, &mem->bus);
+    mem->len = len;
+    if (mem->virt == NULL) {
+        fprintf(stderr, TAG ": Unable to allocate %zu bytes of DMA memory\n", len);
+        return false;
+    }
+    return true;
+#else
+    int fd = open("/dev/vcio", O_RDWR | O_CLOEXEC);
+    if (fd < 0) {
+        perror(TAG ": Unable to open /dev/vcio");
+        return false;
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    len = (len + page - 1) & ~(page - 1);
+    uint32_t flags = (soc_info.soc == BCM_SOC_2835) ? MBOX_MEM_L1_NONALLOC : MBOX_MEM_DIRECT;
+    uint32_t alloc[3] = {len, page, flags};
+    mem->handle = mbox_call(fd, MBOX_MEM_ALLOC, 3, alloc);
+    if (mem->handle == 0) {
+        fprintf(stderr, TAG ": Unable to allocate %zu bytes of DMA memory\n", len);
+        close(fd);
+        return false;
+    }
+    mem->bus = mbox_call(fd, MBOX_MEM_LOCK, 1, &mem->handle);
+    if (mem->bus == 0) {
+        fprintf(stderr, TAG ": Unable to lock DMA memory\n");
+        mbox_release(fd, mem->handle, false);
+        close(fd);
+        return false;
+    }
+    mem->virt = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_SHARED, mem_fd, BUS_TO_PHYS(mem->bus));
+    if (mem->virt == MAP_FAILED) {
+        perror(TAG ": Unable to mmap DMA memory");
+        mbox_release(fd, mem->handle, true);
+        close(fd);
+        mem->virt = NULL;
+        return false;
+    }
+    mem->len = len;
+    close(fd);
+    return true;
+#endif
+}
+
+static void dma_free(struct dma_mem * mem)
+{
+    if (mem->virt == NULL) {
+        return;
+    }
+#ifdef PI2C_SIM
+    pi2c_sim_dma_free(mem->virt);
+#else
+    munmap(mem->virt, mem->len);
+    int fd = open("/dev/vcio", O_RDWR | O_CLOEXEC);
+    if (fd >= 0) {
+        mbox_release(fd, mem->handle, true);
+        close(fd);
+    }
+#endif
+    memset(mem, 0, sizeof(*mem));
+}
+
+static uint32_t dma_cb_bus(unsigned cb)
+{
+    return dma_mem.bus + cb * sizeof(struct bcm_dma_cb);
+}
+
+static void dma_set_cb(unsigned cb, uint32_t ti, uint32_t src, uint32_t dest, uint32_t len, uint32_t next)
+{
+    dma_cbs[cb].ti = ti;
+    dma_cbs[cb].source_ad = src;
+    dma_cbs[cb].dest_ad = dest;
+    dma_cbs[cb].txfr_len = len;
+    dma_cbs[cb].stride = 0;
+    dma_cbs[cb].nextconbk = next;
+}
+
+bool bsc_i2c_start_dma(const struct bsc_i2c_dma_config * cfg)
+{
+    if (!cr_shadow) {
+        fprintf(stderr, TAG ": init_bsc_i2c_slv() has not been called\n");
+        return false;
+    }
+    if (dma_enabled) {
+        fprintf(stderr, TAG ": DMA mode is already on\n");
+        return false;
+    }
+    if (cfg->tx_channel >= DMA_CHANNELS || cfg->rx_channel >= DMA_CHANNELS ||
+        cfg->tx_channel == cfg->rx_channel) {
+        fprintf(stderr, TAG ": Invalid DMA channels %u and %u\n", cfg->tx_channel, cfg->rx_channel);
+        return false;
+    }
+    if (cfg->image_len == 0 || cfg->image_len > (size_t)((addr_t)~0) + 1 || cfg->rx_ring_len == 0) {
+        fprintf(stderr, TAG ": Invalid DMA image or ring length\n");
+        return false;
+    }
+
+    size_t cb_len = DMA_CB_COUNT * sizeof(struct bcm_dma_cb);
+    if (!dma_alloc(&dma_mem, cb_len + (cfg->image_len + cfg->rx_ring_len) * sizeof(uint32_t))) {
+        return false;
+    }
+    dma_cfg = *cfg;
+    dma_cbs = dma_mem.virt;
+    dma_image = (volatile uint32_t *)((uint8_t *)dma_mem.virt + cb_len);
+    dma_ring = dma_image + cfg->image_len;
+    dma_image_bus = dma_mem.bus + cb_len;
+    dma_ring_bus = dma_image_bus + cfg->image_len * sizeof(uint32_t);
+    dma_rx_tail = 0;
+    for (size_t i = 0; i < cfg->image_len; i++) {
+        dma_image[i] = 0;
+    }
+
+    dma_set_cb(DMA_CB_RX,
+               DMA_TI_SRC_DREQ | (DMA_DREQ_BSC_RX << DMA_TI_PERMAP_OFF) | DMA_TI_DEST_INC | DMA_TI_WAIT_RESP,
+               BSC_DR_BUS, dma_ring_bus, cfg->rx_ring_len * sizeof(uint32_t), dma_cb_bus(DMA_CB_RX));
+    dma_set_cb(DMA_CB_TX_WRAP,
+               DMA_TI_DEST_DREQ | (DMA_DREQ_BSC_TX << DMA_TI_PERMAP_OFF) | DMA_TI_SRC_INC | DMA_TI_WAIT_RESP,
+               dma_image_bus, BSC_DR_BUS, cfg->image_len * sizeof(uint32_t), dma_cb_bus(DMA_CB_TX_WRAP));
+    mmio_barrier(); // Control blocks before the DMA controller loads them
+
+    DMA_WR(cfg->tx_channel, DMA_CS, DMA_CS_RESET);
+    DMA_WR(cfg->rx_channel, DMA_CS, DMA_CS_RESET);
+    DMA_WR(cfg->rx_channel, DMA_CONBLK_AD, dma_cb_bus(DMA_CB_RX));
+    DMA_WR(cfg->rx_channel, DMA_CS, DMA_CS_WAIT_OUTSTANDING | DMA_CS_ACTIVE);
+    mmio_barrier(); // DMA to BSC
+    BSC_WR(BSC_DMACR, DMACR_RXDMAE);
+    mmio_barrier(); // BSC to whatever the caller touches next
+
+    dma_enabled = true;
+    select_loops();
+    return true;
+}
+
+void bsc_i2c_stop_dma()
+{
+    if (!dma_enabled) {
+        return;
+    }
+    BSC_WR(BSC_DMACR, 0);
+    mmio_barrier(); // BSC to DMA
+    DMA_WR(dma_cfg.tx_channel, DMA_CS, DMA_CS_RESET);
+    DMA_WR(dma_cfg.rx_channel, DMA_CS, DMA_CS_RESET);
+    mmio_barrier(); // DMA to whatever the caller touches next
+
+    dma_free(&dma_mem);
+    dma_cbs = NULL;
+    dma_image = NULL;
+    dma_ring = NULL;
+    dma_enabled = false;
+    select_loops();
+}
+
+bool bsc_i2c_dma_set_image(addr_t addr, const uint8_t * data, size_t len)
+{
+    if (!dma_enabled || (size_t)addr + len > dma_cfg.image_len) {
+        fprintf(stderr, TAG ": %zu bytes at 0x%04x are outside the DMA image\n", len, addr);
+        return false;
+    }
+    for (size_t i = 0; i < len; i++) {
+        dma_image[addr + i] = data[i];
+    }
+    return true;
+}
+
+// The DMA controller moves every byte, so these only see the ring and the
+// transaction boundaries.
+static int read_poll_dma(uint8_t * buf, size_t len)
+{
+    // An overrun here means the DMA did not keep up. :-(
+    check_overrun();
+    if (rx_resync && !resync_rx()) {
+        return 0;
+    }
+    mmio_barrier(); // BSC to DMA
+
+    size_t head = dma_rx_head();
+    size_t read = 0;
+    for (; len && dma_rx_tail != head; len--) {
+        buf[read++] = dma_ring[dma_rx_tail] & 0xFF;
+        if (++dma_rx_tail == dma_cfg.rx_ring_len) {
+            dma_rx_tail = 0;
+        }
+    }
+    if (tap_enabled) {
+        if (read > 0) {
+            tap_rx(buf, read);
+        }
+        if (tap_open_rec && dma_rx_tail == head) {
+            mmio_barrier(); // DMA to BSC
+            tap_rx_end(BSC_RD(BSC_FR));
+        }
+    }
+    return read;
+}
+
+static int write_dma(tx_callback cb, uint16_t addr)
+{
+    if (cb != NULL) {
+        fprintf(stderr, TAG ": DMA mode serves the image, bsc_i2c_write() takes no tx_callback\n");
+        return -1;
+    }
+    unsigned tx = dma_cfg.tx_channel;
+    size_t start = addr % dma_cfg.image_len;
+    size_t head_len = dma_cfg.image_len - start;
+
+    if (diag_enabled && (size_t)diag_base + BSC_DIAG_LEN <= dma_cfg.image_len) {
+        refresh_diag_image();
+        bsc_i2c_dma_set_image(diag_base, diag_image, BSC_DIAG_LEN);
+    }
+    if (tap_enabled) {
+        tap_open(BSC_TAP_TX);
+    }
+
+    // Leftovers mean the last flush gave up. Don't serve them as fresh data.
+    if (!(BSC_RD(BSC_FR) & FR_TXFE)) {
+        flush_tx_fifo();
+    }
+    mmio_barrier(); // BSC to DMA
+
+    uint32_t head_src = dma_image_bus + start * sizeof(uint32_t);
+    dma_set_cb(DMA_CB_TX_HEAD,
+               DMA_TI_DEST_DREQ | (DMA_DREQ_BSC_TX << DMA_TI_PERMAP_OFF) | DMA_TI_SRC_INC | DMA_TI_WAIT_RESP,
+               head_src, BSC_DR_BUS, head_len * sizeof(uint32_t), dma_cb_bus(DMA_CB_TX_WRAP));
+    mmio_barrier(); // Control block before the DMA controller loads it
+    DMA_WR(tx, DMA_CS, DMA_CS_RESET);
+    DMA_WR(tx, DMA_CONBLK_AD, dma_cb_bus(DMA_CB_TX_HEAD));
+    DMA_WR(tx, DMA_CS, DMA_CS_WAIT_OUTSTANDING | DMA_CS_ACTIVE);
+    mmio_barrier(); // DMA to BSC
+    BSC_WR(BSC_DMACR, DMACR_RXDMAE | DMACR_TXDMAE);
+
+    // The DMA keeps the TX FIFO full from here on. We only wake up to see
+    // whether the master started writing, which ends its read.
+    for (;;) {
+        mmio_barrier(); // BSC to DMA
+        if (dma_rx_head() != dma_rx_tail || bsc_i2c_stop_requested()) {
+            break;
+        }
+        pthread_testcancel();
+        METRIC_ADD(tx_stats.wakeups, 1);
+        mmio_barrier(); // DMA to BSC
+        if (BSC_RD(BSC_RSR) & RSR_UE) {
+            // The DMA did not keep up. :-(
+            METRIC_ADD(diag.underruns, 1);
+            post_event(BSC_EVENT_ERROR);
+            BSC_WR(BSC_RSR, BSC_RD(BSC_RSR) & ~RSR_UE); // Clear the underrun error
+        }
+        gpio_service();
+        service_wait(idle_period(&service_idle, BSC_RD(BSC_FR)));
+    }
+
+    // Stop feeding the FIFO, then see how far the channel got.
+    mmio_barrier(); // DMA to BSC
+    BSC_WR(BSC_DMACR, DMACR_RXDMAE);
+    mmio_barrier(); // BSC to DMA
+    DMA_WR(tx, DMA_CS, DMA_CS_WAIT_OUTSTANDING); // Pause
+    uint32_t cb_ad = DMA_RD(tx, DMA_CONBLK_AD);
+    uint32_t src = DMA_RD(tx, DMA_SOURCE_AD);
+    DMA_WR(tx, DMA_CS, DMA_CS_RESET);
+    mmio_barrier(); // DMA to BSC
+
+    // Full wraps of the image can't be told apart, so a master reading
+    // more than the whole image is credited with less than it read.
+    size_t moved = (cb_ad == dma_cb_bus(DMA_CB_TX_HEAD)) ?
+                   (src - head_src) / sizeof(uint32_t) :
+                   head_len + (src - dma_image_bus) / sizeof(uint32_t);
+    // As with the CPU loops, one more byte sits in the shift register.
+    int ret = (int)moved - GET_FR_TXFLEVEL() - 1;
+
+    flush_tx_fifo();
+
+    if (ret < 0) {
+        ret = 0;
+    }
+    METRIC_ADD(tx_stats.bytes, ret);
+    if (tap_enabled) {
+        // What the master got is the image from addr on, wrapping around.
+        for (uint32_t i = 0; i < (uint32_t)ret && i < tap_record_max; i++) {
+            tap_data[i] = dma_image[(start + i) % dma_cfg.image_len] & 0xFF;
+        }
+        tap_tx_done(ret);
+    }
+    atomic_store_explicit(&last_tx_count, ret, memory_order_relaxed);
+    post_event(BSC_EVENT_TX_DONE);
+    return ret;
+}
+
+static int (* read_poll_impl)(uint8_t *, size_t) = read_poll_timing;
+static int (* write_impl)(tx_callback, uint16_t) = write_timing;
+
+// Pick the loops matching the enabled features. Called whenever a feature
+// is switched on or off, never per transfer.
+static void select_loops()
+{
+    if (dev_fd >= 0) {
+        read_poll_impl = read_poll_dev;
+        write_impl = write_dev;
+        return;
+    }
+    if (dma_enabled) {
+        read_poll_impl = read_poll_dma;
+        write_impl = write_dma;
+        return;
+    }
+    int variant = (timing_enabled ? 1 : 0) | (diag_enabled ? 2 : 0) | (tap_enabled ? 4 : 0);
+    read_poll_impl = read_poll_variants[variant];
+    write_impl = write_variants[variant];
+}
+
+void bsc_i2c_set_timing(bool enable)
+{
+    timing_enabled = enable;
+    select_loops();
+}
+
+int bsc_i2c_read_poll(uint8_t * buf, size_t len)
+{
+    pthread_testcancel();
+    if (len == 0 || buf == NULL || bsc_i2c_stop_requested()) {
+        return 0;
+    }
+    SERVICE_ENTER();
+    int ret = read_poll_impl(buf, len);
+    if (ret > 0) {
+        METRIC_ADD(metrics.rx_bytes, ret);
+    }
+    SERVICE_EXIT();
+    return ret;
+}
+
+// Whether the master write being collected is over: nothing left to read
+// and the bus idle, seen in one flag register read.
+static bool rx_ended()
+{
+    if (dev_fd >= 0) {
+        // The driver hands over each write whole.
+        return !dev_wait(0);
+    }
+    uint32_t fr = BSC_RD(BSC_FR);
+    if (dma_enabled) {
+        mmio_barrier(); // BSC to DMA
+        bool ring_empty = dma_rx_head() == dma_rx_tail;
+        mmio_barrier(); // DMA to BSC
+        return ring_empty && (fr & FR_RXFE) && !(fr & FR_RXBUSY);
+    }
+    return (fr & FR_RXFE) && !(fr & FR_RXBUSY);
+}
+
+int bsc_i2c_read_transaction(uint8_t * buf, size_t len)
+{
+    pthread_testcancel();
+    if (len == 0 || buf == NULL || bsc_i2c_stop_requested()) {
+        return 0;
+    }
+    SERVICE_ENTER();
+    int ret = 0;
+    unsigned resyncs = rx_resync_count;
+    if (rx_txn_len < len) {
+        int got = read_poll_impl(buf + rx_txn_len, len - rx_txn_len);
+        if (got < 0) {
+            SERVICE_EXIT();
+            return got;
+        }
+        if (got > 0) {
+            METRIC_ADD(metrics.rx_bytes, got);
+            if (rx_resync_count != resyncs) {
+                // What we had collected was part of a corrupt write. The
+                // bytes just read came after it ended.
+                memmove(buf, buf + rx_txn_len, got);
+                rx_txn_len = 0;
+            }
+            rx_txn_len += got;
+        } else if (rx_resync_count != resyncs) {
+            rx_txn_len = 0;
+        }
+    } else if (!rx_ended()) {
+        // Longer than buf. Rather than hand over half of it, treat it like
+        // an overrun.
+        rx_txn_len = 0;
+        start_resync();
+    }
+    if (rx_txn_len && !rx_resync && rx_ended()) {
+        // The read above only checked for an overrun before draining. One
+        // since then hit this write, which is over, so drop it whole.
+        if (dev_fd < 0 && check_overrun()) {
+            rx_txn_len = 0;
+        } else {
+            ret = rx_txn_len;
+            rx_txn_len = 0;
+        }
+    }
+    SERVICE_EXIT();
+    return ret;
+}
+
+void bsc_i2c_get_resync_stats(struct bsc_i2c_resync_stats * out)
+{
+    out->corrupt = METRIC_GET(resync.corrupt);
+    out->bytes_discarded = METRIC_GET(resync.bytes_discarded);
+    out->last_latency_us = METRIC_GET(resync.last_latency_us);
+    out->max_latency_us = METRIC_GET(resync.max_latency_us);
+}
+
+int bsc_i2c_write(tx_callback cb, uint16_t addr)
+{
+    pthread_testcancel();
+    int ret;
+    // If we are canceled while sleeping, don't leave stale bytes queued for
+    // the next master read.
+    pthread_cleanup_push(flush_tx_cleanup, NULL);
+    SERVICE_ENTER();
+    ret = write_impl(cb, addr);
+    // Changes the last callback queued after the loop's final service.
+    gpio_service();
+    METRIC_ADD(metrics.write_calls, 1);
+    if (ret > 0) {
+        METRIC_ADD(metrics.master_reads, 1);
+    }
+    if (heat_enabled && ret > 0) {
+        heat_note_read(addr, ret);
+    }
+    SERVICE_EXIT();
+    pthread_cleanup_pop(0);
+    return ret;
 }
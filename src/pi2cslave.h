@@ -18,11 +18,26 @@
 
 // Constants and functions relating to the BCM BSC (Broadcom Serial Controller)
 
-#define BCM_IO_BASE (0x3F000000)
-#define GPIO_BASE   (BCM_IO_BASE + 0x200000)
+#define BCM_IO_BASE (0x3F000000) ///< Default peripheral base, used if detection fails
+#define GPIO_OFFSET (0x200000)   ///< GPIO offset from the peripheral base
+#define GPIO_BASE   (BCM_IO_BASE + GPIO_OFFSET)
 #define GPIO_LEN    (0xF4) ///< I think this number is too big...
-#define BSC_BASE    (BCM_IO_BASE + 0x214000)
+#define BSC_OFFSET  (0x214000)   ///< BSC offset from the peripheral base
+#define BSC_BASE    (BCM_IO_BASE + BSC_OFFSET)
 #define BSC_LEN     (0x40)
+#define ST_OFFSET   (0x3000)     ///< System timer offset from the peripheral base
+#define ST_LEN      (0x1C)
+#define DMA_OFFSET  (0x7000)     ///< DMA controller offset from the peripheral base
+#define DMA_CHAN_LEN (0x100)     ///< Register block of each DMA channel
+#define DMA_CHANNELS (15)        ///< Channels 0 to 14, all in the DMA_OFFSET page
+#define BCM_BUS_IO_BASE (0x7E000000) ///< Peripheral base as the DMA controller sees it
+
+#define BCM2835_IO_BASE (0x20000000) ///< Pi 1 and Zero
+#define BCM2836_IO_BASE (0x3F000000) ///< Pi 2
+#define BCM2837_IO_BASE (0x3F000000) ///< Pi 3 and Zero 2
+#define BCM2711_IO_BASE (0xFE000000) ///< Pi 4
+
+#define BCM_DEVICE_TREE "/proc/device-tree" ///< Where bcm_detect_soc() looks by default
 
 #define GPIO_COUNT        (28)   ///< Total number of user accessable GPIOs
 #define GPSET0            (0x1C) ///< Bits to set GPIOs 0-31
@@ -39,6 +54,8 @@
 #define GPIO_FUN_MASK     (0x7)
 #define GPIO_FUN_SHIFT    (3)
 #define GPIO_FUN_PER_REG  (10)  ///< Each FUN is 3 bits and a reg is 32. 10 fit.
+#define GPIO_FSEL_REGS    ((GPIO_COUNT + GPIO_FUN_PER_REG - 1) / GPIO_FUN_PER_REG)
+#define GPIO_QUEUE_LEN    (64)  ///< GPIO changes that can wait to be applied
 
 #define GPIO_SDA    (18) ///< GPIO pin number of BSC I2C slave SDA
 #define GPIO_SCL    (19) ///< GPIO pin number of BSC I2C slave SCL
@@ -89,6 +106,58 @@
 #define RSR_UE          (1<<1)     ///< TXUE TX Underrun Error
 #define RSR_OE          (1<<0)     ///< RXOE RX Overrun Error
 
+#define IFLS_RXIFLSEL_OFF (3)      ///< RXIFLSEL RX interrupt FIFO level select
+#define IFLS_TXIFLSEL_OFF (0)      ///< TXIFLSEL TX interrupt FIFO level select
+#define IFLS_RXIFLSEL   (0x7<<IFLS_RXIFLSEL_OFF)
+#define IFLS_TXIFLSEL   (0x7<<IFLS_TXIFLSEL_OFF)
+#define IFLS_1_8        (0)        ///< RX at least 1/8 full, or TX at most 1/8 full
+#define IFLS_1_4        (1)        ///< RX at least 1/4 full, or TX at most 1/4 full
+#define IFLS_1_2        (2)        ///< RX at least 1/2 full, or TX at most 1/2 full
+#define IFLS_3_4        (3)        ///< RX at least 3/4 full, or TX at most 3/4 full
+#define IFLS_7_8        (4)        ///< RX at least 7/8 full, or TX at most 7/8 full
+/// Bytes in the FIFO at an IFLS_* level
+#define IFLS_LEVEL_BYTES(sel) (FIFO_LEN * ((sel) < 2 ? (sel) + 1 : (sel) < 4 ? 2 * (sel) : 7) / 8)
+
+#define INT_OE          (1<<3)     ///< OE RX overrun, in IMSC, RIS, MIS and ICR
+#define INT_BE          (1<<2)     ///< BE Break error
+#define INT_TX          (1<<1)     ///< TX TX FIFO dropped to its IFLS level
+#define INT_RX          (1<<0)     ///< RX RX FIFO rose to its IFLS level
+
+#define ST_CLO      (1)  ///< System timer counter lower 32 bits
+#define ST_CHI      (2)  ///< System timer counter higher 32 bits
+
+#define DMACR_TXDMAE    (1<<1)     ///< TXDMAE Request DMA while the TX FIFO has room
+#define DMACR_RXDMAE    (1<<0)     ///< RXDMAE Request DMA while the RX FIFO has data
+
+#define DMA_CS          (0)  ///< Control and status
+#define DMA_CONBLK_AD   (1)  ///< Bus address of the current control block
+#define DMA_TI          (2)  ///< Transfer information, from the control block
+#define DMA_SOURCE_AD   (3)  ///< Current source address
+#define DMA_DEST_AD     (4)  ///< Current destination address
+#define DMA_TXFR_LEN    (5)  ///< Bytes left in the current control block
+#define DMA_STRIDE      (6)  ///< 2D mode stride, from the control block
+#define DMA_NEXTCONBK   (7)  ///< Bus address of the next control block, 0 to stop
+#define DMA_DEBUG       (8)  ///< Debug and error flags
+
+#define DMA_CS_RESET    (1<<31)    ///< RESET Reset the channel
+#define DMA_CS_ABORT    (1<<30)    ///< ABORT Abort the current control block
+#define DMA_CS_WAIT_OUTSTANDING (1<<28) ///< Wait for writes to complete before the next one
+#define DMA_CS_ERROR    (1<<8)     ///< ERROR The channel hit an error
+#define DMA_CS_INT      (1<<2)     ///< INT Interrupt status, write 1 to clear
+#define DMA_CS_END      (1<<1)     ///< END Transfer complete, write 1 to clear
+#define DMA_CS_ACTIVE   (1<<0)     ///< ACTIVE Run, or pause when cleared
+
+#define DMA_TI_PERMAP_OFF (16)     ///< PERMAP Peripheral whose DREQ paces the transfer
+#define DMA_TI_SRC_IGNORE (1<<11)  ///< SRC_IGNORE Do not read, write zeros
+#define DMA_TI_SRC_DREQ   (1<<10)  ///< SRC_DREQ Source reads are paced by DREQ
+#define DMA_TI_SRC_INC    (1<<8)   ///< SRC_INC Increment the source address
+#define DMA_TI_DEST_DREQ  (1<<6)   ///< DEST_DREQ Destination writes are paced by DREQ
+#define DMA_TI_DEST_INC   (1<<4)   ///< DEST_INC Increment the destination address
+#define DMA_TI_WAIT_RESP  (1<<3)   ///< WAIT_RESP Wait for each write to be acknowledged
+
+#define DMA_DREQ_BSC_TX   (8)      ///< DREQ of the BSC slave TX FIFO
+#define DMA_DREQ_BSC_RX   (9)      ///< DREQ of the BSC slave RX FIFO
+
 #define FIFO_LEN        (16) ///< Experimentally verified. Missing from BCM2537 ARM Peripherals spec.
 
 /**
@@ -100,6 +169,63 @@ enum gpio_state {
     GPIO_STATE_HIGH,
 };
 
+/**
+ * @brief The Broadcom SoCs libpi2cslave knows about
+ */
+enum bcm_soc {
+    BCM_SOC_UNKNOWN,
+    BCM_SOC_2835,
+    BCM_SOC_2836,
+    BCM_SOC_2837,
+    BCM_SOC_2711,
+};
+
+/**
+ * @brief Constants which differ between SoCs
+ */
+struct bcm_soc_info {
+    enum bcm_soc soc;
+    const char * name;
+    uint32_t io_base;   ///< Physical address of the peripheral block
+};
+
+/**
+ * @brief Where pi2c_now() gets its time from
+ */
+enum pi2c_clock {
+    PI2C_CLOCK_MONOTONIC, ///< clock_gettime(CLOCK_MONOTONIC), used when nothing better is mapped
+    PI2C_CLOCK_SYSTIMER,  ///< BCM system timer, 1 MHz
+    PI2C_CLOCK_CNTVCT,    ///< ARM generic timer virtual counter
+};
+
+/**
+ * @brief A DMA control block, 32 byte aligned in memory the DMA can reach
+ */
+struct bcm_dma_cb {
+    uint32_t ti;        ///< Transfer information, DMA_TI_*
+    uint32_t source_ad; ///< Bus address to read from
+    uint32_t dest_ad;   ///< Bus address to write to
+    uint32_t txfr_len;  ///< Bytes to transfer
+    uint32_t stride;    ///< 2D mode stride
+    uint32_t nextconbk; ///< Bus address of the next control block, 0 to stop
+    uint32_t reserved[2];
+};
+
+#define BSC_ARENA_DEFAULT_LEN  (64 * 1024) ///< Arena size used when init_bsc_i2c_arena() is not called
+#define BSC_TAP_DEFAULT_LEN    (16 * 1024) ///< Tap ring size used when bsc_i2c_config leaves it 0
+#define BSC_TAP_DEFAULT_RECORD (256)       ///< Longest tap record used when bsc_i2c_config leaves it 0
+#define BSC_HEAT_DEFAULT_PAGE  (256)       ///< Heat map page size used when bsc_i2c_config leaves it 0
+
+/**
+ * @brief Sizes of the library's internal buffers
+ */
+struct bsc_i2c_config {
+    size_t arena_len;      ///< Bytes of arena for internal buffers, 0 for BSC_ARENA_DEFAULT_LEN
+    size_t tap_len;        ///< Bytes of tap ring, rounded up to a power of 2, 0 for BSC_TAP_DEFAULT_LEN
+    size_t tap_record_max; ///< Bytes kept of one transfer in the tap, 0 for BSC_TAP_DEFAULT_RECORD
+    size_t heat_page_len;  ///< Addresses per heat map page, a power of 2, 0 for BSC_HEAT_DEFAULT_PAGE
+};
+
 typedef uint16_t addr_t;
 
 /**
@@ -107,8 +233,152 @@ typedef uint16_t addr_t;
  */
 typedef bool (*tx_callback)(addr_t addr, uint8_t * out);
 
+#define BSC_DIAG_LEN (20) ///< Size in bytes of the diagnostic register window
+
+/**
+ * @brief Health counters served through the diagnostic register window
+ *
+ * In the window each field is a big endian uint32_t, in the order listed here.
+ */
+struct bsc_i2c_diag {
+    uint32_t underruns;          ///< TX underruns seen by bsc_i2c_write()
+    uint32_t overruns;           ///< RX overruns seen by bsc_i2c_read_poll()
+    uint32_t max_turnaround_us;  ///< Worst time from bsc_i2c_write() to first queued byte
+    uint32_t max_service_gap_us; ///< Worst time between two TX FIFO services
+    uint32_t uptime_s;           ///< Seconds since init_bsc_i2c_slv()
+};
+
+/// Turnaround histogram buckets. Bucket i counts turnarounds under 2^i us,
+/// the last one any longer turnaround.
+#define BSC_TURNAROUND_BUCKETS (21)
+
+/**
+ * @brief Running totals of the service path, for monitoring
+ *
+ * Counters wrap around at 2^32, which a monitor takes as a reset.
+ */
+struct bsc_i2c_metrics {
+    uint32_t write_calls;       ///< bsc_i2c_write() calls
+    uint32_t master_reads;      ///< Of those, ones where the master read at least one byte
+    uint32_t rx_bytes;          ///< Bytes read from the master
+    uint32_t flush_toggles;     ///< TXE toggles made to flush the TX FIFO
+    uint32_t flush_giveups;     ///< Flushes given up on, with the FIFO not draining
+    uint32_t turnaround_sum_us; ///< Sum of the turnarounds in the histogram
+    uint32_t turnaround[BSC_TURNAROUND_BUCKETS]; ///< Turnaround histogram, see BSC_TURNAROUND_BUCKETS
+};
+
+/**
+ * @brief What it took to get back in step with the master after corrupt writes
+ */
+struct bsc_i2c_resync_stats {
+    uint32_t corrupt;         ///< Master writes discarded, after an RX overrun or for being too long
+    uint32_t bytes_discarded; ///< Bytes of them read from the FIFO and thrown away
+    uint32_t last_latency_us; ///< Time from the last overrun being seen to the end of its write
+    uint32_t max_latency_us;  ///< Worst such time
+};
+
+#define BSC_TAP_RX        (0)    ///< Tap record of a master write, as read by the slave
+#define BSC_TAP_TX        (1)    ///< Tap record of a master read, the bytes it got
+#define BSC_TAP_TRUNCATED (1<<0) ///< Only the first tap_record_max bytes were kept
+#define BSC_TAP_CORRUPT   (1<<1) ///< Hit by an RX overrun or a watchdog reset
+
+/**
+ * @brief One transfer seen by the tap, see bsc_i2c_tap_peek()
+ */
+struct bsc_i2c_tap_record {
+    uint64_t start_ns; ///< pi2c_now() when the transfer was first seen
+    uint64_t end_ns;   ///< pi2c_now() when it was seen to end
+    uint16_t len;      ///< Bytes of data kept
+    uint8_t dir;       ///< BSC_TAP_RX or BSC_TAP_TX
+    uint8_t flags;     ///< BSC_TAP_* flags
+    uint32_t count;    ///< Bytes transferred, more than len if truncated
+};
+
+/**
+ * @brief A tap subscriber, owned by the thread following the tap
+ */
+struct bsc_i2c_tap {
+    uint32_t cursor;   ///< Ring position of the next record, private
+    uint32_t next;     ///< Ring position after the peeked record, private
+    uint32_t overruns; ///< Times records were overwritten before being read
+};
+
+#define BSC_CAPTURE_MAGIC   "PI2CCAP\n" ///< First bytes of a capture file
+#define BSC_CAPTURE_VERSION (1)
+
+/**
+ * @brief Start of a capture file, see bsc_i2c_capture_begin()
+ *
+ * It is followed by records, each a struct bsc_i2c_tap_record followed by
+ * its len bytes of data. Everything is in the byte order of the machine
+ * that captured it.
+ */
+struct bsc_i2c_capture_header {
+    char magic[8];         ///< BSC_CAPTURE_MAGIC, not NUL terminated
+    uint32_t version;      ///< BSC_CAPTURE_VERSION
+    uint32_t byte_time_ns; ///< Estimated time per byte on the bus, 0 if not measured
+    uint8_t slave_addr;    ///< 7 bit slave address
+    uint8_t reserved[7];
+};
+
+/**
+ * @brief Recoveries made by the hang watchdog, see bsc_i2c_set_watchdog()
+ */
+struct bsc_i2c_watchdog_stats {
+    uint32_t resets;          ///< Times the BSC was reset and reprogrammed
+    uint32_t last_outage_us;  ///< Time from the last FIFO progress to the end of the last reset
+    uint32_t max_outage_us;   ///< Worst such time
+};
+
+/**
+ * @brief Identify the SoC from a device tree
+ *
+ * The peripheral base comes from soc/ranges and the SoC model from the
+ * compatible string. If compatible names no known SoC, the model is guessed
+ * from the peripheral base.
+ *
+ * @param dt_dir Device tree root, normally BCM_DEVICE_TREE. Tests can point
+ *               this at a directory holding fake soc/ranges and compatible
+ *               files.
+ * @param out Where to store the SoC's constants
+ *
+ * @return false if soc/ranges is missing or unreadable, true otherwise
+ */
+bool bcm_detect_soc(const char * dt_dir, struct bcm_soc_info * out);
+/**
+ * @brief Get the SoC init_bcm_reg_mem() mapped the peripherals of
+ */
+const struct bcm_soc_info * bcm_get_soc();
+
+/**
+ * @brief Get a timestamp without a system call
+ *
+ * Reads the ARM generic timer or the BCM system timer once
+ * init_bcm_reg_mem() has mapped the peripherals. Before that, and in
+ * simulated builds, it falls back to clock_gettime().
+ *
+ * @return Nanoseconds since the clock source was selected
+ */
+uint64_t pi2c_now();
+/**
+ * @brief Get the clock source pi2c_now() uses
+ */
+enum pi2c_clock pi2c_clock_source();
+/**
+ * @brief Force pi2c_now() to use a particular clock source
+ *
+ * init_bcm_reg_mem() already picks the best one available. Timestamps taken
+ * before switching can't be compared with ones taken after.
+ *
+ * @return false if the source is not available, true otherwise
+ */
+bool pi2c_set_clock_source(enum pi2c_clock source);
+
 /**
  * @brief Initialize /dev/mem to access hardware registers from userspace.
+ *
+ * The peripheral base is detected with bcm_detect_soc(). If that fails,
+ * BCM_IO_BASE is assumed.
  * @warning This function must be called before any other function in this module.
  *
  * @return false on error, true otherwise
@@ -130,19 +400,343 @@ void shutdown_bcm_reg_mem();
  */
 bool init_bsc_i2c_slv(uint8_t i2c_addr);
 /**
- * @brief Deinitialize the BSC I2C slave device
+ * @brief Use a kernel I2C slave driver's character device instead of /dev/mem
+ *
+ * The driver services the FIFOs from its interrupt handler. It is expected
+ * to return what the master wrote from read() and send what was written
+ * with write() when the master reads. Non-blocking writes should take no
+ * more than its TX buffer holds and poll() should report POLLOUT when there
+ * is room again, since the buffer bounds how far a tx_callback runs ahead
+ * of the master. Its slave address is set by the driver, typically from its
+ * device tree overlay.
+ *
+ * Two more calls are used when the driver supports them. With the TIOCOUTQ
+ * ioctl reporting the bytes it still holds, bsc_i2c_write() returns what
+ * the master read; without it, every byte written. With tcflush(TCOFLUSH)
+ * dropping those bytes, the next master read starts fresh; without it, it
+ * gets them first, so a tx_callback should stop at the length the master
+ * reads. init_bsc_i2c_dev() prints which of these are missing.
+ *
+ * bsc_i2c_read_poll(), bsc_i2c_write(), bsc_i2c_idle_wait() and the
+ * diagnostic window then work over the device, without root, without
+ * spinning and alongside other users of /dev/mem such as pigpio.
+ * init_bcm_reg_mem() is not needed. The driver does not report FIFO
+ * underruns or overruns, so those counters stay at 0, and there is no event
+ * thread: poll bsc_i2c_dev_fd() for POLLIN instead.
+ *
+ * For tests, path may be the slave side of a pty, with the harness playing
+ * the master on the other side, see tests/dev_pty_test.c. A pty supports
+ * both calls, but hands bytes to the other side at once, so it reports
+ * nothing queued and has nothing to drop. bsc_i2c_write() therefore counts
+ * every byte it wrote as sent. Test those behaviors with PI2C_SIM instead.
+ *
+ * @param path The driver's character device
+ *
+ * @return false on error, true otherwise
+ */
+bool init_bsc_i2c_dev(const char * path);
+/**
+ * @brief Get the character device opened by init_bsc_i2c_dev()
+ *
+ * @return The device's file descriptor, or -1 if the /dev/mem path is in use
+ */
+int bsc_i2c_dev_fd();
+/**
+ * @brief Deinitialize the BSC I2C slave device, or close the one opened by
+ *        init_bsc_i2c_dev()
  */
 void shutdown_bsc_i2c_slv();
 
+/**
+ * @brief Reserve the memory every internal buffer is carved from
+ *
+ * The arena is mapped, locked and touched once, here. Features needing
+ * buffers take them from it when they are enabled, so the FIFO service
+ * path never allocates or page faults. If this is not called, the first
+ * feature needing a buffer reserves BSC_ARENA_DEFAULT_LEN bytes.
+ *
+ * Building with PI2C_ALLOC_GUARD defined and linking pi2c_alloc_guard.c
+ * aborts the program if the service path allocates, prints or opens files,
+ * including from a tx_callback, or if a tx_callback reads, writes or sleeps.
+ *
+ * @param cfg Buffer sizes
+ *
+ * @return false on error, or if the arena is already in use, true otherwise
+ */
+bool init_bsc_i2c_arena(const struct bsc_i2c_config * cfg);
+/**
+ * @brief Get how many bytes of the arena are in use
+ */
+size_t bsc_i2c_arena_used();
+/**
+ * @brief Release the arena
+ * @warning Every feature using it must have been disabled first
+ */
+void shutdown_bsc_i2c_arena();
+
+/**
+ * @brief Reserve a window of addresses for the diagnostic registers
+ *
+ * Once enabled, bsc_i2c_write() serves addresses in
+ * [base, base + BSC_DIAG_LEN) from a snapshot of struct bsc_i2c_diag instead
+ * of calling the tx_callback. The snapshot is refreshed at the start of each
+ * bsc_i2c_write() call, never while bytes are being queued.
+ *
+ * @param base First address of the window
+ *
+ * @return false if the window would wrap past the end of addr_t, true otherwise
+ */
+bool bsc_i2c_enable_diag(addr_t base);
+/**
+ * @brief Stop serving the diagnostic register window
+ */
+void bsc_i2c_disable_diag();
+/**
+ * @brief Get the running totals of the service path
+ *
+ * Each counter is read atomically, without locking, so this may be called
+ * from any thread, at any rate, without slowing the service thread.
+ * Turnarounds are only measured while timing is enabled, see
+ * bsc_i2c_set_timing().
+ *
+ * @param out Where to store the totals
+ */
+void bsc_i2c_get_metrics(struct bsc_i2c_metrics * out);
+/**
+ * @brief Get the current health counters
+ *
+ * @note This is not synchronized with the thread calling bsc_i2c_write() or
+ *       bsc_i2c_read_poll(). Values may be slightly out of date.
+ *
+ * @param out Where to store the counters
+ */
+void bsc_i2c_get_diag(struct bsc_i2c_diag * out);
+
+/**
+ * @brief Enable or disable timestamping of FIFO services
+ *
+ * Timestamps feed the diagnostic timings and the bus rate estimate. They are
+ * enabled by default. Disabling them switches to service loops built without
+ * that code, at the cost of auto tuning and the derived idle back off
+ * ceiling no longer adapting.
+ *
+ * @param enable true to timestamp FIFO services
+ */
+void bsc_i2c_set_timing(bool enable);
+
+/**
+ * @brief Let the TX FIFO service period follow the measured bus rate
+ *
+ * The library always estimates the time the master takes per byte from how
+ * fast the FIFO levels change during transactions. With auto tuning enabled
+ * bsc_i2c_write() sleeps for about one byte time between top ups, rather
+ * than a fixed interval. This saves CPU with slow masters, and with fast ones
+ * it still notices a new master write before the master turns around to read.
+ *
+ * @param enable true to enable auto tuning, false to restore the default period
+ */
+void bsc_i2c_set_auto_tune(bool enable);
+/**
+ * @brief Get the estimated time the master takes to transfer one byte
+ *
+ * @return Time per byte in nanoseconds, or 0 if there is no estimate yet
+ */
+uint32_t bsc_i2c_byte_time_ns();
+/**
+ * @brief Get the period bsc_i2c_write() currently sleeps between TX FIFO top ups
+ *
+ * @return Period in microseconds
+ */
+unsigned bsc_i2c_service_period_us();
+
+/**
+ * @brief Measured costs of the platform, used to pick polling parameters
+ *
+ * The first three fields are measured by bsc_i2c_calibrate(), the rest are
+ * derived from them.
+ */
+struct bsc_i2c_profile {
+    uint32_t mmio_read_ns;       ///< Cost of one uncached BSC register read
+    uint32_t clock_ns;           ///< Cost of one timestamp
+    uint32_t sleep_overshoot_us; ///< How much longer than asked usleep() sleeps
+    uint32_t spin_threshold_us;  ///< Service periods up to this are spun, not slept
+    bool sample_rx_rate;         ///< Whether bsc_i2c_read_poll() timestamps the RX FIFO
+};
+
+/**
+ * @brief Measure the platform's register, timer and sleep costs and use them
+ *
+ * This takes about a millisecond. The BSC registers are only read, so it is
+ * safe to call at any time after init_bcm_reg_mem().
+ *
+ * @param out If not NULL, the resulting profile is stored here
+ *
+ * @return false on error, true otherwise
+ */
+bool bsc_i2c_calibrate(struct bsc_i2c_profile * out);
+/**
+ * @brief Get the profile currently in use
+ *
+ * @param out Where to store the profile
+ */
+void bsc_i2c_get_profile(struct bsc_i2c_profile * out);
+/**
+ * @brief Use a profile measured elsewhere. The derived fields are recomputed.
+ *
+ * @param prof Profile to use
+ */
+void bsc_i2c_set_profile(const struct bsc_i2c_profile * prof);
+/**
+ * @brief Save the profile currently in use so a later boot can skip calibration
+ *
+ * @param path File to write
+ *
+ * @return false on error, true otherwise
+ */
+bool bsc_i2c_save_profile(const char * path);
+/**
+ * @brief Load and use a profile saved by bsc_i2c_save_profile()
+ *
+ * @param path File to read
+ *
+ * @return false if the file is missing or invalid, true otherwise
+ */
+bool bsc_i2c_load_profile(const char * path);
+
+/**
+ * @brief Back off polling while the bus is quiet
+ *
+ * When enabled, each time the FIFO levels and busy flags are unchanged
+ * between two polls, the wait before the next one doubles, up to ceiling_us.
+ * Any change goes straight back to the normal service period. This applies
+ * to bsc_i2c_write() and bsc_i2c_idle_wait().
+ *
+ * @param enable true to enable the back off
+ * @param ceiling_us Longest wait between polls. 0 derives it from the
+ *                   measured bus rate, so that a transfer starting right
+ *                   after going idle can't overrun or underrun the FIFO.
+ *
+ * @warning A master that writes a register address and then reads back
+ *          sooner than ceiling_us may get stale or missing data, since the
+ *          slave is asleep when it should flush and refill the TX FIFO. For
+ *          such masters pick a ceiling below their write to read gap.
+ */
+void bsc_i2c_set_idle_backoff(bool enable, unsigned ceiling_us);
+/**
+ * @brief Wait before polling again, per the idle back off
+ *
+ * Meant for a reader loop to call whenever bsc_i2c_read_poll() returns 0,
+ * instead of spinning.
+ */
+void bsc_i2c_idle_wait();
+
+/**
+ * @brief Get the mapped BSC registers, for use with pi2cslave_inline.h
+ *
+ * @return The registers, or NULL if init_bcm_reg_mem() has not been called
+ */
+volatile uint32_t * bsc_i2c_regs();
+/**
+ * @brief Drop whatever the master did not read from the TX FIFO
+ *
+ * bsc_i2c_write() does this itself. It is only needed when filling the TX
+ * FIFO with the pi2cslave_inline.h accessors.
+ */
+void bsc_i2c_flush_tx();
+
+#define BSC_DMA_TX_CHANNEL (10) ///< Suggested DMA channel for TX, check it is free
+#define BSC_DMA_RX_CHANNEL (11) ///< Suggested DMA channel for RX, check it is free
+
+/**
+ * @brief Configuration of DMA mode, see bsc_i2c_start_dma()
+ */
+struct bsc_i2c_dma_config {
+    unsigned tx_channel; ///< DMA channel moving the register image into the TX FIFO
+    unsigned rx_channel; ///< DMA channel moving the RX FIFO into the ring
+    size_t image_len;    ///< Bytes of register image the master reads, at most 64 KiB
+    size_t rx_ring_len;  ///< Bytes the RX ring holds
+};
+
+/**
+ * @brief Let the DMA controller move the bytes, instead of the CPU
+ *
+ * The register image and an RX ring are allocated in locked memory the DMA
+ * controller can reach. One control block, linked to itself, keeps copying
+ * the RX FIFO into the ring. For each master read, bsc_i2c_write() chains a
+ * control block from the requested address to the end of the image into
+ * one looping over the whole image, so a master reading past the end wraps
+ * to address 0. The CPU then only wakes up at the service period to notice
+ * the end of the read.
+ *
+ * While DMA mode is on, bsc_i2c_read_poll() reads from the ring, and
+ * bsc_i2c_write() serves the image set with bsc_i2c_dma_set_image(). It
+ * must be passed a NULL tx_callback, and returns -1 otherwise. The diagnostic window, if it fits in the image,
+ * is copied into it at the start of each bsc_i2c_write().
+ *
+ * @warning The ring is overwritten when the master writes more than
+ *          rx_ring_len bytes between two bsc_i2c_read_poll() calls. This
+ *          can't be detected, so size it for the longest burst expected.
+ *
+ * @warning The channels must not be used by anything else, such as the
+ *          firmware or pigpio.
+ *
+ * @param cfg Channels and buffer sizes
+ *
+ * @return false on error, true otherwise
+ */
+bool bsc_i2c_start_dma(const struct bsc_i2c_dma_config * cfg);
+/**
+ * @brief Stop DMA mode and free its memory, going back to CPU FIFO servicing
+ */
+void bsc_i2c_stop_dma();
+/**
+ * @brief Copy bytes into the register image served in DMA mode
+ *
+ * The DMA controller reads the image while the master reads, so a multi
+ * byte value updated during a read may be seen half old, half new.
+ *
+ * @param addr Address of the first byte
+ * @param data Bytes to copy
+ * @param len Number of bytes
+ *
+ * @return false if DMA mode is off or the bytes don't fit, true otherwise
+ */
+bool bsc_i2c_dma_set_image(addr_t addr, const uint8_t * data, size_t len);
+
 /**
  * @brief Set the output state of a GPIO
  *
+ * Safe to call from any thread. The change goes through the same queue as
+ * bcm_queue_gpio_out(), and this returns once it has been applied.
+ *
  * @param gpio Number of GPIO to set
  * @param state One of gpio_state
  *
  * @return false on error, true otherwise
  */
 bool bcm_set_gpio_out(int gpio, enum gpio_state state);
+/**
+ * @brief Queue a change to the output state of a GPIO without waiting
+ *
+ * Safe to call from any thread, including from a tx_callback. Queued changes
+ * are applied in order, in batches, by the thread calling bsc_i2c_write()
+ * between FIFO bursts, or by bsc_i2c_idle_wait(), bcm_set_gpio_out() or
+ * bcm_gpio_sync(). A batch takes one store to GPCLR0, one to GPSET0, and
+ * one to each GPFSEL register it touches.
+ *
+ * @param gpio Number of GPIO to set
+ * @param state One of gpio_state
+ *
+ * @return false if the arguments are invalid or GPIO_QUEUE_LEN changes are
+ *         already waiting, true otherwise
+ */
+bool bcm_queue_gpio_out(int gpio, enum gpio_state state);
+/**
+ * @brief Wait until the GPIO changes queued so far have been applied
+ *
+ * Applies them if no other thread is applying the queue.
+ */
+void bcm_gpio_sync();
 
 /**
  * @brief Check if master is currently sending us data
@@ -151,20 +745,330 @@ bool bcm_set_gpio_out(int gpio, enum gpio_state state);
  */
 bool bsc_i2c_receiving();
 
+#define BSC_EVENT_RX      (1<<0) ///< A master write is waiting to be read with bsc_i2c_read_poll()
+#define BSC_EVENT_TX_DONE (1<<1) ///< bsc_i2c_write() returned
+#define BSC_EVENT_ERROR   (1<<2) ///< An RX overrun or TX underrun happened
+
+/**
+ * @brief Get an eventfd that becomes readable when events are pending
+ *
+ * The eventfd is created on first call and is non-blocking. It is meant to
+ * be added to an epoll or poll set. When it is readable, call
+ * bsc_i2c_take_events(). Events are coalesced, so any number of events
+ * between two bsc_i2c_take_events() calls cause a single wakeup.
+ *
+ * BSC_EVENT_RX is only posted while the event thread is running, see
+ * bsc_i2c_start_event_thread().
+ *
+ * @return The eventfd, or -1 on error
+ */
+int bsc_i2c_event_fd();
+/**
+ * @brief Fetch and clear the pending events
+ *
+ * @param tx_count If not NULL, set to what the last bsc_i2c_write() returned
+ *
+ * @return Bitmask of BSC_EVENT_* that happened since the last call
+ */
+unsigned bsc_i2c_take_events(int * tx_count);
+/**
+ * @brief Start a thread which watches the FIFOs and posts events
+ *
+ * The thread only reads the flag and status registers, so it can run
+ * alongside whichever thread calls bsc_i2c_read_poll() and bsc_i2c_write().
+ * It polls at the TX service period while the bus is active, and backs off
+ * to the idle ceiling when it isn't, whether or not idle back off is enabled
+ * for bsc_i2c_write(), see bsc_i2c_set_idle_backoff(). With
+ * bsc_i2c_enable_tx_irq(), the RX interrupt wakes it instead, and an idle
+ * bus costs one wakeup every 10 ms. A one byte master write doesn't reach
+ * the interrupt level, so it may be posted that late.
+ *
+ * @return false on error, true otherwise
+ */
+bool bsc_i2c_start_event_thread();
+/**
+ * @brief Stop the thread started by bsc_i2c_start_event_thread()
+ */
+void bsc_i2c_stop_event_thread();
+
+/**
+ * @brief Ask bsc_i2c_read_poll() and bsc_i2c_write() to return as soon as possible
+ *
+ * Safe to call from any thread or a signal handler. The request stays in
+ * effect until bsc_i2c_clear_stop() is called. The FIFOs are left flushed
+ * and consistent.
+ */
+void bsc_i2c_request_stop();
+/**
+ * @brief Withdraw a stop request made with bsc_i2c_request_stop()
+ */
+void bsc_i2c_clear_stop();
+/**
+ * @brief Check whether a stop has been requested
+ *
+ * @return true if bsc_i2c_request_stop() was called and not yet cleared
+ */
+bool bsc_i2c_stop_requested();
+
 /**
  * @brief Read up to len bytes into buffer. Does not block.
  *
- * If there is no data to read from the master, return immediately.
+ * If there is no data to read from the master, or bsc_i2c_request_stop() has
+ * been called, return immediately.
+ *
+ * After an RX overrun, the rest of that master write is discarded, and 0 is
+ * returned until the write ends. Bytes of it returned before the overrun
+ * was seen can't be taken back, use bsc_i2c_read_transaction() to never
+ * see any of them.
  *
- * @note This function is a pthread cancellation point
+ * @note This function is a pthread cancellation point on entry only
  *
  * @param buf Buffer to read bytes into
  * @param len Length of bufer
  *
- * @return Number of bytes read
+ * @return Number of bytes read, or -1 if the device opened by
+ *         init_bsc_i2c_dev() failed
  */
 int bsc_i2c_read_poll(uint8_t * buf, size_t len);
 
+/**
+ * @brief Collect one whole master write. Does not block.
+ *
+ * Call it repeatedly with the same buffer. Bytes accumulate in buf until the
+ * master ends its write, which is when the flag register shows the RX FIFO
+ * empty and the bus idle. Writes hit by an RX overrun, or longer than len,
+ * are discarded whole and never returned. See bsc_i2c_get_resync_stats().
+ *
+ * @note The FIFO does not mark where writes begin and end. If the master
+ *       starts a new write before the library has seen the previous one
+ *       end, they are returned, or discarded, as one.
+ *
+ * @param buf Buffer collecting the write, untouched between calls
+ * @param len Length of buf, the longest write kept
+ *
+ * @return Length of the write once it has ended, 0 otherwise, or -1 if the
+ *         device opened by init_bsc_i2c_dev() failed
+ */
+int bsc_i2c_read_transaction(uint8_t * buf, size_t len);
+/**
+ * @brief Get the statistics of discarded master writes
+ *
+ * @note Like bsc_i2c_get_diag(), this is not synchronized with the service
+ *       thread.
+ */
+void bsc_i2c_get_resync_stats(struct bsc_i2c_resync_stats * out);
+
+/**
+ * @brief Reset the BSC when the bus is stuck busy
+ *
+ * When enabled, bsc_i2c_read_poll(), bsc_i2c_read_transaction() and
+ * bsc_i2c_write() watch for the bus being busy with no FIFO progress. After
+ * timeout_us of that, they reset the BSC with CR_BRK, reprogram it as
+ * init_bsc_i2c_slv() did and flush the TX FIFO, then carry on. A
+ * bsc_i2c_write() in progress goes back to serving from its addr, as the
+ * master's next read starts there again. Each reset posts BSC_EVENT_ERROR.
+ *
+ * @note Not applied in DMA mode, nor with init_bsc_i2c_dev(), where the
+ *       driver has its own recovery.
+ *
+ * @param timeout_us Time the bus may stay busy without progress, 0 to
+ *                   disable the watchdog. Choose it well above the longest
+ *                   byte time, including any clock stretching by the master.
+ */
+void bsc_i2c_set_watchdog(uint32_t timeout_us);
+/**
+ * @brief Get the statistics of watchdog resets
+ *
+ * @note Like bsc_i2c_get_diag(), this is not synchronized with the service
+ *       thread.
+ */
+void bsc_i2c_get_watchdog_stats(struct bsc_i2c_watchdog_stats * out);
+
+/**
+ * @brief Counts of bsc_i2c_write() wakeups, to compare service modes
+ */
+struct bsc_i2c_tx_stats {
+    uint32_t wakeups;    ///< Times bsc_i2c_write() woke up to service the FIFO
+    uint32_t interrupts; ///< Of those, times woken by an interrupt, see bsc_i2c_enable_tx_irq()
+    uint32_t bytes;      ///< Bytes the master read
+};
+
+/**
+ * @brief Sleep until the TX FIFO runs low, instead of polling it
+ *
+ * bsc_i2c_write() normally wakes up every service period to top up the TX
+ * FIFO, whether or not the master is reading. With this, it fills the FIFO
+ * and sleeps until the BSC's TX interrupt reports that the FIFO has dropped
+ * to tx_level, then refills it in one burst. The RX interrupt, at 1/8 full,
+ * ends the sleep when the master starts writing. A master write shorter
+ * than that is seen after the idle back off ceiling, see
+ * bsc_i2c_set_idle_backoff().
+ *
+ * The interrupt reaches user space through a UIO device, for example the
+ * uio_pdrv_genirq driver bound to the BSC slave interrupt by a device tree
+ * overlay. When built with PI2C_SIM, uio_path is ignored and the simulated
+ * BSC's interrupt line is used.
+ *
+ * @note Not used in DMA mode, nor with init_bsc_i2c_dev().
+ *
+ * @param uio_path UIO device of the BSC slave interrupt, e.g. "/dev/uio0"
+ * @param tx_level IFLS_* level to refill at. The bytes left must last the
+ *                 master while the service thread wakes up.
+ *
+ * @return false on error, true otherwise
+ */
+bool bsc_i2c_enable_tx_irq(const char * uio_path, unsigned tx_level);
+/**
+ * @brief Go back to polling the TX FIFO every service period
+ */
+void bsc_i2c_disable_tx_irq();
+/**
+ * @brief Get the counts of bsc_i2c_write() wakeups
+ *
+ * @note Like bsc_i2c_get_diag(), this is not synchronized with the service
+ *       thread.
+ */
+void bsc_i2c_get_tx_stats(struct bsc_i2c_tx_stats * out);
+
+/**
+ * @brief Order of a heat map report, hottest first
+ */
+enum bsc_i2c_heat_key {
+    BSC_HEAT_BY_READ_STARTS, ///< Master reads starting in the page
+    BSC_HEAT_BY_BYTES_READ,  ///< Bytes the master read from the page
+    BSC_HEAT_BY_WRITES,      ///< Writes reported with bsc_i2c_heat_note_write()
+    BSC_HEAT_BY_RECENT,      ///< Last access
+    BSC_HEAT_BY_ADDR,        ///< Address, lowest first
+};
+
+/**
+ * @brief Accesses to one page of addresses, see bsc_i2c_enable_heat_map()
+ */
+struct bsc_i2c_heat_page {
+    addr_t first;            ///< First address of the page
+    uint32_t read_starts;    ///< Master reads starting in the page
+    uint32_t bytes_read;     ///< Bytes the master read from the page
+    uint32_t writes;         ///< Writes reported with bsc_i2c_heat_note_write()
+    uint64_t last_access_ns; ///< pi2c_now() of the last access, to about a millisecond
+};
+
+/**
+ * @brief Count accesses per page of addresses
+ *
+ * The addr_t space is split in pages of heat_page_len addresses, see
+ * bsc_i2c_config, each with a few counters in the arena. Each master read
+ * served by bsc_i2c_write() counts as a read start in the page of its
+ * addr, and its bytes are counted in the pages they came from. Master
+ * writes carry no address the library understands, so the handler
+ * reports them with bsc_i2c_heat_note_write(). The report is meant to pick
+ * prefill sizes, cache ranges and register image layouts.
+ *
+ * @return false if the arena has no room for the counters, true otherwise
+ */
+bool bsc_i2c_enable_heat_map();
+/**
+ * @brief Stop counting accesses. The counters are kept until reset.
+ */
+void bsc_i2c_disable_heat_map();
+/**
+ * @brief Clear every heat map counter
+ */
+void bsc_i2c_reset_heat_map();
+/**
+ * @brief Count a master write to the register at addr
+ */
+void bsc_i2c_heat_note_write(addr_t addr);
+/**
+ * @brief Get the pages that were accessed, hottest first
+ *
+ * @note Each counter is read whole, but while the master is active a page's
+ *       counters may be read at slightly different times.
+ *
+ * @param out Where to store the pages
+ * @param max Room in out. Only the max hottest pages are stored.
+ * @param key What to sort by
+ *
+ * @return Number of pages stored
+ */
+size_t bsc_i2c_heat_report(struct bsc_i2c_heat_page * out, size_t max, enum bsc_i2c_heat_key key);
+/**
+ * @brief Save bsc_i2c_heat_report() as text, one page per line
+ *
+ * @param path File to write
+ * @param key What to sort by
+ *
+ * @return false on error, true otherwise
+ */
+bool bsc_i2c_save_heat_report(const char * path, enum bsc_i2c_heat_key key);
+
+/**
+ * @brief Record every transfer in the tap ring
+ *
+ * The service thread writes each master write and each master read once
+ * into a ring carved from the arena, sized by bsc_i2c_config. Any number
+ * of subscribers follow it with bsc_i2c_tap_peek(), each at its own pace.
+ * Nobody waits for a subscriber: one that falls a whole ring behind misses
+ * records, and finds out from its overruns count.
+ *
+ * @note A master write is recorded once the bus is seen idle after it, or
+ *       when bsc_i2c_write() starts replying to it.
+ *
+ * @return false if the arena has no room for the ring, true otherwise
+ */
+bool bsc_i2c_enable_tap();
+/**
+ * @brief Stop recording transfers. Subscribers may still read what was recorded.
+ */
+void bsc_i2c_disable_tap();
+/**
+ * @brief Start following the tap, from the next record written
+ */
+void bsc_i2c_tap_subscribe(struct bsc_i2c_tap * tap);
+/**
+ * @brief Get the oldest record the subscriber has not released. Does not block.
+ *
+ * The data is not copied, it points into the ring. It stays there until the
+ * service thread laps the subscriber, which bsc_i2c_tap_release() reports.
+ *
+ * @param tap The subscriber
+ * @param rec Where to store the record
+ * @param data Where to store a pointer to the rec->len bytes of data
+ *
+ * @return false if there is no new record, true otherwise
+ */
+bool bsc_i2c_tap_peek(struct bsc_i2c_tap * tap, struct bsc_i2c_tap_record * rec, const uint8_t ** data);
+/**
+ * @brief Move past the record from bsc_i2c_tap_peek()
+ *
+ * @return false if the record was overwritten while in use, so whatever was
+ *         taken from its data must be thrown away, true otherwise
+ */
+bool bsc_i2c_tap_release(struct bsc_i2c_tap * tap);
+/**
+ * @brief Write the header of a capture file
+ *
+ * A tap subscriber then calls bsc_i2c_capture_save() as often as it likes.
+ * tools/pi2c_capture_vcd.c turns the file into a VCD file for PulseView.
+ *
+ * @param fd File to write to
+ *
+ * @return false on error, true otherwise
+ */
+bool bsc_i2c_capture_begin(int fd);
+/**
+ * @brief Append the records the subscriber has not read yet to a capture file
+ *
+ * Records are copied out of the ring before they are written, so the file
+ * never gets one that was overwritten while being saved. Records the
+ * subscriber missed are counted in tap->overruns.
+ *
+ * @param tap The subscriber
+ * @param fd File started by bsc_i2c_capture_begin()
+ *
+ * @return Number of records written, or -1 on error
+ */
+int bsc_i2c_capture_save(struct bsc_i2c_tap * tap, int fd);
+
 /**
  * @brief Send bytes to master from tx_callback, incrementing addr each time.
  *
@@ -176,13 +1080,17 @@ int bsc_i2c_read_poll(uint8_t * buf, size_t len);
  *       to the master. It only means that it has been queued. The return value
  *       must be checked to see how many bytes have been sent.
  *
- * @note This function is a pthread cancellation point
+ * @note This function returns early, after flushing the TX FIFO, once
+ *       bsc_i2c_request_stop() has been called. It is also a pthread
+ *       cancellation point between TX FIFO top ups. If canceled, the TX FIFO
+ *       is still flushed.
  *
  * @param cb The callback to retrieve data to send. If this returns false, no
- *           more data is sent (but the function does not return).
+ *           more data is sent (but the function does not return). NULL in
+ *           DMA mode, see bsc_i2c_start_dma().
  * @param addr This is passed to the callback to indicate the byte to send
  *
- * @return Number of bytes sent.
+ * @return Number of bytes sent, or -1 if cb is given in DMA mode.
  */
 int bsc_i2c_write(tx_callback cb, uint16_t addr);
 
@@ -0,0 +1,329 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/**
+ * @file pi2cslave_coro.hpp
+ * @brief C++20 coroutine front end for libPi2cSlave
+ *
+ * A device handler is written as a coroutine returning pi2c::Task:
+ *
+ * @code
+ * uint8_t regs[256];
+ *
+ * pi2c::Task handler(pi2c::Slave & slave)
+ * {
+ *     for (;;) {
+ *         std::span<const uint8_t> req = co_await slave.next_write();
+ *         // Past the end of regs, or without an address, serve nothing.
+ *         std::size_t addr = req.size() >= 2 ? (req[0] << 8) | req[1] : sizeof(regs);
+ *         int sent = co_await slave.reply(std::span(regs).subspan(std::min(addr, sizeof(regs))));
+ *     }
+ * }
+ *
+ * uint8_t rx[64];
+ * pi2c::Slave slave(rx);
+ * slave.spawn(handler(slave));
+ * slave.run();
+ * @endcode
+ *
+ * Coroutine frames come from a fixed arena, so handling a transaction never
+ * touches the heap. The arena holds PI2C_CORO_FRAMES frames of up to
+ * PI2C_CORO_FRAME_SIZE bytes each. If a frame doesn't fit, the Task is
+ * invalid rather than falling back to the heap.
+ *
+ * @warning Everything here is single threaded. Slave::run() and the
+ *          coroutines it resumes must all run on one thread.
+ */
+#ifndef __PI2CSLAVE_CORO_HPP__
+#define __PI2CSLAVE_CORO_HPP__
+
+#include <coroutine>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <utility>
+
+extern "C" {
+#include "pi2cslave.h"
+}
+
+#ifndef PI2C_CORO_FRAMES
+#define PI2C_CORO_FRAMES     (8)   ///< Number of coroutine frames in the arena
+#endif
+#ifndef PI2C_CORO_FRAME_SIZE
+#define PI2C_CORO_FRAME_SIZE (512) ///< Largest coroutine frame the arena can hold
+#endif
+
+namespace pi2c {
+
+/**
+ * @brief Fixed pool of equally sized coroutine frames
+ */
+class FrameArena {
+public:
+    FrameArena()
+    {
+        for (std::size_t i = 0; i < PI2C_CORO_FRAMES; i++) {
+            slots_[i].next = (i + 1 < PI2C_CORO_FRAMES) ? &slots_[i + 1] : nullptr;
+        }
+        free_ = &slots_[0];
+    }
+
+    void * allocate(std::size_t size) noexcept
+    {
+        if (size > PI2C_CORO_FRAME_SIZE || free_ == nullptr) {
+            return nullptr;
+        }
+        Slot * slot = free_;
+        free_ = slot->next;
+        return slot->bytes;
+    }
+
+    void release(void * frame) noexcept
+    {
+        Slot * slot = static_cast<Slot *>(frame);
+        slot->next = free_;
+        free_ = slot;
+    }
+
+    static FrameArena & instance() noexcept
+    {
+        static FrameArena arena;
+        return arena;
+    }
+
+private:
+    union Slot {
+        Slot * next;
+        alignas(std::max_align_t) unsigned char bytes[PI2C_CORO_FRAME_SIZE];
+    };
+    Slot slots_[PI2C_CORO_FRAMES];
+    Slot * free_;
+};
+
+/**
+ * @brief A device handler coroutine, started by Slave::spawn()
+ */
+class Task {
+public:
+    struct promise_type {
+        static void * operator new(std::size_t size) noexcept
+        {
+            return FrameArena::instance().allocate(size);
+        }
+        static void operator delete(void * frame) noexcept
+        {
+            FrameArena::instance().release(frame);
+        }
+        static Task get_return_object_on_allocation_failure() noexcept { return Task(); }
+
+        Task get_return_object() noexcept
+        {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+        std::suspend_always initial_suspend() noexcept { return {}; }
+        std::suspend_always final_suspend() noexcept { return {}; }
+        void return_void() noexcept {}
+        void unhandled_exception() noexcept {}
+    };
+
+    Task() = default;
+    Task(Task && other) noexcept : handle_(std::exchange(other.handle_, nullptr)) {}
+    Task & operator=(Task && other) noexcept
+    {
+        if (this != &other) {
+            reset();
+            handle_ = std::exchange(other.handle_, nullptr);
+        }
+        return *this;
+    }
+    ~Task() { reset(); }
+
+    /// @brief false if the frame did not fit in the arena
+    bool valid() const noexcept { return static_cast<bool>(handle_); }
+    /// @brief true once the handler has returned
+    bool done() const noexcept { return !handle_ || handle_.done(); }
+
+private:
+    friend class Slave;
+
+    explicit Task(std::coroutine_handle<promise_type> handle) noexcept : handle_(handle) {}
+
+    void reset() noexcept
+    {
+        if (handle_) {
+            handle_.destroy();
+            handle_ = nullptr;
+        }
+    }
+
+    std::coroutine_handle<promise_type> handle_;
+};
+
+/**
+ * @brief Executor which drives a handler coroutine from the FIFO service loop
+ */
+class Slave {
+public:
+    /**
+     * @param rx_buf Buffer for master writes. A write longer than this is
+     *               dropped, like an overrun, see bsc_i2c_read_transaction().
+     */
+    explicit Slave(std::span<uint8_t> rx_buf) noexcept : rx_buf_(rx_buf) {}
+
+    Slave(const Slave &) = delete;
+    Slave & operator=(const Slave &) = delete;
+
+    /**
+     * @brief Awaitable resuming with the next complete master write
+     *
+     * The span stays valid until the next co_await on this Slave.
+     */
+    auto next_write() noexcept
+    {
+        struct Awaiter {
+            Slave & slave;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) noexcept
+            {
+                slave.waiting_ = h;
+                slave.state_ = State::WaitWrite;
+                slave.rx_len_ = 0;
+            }
+            std::span<const uint8_t> await_resume() const noexcept
+            {
+                return slave.rx_buf_.first(slave.rx_len_);
+            }
+        };
+        return Awaiter{*this};
+    }
+
+    /**
+     * @brief Awaitable sending data to the master's next read
+     *
+     * Resumes when the master starts writing again, with the number of bytes
+     * it actually read, like bsc_i2c_write().
+     *
+     * @note Addresses are passed to the library as offsets into data, so the
+     *       diagnostic window must not be enabled at low addresses.
+     */
+    auto reply(std::span<const uint8_t> data) noexcept
+    {
+        struct Awaiter {
+            Slave & slave;
+            std::span<const uint8_t> data;
+            bool await_ready() const noexcept { return false; }
+            void await_suspend(std::coroutine_handle<> h) noexcept
+            {
+                slave.waiting_ = h;
+                slave.state_ = State::Reply;
+                slave.tx_data_ = data;
+            }
+            int await_resume() const noexcept { return slave.tx_sent_; }
+        };
+        return Awaiter{*this, data};
+    }
+
+    /**
+     * @brief Start a handler. It runs until its first co_await.
+     *
+     * @return false if the task is invalid, true otherwise
+     */
+    bool spawn(Task task) noexcept
+    {
+        if (!task.valid()) {
+            return false;
+        }
+        task_ = std::move(task);
+        task_.handle_.resume();
+        return true;
+    }
+
+    /**
+     * @brief Service the FIFOs once and resume the handler if its wait is over
+     *
+     * @return false once the handler has returned or the slave device
+     *         failed, true otherwise
+     */
+    bool poll() noexcept
+    {
+        switch (state_) {
+        case State::WaitWrite:
+            poll_write();
+            break;
+        case State::Reply:
+            current_ = this;
+            tx_sent_ = bsc_i2c_write(reply_byte, 0);
+            current_ = nullptr;
+            resume();
+            break;
+        case State::Idle:
+            break;
+        }
+        return !failed_ && !task_.done();
+    }
+
+    /// @brief true once bsc_i2c_read_poll() reported the slave device failed
+    bool failed() const noexcept { return failed_; }
+
+    /**
+     * @brief Run the handler until it returns or bsc_i2c_request_stop() is called
+     */
+    void run() noexcept
+    {
+        while (!bsc_i2c_stop_requested() && poll()) {
+        }
+    }
+
+private:
+    enum class State { Idle, WaitWrite, Reply };
+
+    void poll_write() noexcept
+    {
+        // The library decides where a write ends from a single flag register
+        // read, so a last byte arriving as we look can't be split off.
+        int got = bsc_i2c_read_transaction(rx_buf_.data(), rx_buf_.size());
+        if (got < 0) {
+            // The slave device is gone, there will be no more writes.
+            failed_ = true;
+            return;
+        }
+        if (got > 0) {
+            rx_len_ = got;
+            resume();
+            return;
+        }
+        bsc_i2c_idle_wait();
+    }
+
+    void resume() noexcept
+    {
+        state_ = State::Idle;
+        std::exchange(waiting_, nullptr).resume();
+    }
+
+    static bool reply_byte(addr_t addr, uint8_t * out)
+    {
+        if (addr >= current_->tx_data_.size()) {
+            return false;
+        }
+        *out = current_->tx_data_[addr];
+        return true;
+    }
+
+    static inline Slave * current_ = nullptr; ///< Slave inside bsc_i2c_write()
+
+    std::span<uint8_t> rx_buf_;
+    std::size_t rx_len_ = 0;
+    std::span<const uint8_t> tx_data_;
+    int tx_sent_ = 0;
+    State state_ = State::Idle;
+    bool failed_ = false;
+    std::coroutine_handle<> waiting_;
+    Task task_;
+};
+
+} // namespace pi2c
+
+#endif // ! __PI2CSLAVE_CORO_HPP__
@@ -0,0 +1,119 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/**
+ * @file pi2cslave_inline.h
+ * @brief Inline FIFO accessors for callers running their own service loop
+ *
+ * These work directly on the registers returned by bsc_i2c_regs(), so each
+ * byte costs a register access and nothing else. They skip everything
+ * bsc_i2c_read_poll() and bsc_i2c_write() do besides moving bytes:
+ *
+ * - No underrun/overrun counting, diagnostic window, timing or events.
+ * - No TX flush. Call bsc_i2c_flush_tx() at the end of a master read, or
+ *   the next read gets the leftovers.
+ * - No barriers. Call mmio_barrier() when switching between these and GPIO
+ *   accesses on the same thread.
+ *
+ * @warning Don't use these while another thread is in bsc_i2c_read_poll()
+ *          or bsc_i2c_write(). Both would pop and push the same FIFOs.
+ *
+ * @code
+ * volatile uint32_t * regs = bsc_i2c_regs();
+ * uint8_t buf[64];
+ * size_t got = 0;
+ * // The write is over once the FIFO is empty and the bus idle, seen in one
+ * // flag register read. Bytes may still be waiting after RXBUSY clears.
+ * while (got < sizeof(buf) && (bsc_fifo_status(regs) & (FR_RXBUSY | FR_RXFE)) != FR_RXFE) {
+ *     got += bsc_fifo_drain(regs, buf + got, sizeof(buf) - got);
+ * }
+ * @endcode
+ */
+#ifndef __PI2CSLAVE_INLINE_H__
+#define __PI2CSLAVE_INLINE_H__
+
+#include "pi2cslave.h"
+#include "pi2c_mmio.h"
+
+/**
+ * @brief Read the flag register once
+ *
+ * @return FR_* bits of the BSC flag register
+ */
+static inline uint32_t bsc_fifo_status(volatile uint32_t * regs)
+{
+    return mmio_read(&regs[BSC_FR]);
+}
+
+/**
+ * @brief Get the number of bytes waiting in the RX FIFO
+ */
+static inline unsigned bsc_fifo_rx_level(volatile uint32_t * regs)
+{
+    return (mmio_read(&regs[BSC_FR]) & FR_RXFLEVEL) >> FR_RXFLEVEL_OFF;
+}
+
+/**
+ * @brief Get the number of bytes queued in the TX FIFO
+ */
+static inline unsigned bsc_fifo_tx_level(volatile uint32_t * regs)
+{
+    return (mmio_read(&regs[BSC_FR]) & FR_TXFLEVEL) >> FR_TXFLEVEL_OFF;
+}
+
+/**
+ * @brief Pop one byte from the RX FIFO. The FIFO must not be empty.
+ */
+static inline uint8_t bsc_fifo_pop(volatile uint32_t * regs)
+{
+    return mmio_read(&regs[BSC_DR]) & 0xFF;
+}
+
+/**
+ * @brief Push one byte to the TX FIFO. The FIFO must not be full.
+ */
+static inline void bsc_fifo_push(volatile uint32_t * regs, uint8_t byte)
+{
+    mmio_write(&regs[BSC_DR], byte);
+}
+
+/**
+ * @brief Pop up to len bytes from the RX FIFO
+ *
+ * Reads the flag register once, then pops what it said was there.
+ *
+ * @return Number of bytes popped
+ */
+static inline size_t bsc_fifo_drain(volatile uint32_t * regs, uint8_t * buf, size_t len)
+{
+    size_t n = bsc_fifo_rx_level(regs);
+    if (n > len) {
+        n = len;
+    }
+    for (size_t i = 0; i < n; i++) {
+        buf[i] = bsc_fifo_pop(regs);
+    }
+    return n;
+}
+
+/**
+ * @brief Push up to len bytes to the TX FIFO
+ *
+ * Reads the flag register once, then pushes as much as there was room for.
+ *
+ * @return Number of bytes pushed
+ */
+static inline size_t bsc_fifo_fill(volatile uint32_t * regs, const uint8_t * buf, size_t len)
+{
+    size_t n = FIFO_LEN - bsc_fifo_tx_level(regs);
+    if (n > len) {
+        n = len;
+    }
+    for (size_t i = 0; i < n; i++) {
+        bsc_fifo_push(regs, buf[i]);
+    }
+    return n;
+}
+
+#endif // ! __PI2CSLAVE_INLINE_H__
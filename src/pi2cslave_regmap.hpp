@@ -0,0 +1,266 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/**
+ * @file pi2cslave_regmap.hpp
+ * @brief C++17 compile-time register maps for libPi2cSlave
+ *
+ * A device is declared as a constexpr table of registers. The reset image,
+ * the readable/writable byte masks and the address range are all computed by
+ * the compiler, so serving a byte is an array index with no table walk.
+ *
+ * @code
+ * static constexpr std::array<pi2c::Reg<uint16_t>, 3> map = {{
+ *     {0x0000, 2, 0x1234, pi2c::Access::RO}, // ID
+ *     {0x0002, 1, 0x00,   pi2c::Access::RW}, // CTRL
+ *     {0x0010, 4, 0,      pi2c::Access::RO}, // COUNTER
+ * }};
+ * static pi2c::RegMap<uint16_t, pi2c::Endian::Big, map> dev;
+ *
+ * uint16_t addr;
+ * if (dev.handle_write(req, req_len, addr)) {
+ *     dev.serve(addr);
+ * }
+ * @endcode
+ *
+ * The C API stays available underneath. serve() uses bsc_i2c_write() with
+ * offsets from the lowest mapped address, so a map may span at most 64 KiB
+ * even when Addr is 32 bits wide.
+ */
+#ifndef __PI2CSLAVE_REGMAP_HPP__
+#define __PI2CSLAVE_REGMAP_HPP__
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <type_traits>
+
+extern "C" {
+#include "pi2cslave.h"
+}
+
+namespace pi2c {
+
+/// @brief Who may access a register
+enum class Access : uint8_t {
+    RO, ///< Master can read only
+    WO, ///< Master can write only
+    RW, ///< Master can read and write
+};
+
+/// @brief Byte order of multi-byte registers and of the address on the bus
+enum class Endian {
+    Big,
+    Little,
+};
+
+/// @brief One register of a map
+template <typename Addr>
+struct Reg {
+    Addr addr;      ///< Address of the first byte
+    uint8_t width;  ///< Width in bytes, 1 to 4
+    uint32_t reset; ///< Value after reset
+    Access access;  ///< Access mode
+};
+
+/**
+ * @brief A register image specialized for one constexpr map
+ *
+ * @tparam Addr  Address type, uint8_t, uint16_t or uint32_t
+ * @tparam E     Byte order of registers and of the address the master sends
+ * @tparam Map   constexpr std::array of Reg<Addr>
+ */
+template <typename Addr, Endian E, const auto & Map>
+class RegMap {
+    static_assert(std::is_same_v<Addr, uint8_t> || std::is_same_v<Addr, uint16_t> ||
+                  std::is_same_v<Addr, uint32_t>, "Addr must be 8, 16 or 32 bits");
+
+    static constexpr Addr lowest()
+    {
+        Addr low = Map[0].addr;
+        for (const auto & reg : Map) {
+            low = (reg.addr < low) ? reg.addr : low;
+        }
+        return low;
+    }
+
+    static constexpr std::size_t span()
+    {
+        std::size_t end = 0;
+        for (const auto & reg : Map) {
+            std::size_t reg_end = reg.addr - lowest() + reg.width;
+            end = (reg_end > end) ? reg_end : end;
+        }
+        return end;
+    }
+
+public:
+    static constexpr Addr Base = lowest(); ///< Lowest mapped address
+    static constexpr std::size_t Span = span(); ///< Bytes from Base to the end of the last register
+
+    static_assert(Span <= 0x10000, "A register map may span at most 64 KiB");
+
+private:
+    // Byte offset within a register of width `width` holding bit `byte * 8`.
+    static constexpr std::size_t byte_pos(uint8_t width, std::size_t byte)
+    {
+        return (E == Endian::Big) ? width - 1 - byte : byte;
+    }
+
+    static constexpr std::array<uint8_t, Span> reset_image()
+    {
+        std::array<uint8_t, Span> image{};
+        for (const auto & reg : Map) {
+            for (std::size_t b = 0; b < reg.width; b++) {
+                image[reg.addr - Base + byte_pos(reg.width, b)] = (reg.reset >> (b * 8)) & 0xFF;
+            }
+        }
+        return image;
+    }
+
+    static constexpr std::array<uint8_t, Span> access_mask(bool want_read)
+    {
+        std::array<uint8_t, Span> mask{};
+        for (const auto & reg : Map) {
+            bool ok = want_read ? reg.access != Access::WO : reg.access != Access::RO;
+            for (std::size_t b = 0; b < reg.width; b++) {
+                mask[reg.addr - Base + b] = ok ? 0xFF : 0x00;
+            }
+        }
+        return mask;
+    }
+
+    static constexpr std::array<uint8_t, Span> Readable = access_mask(true);
+    static constexpr std::array<uint8_t, Span> Writable = access_mask(false);
+
+public:
+    RegMap() : image_(reset_image()) {}
+
+    /// @brief Restore every register to its reset value
+    void reset() { image_ = reset_image(); }
+
+    /**
+     * @brief Get a register's value. RegAddr must be a register in the map.
+     */
+    template <Addr RegAddr>
+    uint32_t get() const
+    {
+        constexpr const auto & reg = find<RegAddr>();
+        uint32_t val = 0;
+        for (std::size_t b = 0; b < reg.width; b++) {
+            val |= (uint32_t)image_[RegAddr - Base + byte_pos(reg.width, b)] << (b * 8);
+        }
+        return val;
+    }
+
+    /**
+     * @brief Set a register's value from the Pi side, regardless of access mode
+     */
+    template <Addr RegAddr>
+    void set(uint32_t val)
+    {
+        constexpr const auto & reg = find<RegAddr>();
+        for (std::size_t b = 0; b < reg.width; b++) {
+            image_[RegAddr - Base + byte_pos(reg.width, b)] = (val >> (b * 8)) & 0xFF;
+        }
+    }
+
+    /**
+     * @brief Get the byte the master reads at addr
+     *
+     * Unmapped and write only bytes read as 0. Compiles to a bounds check,
+     * an index and a mask, with no branches on the map contents.
+     *
+     * @return false if addr is past the end of the map, true otherwise
+     */
+    bool read_byte(Addr addr, uint8_t * out) const
+    {
+        std::size_t off = (Addr)(addr - Base);
+        bool in = off < Span;
+        std::size_t idx = in ? off : 0;
+        *out = image_[idx] & Readable[idx];
+        return in;
+    }
+
+    /**
+     * @brief Apply a master write of an address followed by data
+     *
+     * The first sizeof(Addr) bytes are the address, in E byte order. The
+     * rest are stored from that address on. Bytes landing on unmapped or read
+     * only addresses are dropped.
+     *
+     * @param req The master write
+     * @param len Length of req
+     * @param addr Set to the address the master sent
+     *
+     * @return false if req is too short to hold an address, true otherwise
+     */
+    bool handle_write(const uint8_t * req, std::size_t len, Addr & addr)
+    {
+        if (len < sizeof(Addr)) {
+            return false;
+        }
+        addr = 0;
+        for (std::size_t b = 0; b < sizeof(Addr); b++) {
+            addr |= (Addr)((Addr)req[byte_pos(sizeof(Addr), b)] << (b * 8));
+        }
+        for (std::size_t i = sizeof(Addr); i < len; i++) {
+            std::size_t off = (Addr)(addr + (i - sizeof(Addr)) - Base);
+            if (off < Span) {
+                image_[off] = (image_[off] & ~Writable[off]) | (req[i] & Writable[off]);
+            }
+        }
+        return true;
+    }
+
+    /**
+     * @brief Serve a master read starting at addr with bsc_i2c_write()
+     *
+     * @return Number of bytes the master read, as from bsc_i2c_write()
+     */
+    int serve(Addr addr)
+    {
+        // Check before narrowing to addr_t, or a 32 bit address past the map
+        // would alias into it.
+        std::size_t off = (Addr)(addr - Base);
+        if (off >= Span) {
+            return bsc_i2c_write(no_byte, 0);
+        }
+        current_ = this;
+        int sent = bsc_i2c_write(tx_byte, (addr_t)off);
+        current_ = nullptr;
+        return sent;
+    }
+
+private:
+    template <Addr RegAddr>
+    static constexpr const Reg<Addr> & find()
+    {
+        for (const auto & reg : Map) {
+            if (reg.addr == RegAddr) {
+                return reg;
+            }
+        }
+        // Not constant evaluable, so a bad RegAddr fails to compile.
+        throw "Address is not a register in this map";
+    }
+
+    static bool tx_byte(addr_t off, uint8_t * out)
+    {
+        return current_->read_byte((Addr)(Base + off), out);
+    }
+
+    static bool no_byte(addr_t, uint8_t *)
+    {
+        return false;
+    }
+
+    static inline RegMap * current_ = nullptr; ///< Map inside bsc_i2c_write()
+
+    std::array<uint8_t, Span> image_;
+};
+
+} // namespace pi2c
+
+#endif // ! __PI2CSLAVE_REGMAP_HPP__
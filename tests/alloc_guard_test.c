@@ -0,0 +1,146 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Checks pi2c_alloc_guard.c against the simulator: a master read served by
+ * a clean tx_callback must work, and one whose tx_callback allocates,
+ * prints, opens, reads or sleeps must abort naming the offending call.
+ * Each bad callback runs in a child process, so the abort can be caught.
+ */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "sim_harness.h"
+
+#define READ_LEN (8)
+
+enum misdeed {
+    MISDEED_NONE,
+    MISDEED_MALLOC,
+    MISDEED_PUTS,
+    MISDEED_OPEN,
+    MISDEED_READ,
+    MISDEED_USLEEP,
+};
+
+static const char * const misdeed_calls[] = {
+    [MISDEED_MALLOC] = "malloc",
+    [MISDEED_PUTS] = "puts",
+    [MISDEED_OPEN] = "open",
+    [MISDEED_READ] = "read",
+    [MISDEED_USLEEP] = "usleep",
+};
+
+static enum misdeed misdeed = MISDEED_NONE;
+static int devnull = -1;
+static void * volatile allocated; ///< Keeps the compiler from eliding malloc()
+
+static bool tx_cb(addr_t addr, uint8_t * out)
+{
+    uint8_t scratch;
+    switch (misdeed) {
+        case MISDEED_MALLOC:
+            allocated = malloc(16);
+            free(allocated);
+            break;
+        case MISDEED_PUTS:
+            puts("tx_cb");
+            break;
+        case MISDEED_OPEN:
+            close(open("/dev/null", O_RDONLY));
+            break;
+        case MISDEED_READ:
+            if (read(devnull, &scratch, 1) < 0) {
+                return false;
+            }
+            break;
+        case MISDEED_USLEEP:
+            usleep(1);
+            break;
+        default:
+            break;
+    }
+    return sim_echo_cb(addr, out);
+}
+
+// Serve one master read of READ_LEN bytes with tx_cb.
+static bool serve_one_read(struct sim_result * result)
+{
+    static const struct sim_traffic traffic = {
+        .transactions = 1,
+        .min_read = READ_LEN,
+        .max_read = READ_LEN,
+        .byte_gap_us = 90,
+    };
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return false;
+    }
+    sim_serve(&traffic, tx_cb, result);
+    shutdown_bsc_i2c_slv();
+    shutdown_bcm_reg_mem();
+    return true;
+}
+
+// Run a misbehaving tx_callback in a child, which should abort.
+static bool expect_abort(enum misdeed what)
+{
+    int pipefd[2];
+    if (pipe(pipefd) < 0) {
+        perror("pipe");
+        return false;
+    }
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(pipefd[1], STDERR_FILENO);
+        close(pipefd[0]);
+        misdeed = what;
+        struct sim_result result;
+        serve_one_read(&result);
+        _exit(0);
+    }
+    close(pipefd[1]);
+    char msg[256];
+    ssize_t len = 0;
+    ssize_t got;
+    while (len < (ssize_t)sizeof(msg) - 1 && (got = read(pipefd[0], msg + len, sizeof(msg) - 1 - len)) > 0) {
+        len += got;
+    }
+    msg[len] = '\0';
+    close(pipefd[0]);
+
+    int status;
+    waitpid(pid, &status, 0);
+    char want[64];
+    snprintf(want, sizeof(want), "service path called %s\n", misdeed_calls[what]);
+    if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT || strstr(msg, want) == NULL) {
+        fprintf(stderr, "FAIL: a tx_callback calling %s did not abort as expected\n", misdeed_calls[what]);
+        return false;
+    }
+    printf("ok: a tx_callback calling %s aborts\n", misdeed_calls[what]);
+    return true;
+}
+
+int main()
+{
+    bool ok = true;
+    devnull = open("/dev/null", O_RDONLY);
+    for (enum misdeed what = MISDEED_MALLOC; what <= MISDEED_USLEEP; what++) {
+        ok &= expect_abort(what);
+    }
+
+    // The clean run goes last, once no child can inherit its threads.
+    struct sim_result result = {0};
+    if (!serve_one_read(&result) || result.bytes_read != READ_LEN || result.bad_bytes != 0) {
+        fprintf(stderr, "FAIL: a clean tx_callback served %u bytes, %u bad\n", result.bytes_read, result.bad_bytes);
+        ok = false;
+    } else {
+        printf("ok: a clean tx_callback serves a read under the guard\n");
+    }
+    return ok ? 0 : 1;
+}
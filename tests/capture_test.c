@@ -0,0 +1,174 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Captures the master's traffic through the tap, converts the capture with
+ * tools/pi2c_capture_vcd.c and decodes the VCD back into I2C transfers,
+ * sampling SDA on each rising SCL edge between START and STOP. Each
+ * transaction must come back as the master's write of the address, then
+ * its read of the bytes from that address, with the slave address, R/W
+ * bit and ACKs right and a NACK on the last byte read. Run from the tests
+ * directory, after make has built the tool.
+ */
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define CAPTURE_PATH "build/capture_test.cap"
+#define VCD_PATH     "build/capture_test.vcd"
+#define TOOL         "build/pi2c_capture_vcd"
+#define TRANSFER_MAX (64)  ///< Bytes per decoded transfer, address included
+#define TRANSFERS    (128) ///< Transfers decoded at most
+
+static const struct sim_traffic traffic = {
+    .transactions = 20,
+    .min_read = 1,
+    .max_read = 12,
+    .byte_gap_us = 20,
+};
+
+struct transfer {
+    uint8_t bytes[TRANSFER_MAX];
+    bool acked[TRANSFER_MAX];
+    unsigned len;
+    unsigned bits; ///< Bits of the byte being decoded
+};
+
+static unsigned read_len(unsigned t)
+{
+    return traffic.min_read + t % (traffic.max_read - traffic.min_read + 1);
+}
+
+static bool capture(const struct bsc_i2c_tap * tap_in)
+{
+    struct bsc_i2c_tap tap = *tap_in;
+    int fd = open(CAPTURE_PATH, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(CAPTURE_PATH);
+        return false;
+    }
+    bool ok = bsc_i2c_capture_begin(fd);
+    int records = ok ? bsc_i2c_capture_save(&tap, fd) : -1;
+    close(fd);
+    printf("  %d records captured, %u overruns\n", records, tap.overruns);
+    return records == 2 * (int)traffic.transactions && tap.overruns == 0;
+}
+
+// Decode the VCD's scl (!) and sda (") changes into transfers
+static unsigned decode(FILE * vcd, struct transfer * out, unsigned max)
+{
+    char line[128];
+    bool scl = true;
+    bool sda = true;
+    bool in_transfer = false;
+    unsigned count = 0;
+    while (fgets(line, sizeof(line), vcd)) {
+        if ((line[0] != '0' && line[0] != '1') || (line[1] != '!' && line[1] != '"')) {
+            continue;
+        }
+        bool val = line[0] == '1';
+        if (line[1] == '"') {
+            if (scl && sda && !val && count < max) {
+                // START
+                out[count] = (struct transfer){0};
+                in_transfer = true;
+            } else if (scl && !sda && val && in_transfer) {
+                // STOP, which comes after a rising SCL edge that is no bit
+                out[count].bits = 0;
+                in_transfer = false;
+                count++;
+            }
+            sda = val;
+            continue;
+        }
+        if (val && !scl && in_transfer) {
+            struct transfer * t = &out[count];
+            if (t->len < TRANSFER_MAX) {
+                if (t->bits < 8) {
+                    t->bytes[t->len] = t->bytes[t->len] << 1 | sda;
+                    t->bits++;
+                } else {
+                    t->acked[t->len++] = !sda;
+                    t->bits = 0;
+                }
+            }
+        }
+        scl = val;
+    }
+    return count;
+}
+
+static bool same(const struct transfer * got, const uint8_t * bytes, unsigned len, bool read)
+{
+    if (got->len != len) {
+        return false;
+    }
+    for (unsigned i = 0; i < len; i++) {
+        // The slave ACKs the address and what the master writes. The master
+        // ACKs what it reads, except the last byte.
+        bool ack = !read || i == 0 || i + 1 < len;
+        if (got->bytes[i] != bytes[i] || got->acked[i] != ack) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main()
+{
+    struct bsc_i2c_config cfg = {.tap_len = 16384};
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_arena(&cfg) || !init_bsc_i2c_slv(SIM_SLAVE_ADDR) ||
+        !bsc_i2c_enable_tap()) {
+        return 1;
+    }
+    struct bsc_i2c_tap tap;
+    bsc_i2c_tap_subscribe(&tap);
+    struct sim_result result;
+    sim_serve(&traffic, sim_echo_cb, &result);
+    bsc_i2c_disable_tap();
+    printf("capture, %u transactions, %u underruns, %u bad bytes\n", result.reads, result.underruns,
+           result.bad_bytes);
+    bool ok = result.reads == traffic.transactions && result.bad_bytes == 0 && result.underruns == 0;
+    ok &= capture(&tap);
+    shutdown_bsc_i2c_slv();
+    shutdown_bcm_reg_mem();
+
+    if (system(TOOL " " CAPTURE_PATH " " VCD_PATH) != 0) {
+        fprintf(stderr, "FAIL: " TOOL " failed\n");
+        return 1;
+    }
+    FILE * vcd = fopen(VCD_PATH, "r");
+    if (vcd == NULL) {
+        perror(VCD_PATH);
+        return 1;
+    }
+    static struct transfer transfers[TRANSFERS];
+    unsigned count = decode(vcd, transfers, TRANSFERS);
+    fclose(vcd);
+
+    unsigned wrong = 0;
+    for (unsigned t = 0; t < traffic.transactions && 2 * t + 1 < count; t++) {
+        uint16_t addr = t * 3;
+        uint8_t write[] = {SIM_SLAVE_ADDR, addr >> 8, addr & 0xFF};
+        uint8_t read[TRANSFER_MAX] = {SIM_SLAVE_ADDR | 1};
+        for (unsigned i = 0; i < read_len(t); i++) {
+            read[i + 1] = (uint8_t)(addr + i);
+        }
+        if (!same(&transfers[2 * t], write, sizeof(write), false) ||
+            !same(&transfers[2 * t + 1], read, read_len(t) + 1, true)) {
+            fprintf(stderr, "  transaction %u decodes wrong\n", t);
+            wrong++;
+        }
+    }
+    printf("  %u transfers decoded from the VCD, %u transactions wrong\n", count, wrong);
+    ok &= count == 2 * traffic.transactions && wrong == 0;
+    if (!ok) {
+        fprintf(stderr, "FAIL: capture to VCD\n");
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,120 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Serves the master with the pi2cslave_coro.hpp handler from its usage
+ * example. The master reads from addresses inside the register image, up
+ * to its end and past it, and sometimes writes a lone byte with no whole
+ * address. Bytes inside the image must come back right, and the first byte
+ * past its end must be an underrun, with nothing served from beyond it.
+ * The bytes each reply reports sent must be those read from the image, or
+ * one fewer where the image ran dry, as bsc_i2c_write() then can't tell
+ * whether the master took the last byte queued.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <thread>
+#include <unistd.h>
+
+#include "pi2cslave_coro.hpp"
+extern "C" {
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+}
+
+#define TRANSACTIONS (300)
+#define IMAGE_LEN    (200)
+#define READ_LEN     (4)
+#define LONE_EVERY   (10) ///< Every so many transactions, the master writes a single byte
+#define GAP_US       (20)
+
+static uint8_t regs[IMAGE_LEN];
+static unsigned handled = 0;
+static unsigned sent_total = 0;
+static unsigned ran_dry = 0; ///< Replies that ended at the end of the image
+
+// The handler from the usage example
+static pi2c::Task handler(pi2c::Slave & slave)
+{
+    for (;;) {
+        std::span<const uint8_t> req = co_await slave.next_write();
+        // Past the end of regs, or without an address, serve nothing.
+        std::size_t addr = req.size() >= 2 ? (req[0] << 8) | req[1] : sizeof(regs);
+        int sent = co_await slave.reply(std::span(regs).subspan(std::min(addr, sizeof(regs))));
+        handled++;
+        sent_total += sent > 0 ? sent : 0;
+        ran_dry += addr < sizeof(regs) && addr + READ_LEN >= sizeof(regs);
+    }
+}
+
+struct master_result {
+    unsigned image_bytes = 0; ///< Bytes read from inside the image
+    unsigned bad = 0;         ///< Wrong bytes inside the image, or no underrun past it
+};
+
+static void master(master_result * result)
+{
+    for (unsigned t = 0; t < TRANSACTIONS; t++) {
+        bool lone = t % LONE_EVERY == LONE_EVERY - 1;
+        unsigned addr = lone ? IMAGE_LEN : (t * 7) % (IMAGE_LEN + 2 * READ_LEN);
+        pi2c_sim_master_start(SIM_SLAVE_ADDR >> 1, false);
+        if (lone) {
+            pi2c_sim_master_write_byte(addr >> 8);
+        } else {
+            pi2c_sim_master_write_byte(addr >> 8);
+            usleep(GAP_US);
+            pi2c_sim_master_write_byte(addr & 0xFF);
+        }
+        pi2c_sim_master_stop();
+        usleep(10 * GAP_US);
+
+        pi2c_sim_master_start(SIM_SLAVE_ADDR >> 1, true);
+        for (unsigned i = 0; i < READ_LEN; i++) {
+            bool underrun;
+            uint8_t byte = pi2c_sim_master_read_byte(&underrun);
+            if (addr + i < IMAGE_LEN) {
+                result->image_bytes++;
+                result->bad += underrun || byte != regs[addr + i];
+            } else {
+                // Bytes after an underrun come a byte late, so only the
+                // first one past the end is known.
+                result->bad += !underrun;
+                break;
+            }
+            usleep(GAP_US);
+        }
+        pi2c_sim_master_stop();
+        usleep(GAP_US);
+    }
+    bsc_i2c_request_stop();
+}
+
+int main()
+{
+    for (unsigned i = 0; i < IMAGE_LEN; i++) {
+        regs[i] = i ^ 0xA5;
+    }
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return 1;
+    }
+    master_result result;
+    std::thread thread(master, &result);
+    uint8_t rx[64];
+    pi2c::Slave slave(rx);
+    bool spawned = slave.spawn(handler(slave));
+    slave.run();
+    thread.join();
+
+    printf("coroutine handler, %u transactions, %u handled\n", TRANSACTIONS, handled);
+    printf("  %u bytes read from the image, %u reported sent, %u replies ran dry, %u bad\n",
+           result.image_bytes, sent_total, ran_dry, result.bad);
+    bool ok = spawned && !slave.failed() && result.bad == 0 && sent_total <= result.image_bytes &&
+              sent_total + ran_dry >= result.image_bytes && handled >= TRANSACTIONS - 1;
+    if (!ok) {
+        fprintf(stderr, "FAIL: coroutine handler\n");
+    }
+    shutdown_bsc_i2c_slv();
+    shutdown_bcm_reg_mem();
+    return ok ? 0 : 1;
+}
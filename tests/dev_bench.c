@@ -0,0 +1,179 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Compares the register path with a slave device, on the simulated BSC and
+ * on a pty standing in for the kernel slave driver. The master writes an
+ * address, then reads bytes from it, with a pause between transactions.
+ * Reports the latency from the master's address write to the slave's first
+ * tx_callback call, and the CPU time the slave's thread used per
+ * transaction and over the run.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define TRANSACTIONS  (500)
+#define MAX_READ      (16)
+#define TURNAROUND_US (300) ///< Master's pause between its write and its read
+#define HOLD_US       (1000) ///< Master's silence between transactions
+#define BYTE_WAIT_MS  (100)
+
+static int master_fd = -1; ///< The pty's master side, -1 on the simulated BSC
+static volatile addr_t read_end;
+static volatile uint64_t addr_sent_ns; ///< When the master's address write ended
+static uint64_t latency_sum_ns;
+static uint64_t latency_max_ns;
+static unsigned latencies;
+static unsigned bad_bytes;
+
+static uint64_t clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Times its first call per transaction. Stops at what the master reads,
+// which the pty needs and the BSC doesn't mind.
+static bool timed_cb(addr_t addr, uint8_t * out)
+{
+    if (addr >= read_end) {
+        return false;
+    }
+    uint64_t sent = addr_sent_ns;
+    if (sent) {
+        uint64_t latency = clock_ns(CLOCK_MONOTONIC) - sent;
+        addr_sent_ns = 0;
+        latency_sum_ns += latency;
+        latency_max_ns = latency > latency_max_ns ? latency : latency_max_ns;
+        latencies++;
+    }
+    *out = (uint8_t)addr;
+    return true;
+}
+
+static void sim_transaction(uint16_t addr, unsigned len)
+{
+    if (!pi2c_sim_master_start(SIM_SLAVE_ADDR >> 1, false)) {
+        return;
+    }
+    pi2c_sim_master_write_byte(addr >> 8);
+    pi2c_sim_master_write_byte(addr & 0xFF);
+    pi2c_sim_master_stop();
+    addr_sent_ns = clock_ns(CLOCK_MONOTONIC);
+    usleep(TURNAROUND_US);
+    if (!pi2c_sim_master_start(SIM_SLAVE_ADDR >> 1, true)) {
+        return;
+    }
+    for (unsigned i = 0; i < len; i++) {
+        bool underrun;
+        if (pi2c_sim_master_read_byte(&underrun) != (uint8_t)(addr + i) || underrun) {
+            bad_bytes++;
+        }
+    }
+    pi2c_sim_master_stop();
+}
+
+static void pty_transaction(uint16_t addr, unsigned len)
+{
+    uint8_t out[2] = {addr >> 8, addr & 0xFF};
+    if (write(master_fd, out, sizeof(out)) != sizeof(out)) {
+        return;
+    }
+    addr_sent_ns = clock_ns(CLOCK_MONOTONIC);
+    usleep(TURNAROUND_US);
+    for (unsigned i = 0; i < len; i++) {
+        struct pollfd pfd = {master_fd, POLLIN, 0};
+        uint8_t byte;
+        if (poll(&pfd, 1, BYTE_WAIT_MS) <= 0 || read(master_fd, &byte, 1) != 1 || byte != (uint8_t)(addr + i)) {
+            bad_bytes++;
+        }
+    }
+}
+
+static void * master(void * arg)
+{
+    (void)arg;
+    for (unsigned t = 0; t < TRANSACTIONS; t++) {
+        uint16_t addr = t * 3;
+        unsigned len = 1 + t % MAX_READ;
+        usleep(HOLD_US);
+        read_end = addr + len;
+        if (master_fd < 0) {
+            sim_transaction(addr, len);
+        } else {
+            pty_transaction(addr, len);
+        }
+    }
+    bsc_i2c_request_stop();
+    return NULL;
+}
+
+static bool run(void * arg)
+{
+    bool dev = arg != NULL;
+    if (dev) {
+        if ((master_fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(master_fd) < 0 ||
+            unlockpt(master_fd) < 0 || !init_bsc_i2c_dev(ptsname(master_fd))) {
+            return false;
+        }
+    } else if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return false;
+    }
+
+    uint64_t wall = clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    pthread_t thread;
+    pthread_create(&thread, NULL, master, NULL);
+    while (!bsc_i2c_stop_requested()) {
+        uint8_t buf[2];
+        int got = 0;
+        while (got < 2 && !bsc_i2c_stop_requested()) {
+            int more = bsc_i2c_read_poll(buf + got, 2 - got);
+            if (more < 0) {
+                break;
+            }
+            if (more == 0) {
+                bsc_i2c_idle_wait();
+            }
+            got += more;
+        }
+        if (got == 2) {
+            bsc_i2c_write(timed_cb, buf[0] << 8 | buf[1]);
+        }
+    }
+    cpu = clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    wall = clock_ns(CLOCK_MONOTONIC) - wall;
+    pthread_join(thread, NULL);
+
+    printf("  %-9s latency avg %5llu us max %5llu us, CPU %5llu us per transaction, %5.1f%%, %u bad bytes\n",
+           dev ? "pty" : "registers",
+           latencies ? (unsigned long long)(latency_sum_ns / latencies / 1000) : 0ULL,
+           (unsigned long long)(latency_max_ns / 1000),
+           (unsigned long long)(cpu / TRANSACTIONS / 1000),
+           100.0 * cpu / wall, bad_bytes);
+    shutdown_bsc_i2c_slv();
+    if (!dev) {
+        shutdown_bcm_reg_mem();
+    }
+    return latencies > 0;
+}
+
+int main()
+{
+    bool ok = true;
+    printf("%u transactions, reads of 1 to %u bytes, %u us apart\n", TRANSACTIONS, MAX_READ, HOLD_US);
+    ok &= sim_isolated(run, NULL);
+    ok &= sim_isolated(run, (void *)1);
+    return ok ? 0 : 1;
+}
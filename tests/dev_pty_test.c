@@ -0,0 +1,184 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Runs the slave on a pty standing in for the kernel slave driver, with the
+ * test playing the master on the other side. Every read must get the bytes
+ * of its address, and bsc_i2c_write() must return what the master read.
+ * Then cancels a bsc_i2c_write() asleep on a full pty, and checks the slave
+ * still serves the next read.
+ */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "sim_harness.h"
+
+#define TRANSACTIONS  (200)
+#define MAX_READ      (10)
+#define TURNAROUND_US (300)
+#define BYTE_WAIT_MS  (100)
+#define CANCEL_US     (50000)
+#define CANCEL_ADDR   (0x1234)
+
+static int master_fd = -1;
+static volatile addr_t read_end; ///< First address past the master's read
+
+// The pty hands over all it is given at once, so stop at what the master reads.
+static bool bounded_cb(addr_t addr, uint8_t * out)
+{
+    if (addr >= read_end) {
+        return false;
+    }
+    *out = (uint8_t)addr;
+    return true;
+}
+
+static bool endless_cb(addr_t addr, uint8_t * out)
+{
+    *out = (uint8_t)addr;
+    return true;
+}
+
+static unsigned read_len(unsigned t)
+{
+    return 1 + t % MAX_READ;
+}
+
+// Write the address, then read len bytes back. Returns the bad bytes.
+static unsigned master_transaction(uint16_t addr, unsigned len)
+{
+    uint8_t out[2] = {addr >> 8, addr & 0xFF};
+    read_end = addr + len;
+    if (write(master_fd, out, sizeof(out)) != sizeof(out)) {
+        return len;
+    }
+    usleep(TURNAROUND_US);
+    unsigned bad = 0;
+    for (unsigned i = 0; i < len; i++) {
+        struct pollfd pfd = {master_fd, POLLIN, 0};
+        uint8_t byte;
+        if (poll(&pfd, 1, BYTE_WAIT_MS) <= 0 || read(master_fd, &byte, 1) != 1 || byte != (uint8_t)(addr + i)) {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+static void * master(void * arg)
+{
+    unsigned * bad = arg;
+    for (unsigned t = 0; t < TRANSACTIONS; t++) {
+        *bad += master_transaction(t * 3, read_len(t));
+    }
+    bsc_i2c_request_stop();
+    return NULL;
+}
+
+static void * master_once(void * arg)
+{
+    unsigned * bad = arg;
+    *bad = master_transaction(CANCEL_ADDR, MAX_READ);
+    bsc_i2c_request_stop();
+    return NULL;
+}
+
+// Read a two byte address, false once the master is done.
+static bool read_addr(uint16_t * addr)
+{
+    uint8_t buf[2];
+    int got = 0;
+    while (got < 2 && !bsc_i2c_stop_requested()) {
+        int more = bsc_i2c_read_poll(buf + got, 2 - got);
+        if (more < 0) {
+            return false;
+        }
+        if (more == 0) {
+            bsc_i2c_idle_wait();
+        }
+        got += more;
+    }
+    *addr = buf[0] << 8 | buf[1];
+    return got == 2;
+}
+
+static bool serve()
+{
+    unsigned bad = 0;
+    unsigned miscounted = 0;
+    bsc_i2c_clear_stop();
+    pthread_t thread;
+    pthread_create(&thread, NULL, master, &bad);
+    uint16_t addr;
+    for (unsigned t = 0; read_addr(&addr); t++) {
+        int sent = bsc_i2c_write(bounded_cb, addr);
+        miscounted += sent != (int)read_len(t);
+    }
+    pthread_join(thread, NULL);
+    printf("  %u transactions, %u bad bytes, %u miscounted writes\n", TRANSACTIONS, bad, miscounted);
+    return bad == 0 && miscounted == 0;
+}
+
+static void * write_forever(void * arg)
+{
+    (void)arg;
+    bsc_i2c_write(endless_cb, 0);
+    return NULL;
+}
+
+static bool cancel_write()
+{
+    bsc_i2c_clear_stop();
+    pthread_t thread;
+    pthread_create(&thread, NULL, write_forever, NULL);
+    usleep(CANCEL_US);
+    pthread_cancel(thread);
+    void * status;
+    pthread_join(thread, &status);
+    if (status != PTHREAD_CANCELED) {
+        fprintf(stderr, "FAIL: bsc_i2c_write() returned before being canceled\n");
+        return false;
+    }
+
+    // The pty passed on what it was given, drop it like the master would.
+    uint8_t junk[256];
+    struct pollfd pfd = {master_fd, POLLIN, 0};
+    while (poll(&pfd, 1, BYTE_WAIT_MS) > 0 && read(master_fd, junk, sizeof(junk)) > 0) {
+    }
+
+    unsigned bad = 0;
+    bsc_i2c_clear_stop();
+    pthread_create(&thread, NULL, master_once, &bad);
+    uint16_t addr;
+    int sent = read_addr(&addr) ? bsc_i2c_write(bounded_cb, addr) : -1;
+    pthread_join(thread, NULL);
+    if (sent != MAX_READ) {
+        fprintf(stderr, "FAIL: write after the cancel sent %d bytes\n", sent);
+        return false;
+    }
+    printf("  canceled write, then %u bad bytes of %u\n", bad, MAX_READ);
+    return bad == 0;
+}
+
+int main()
+{
+    if ((master_fd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(master_fd) < 0 || unlockpt(master_fd) < 0) {
+        perror("posix_openpt");
+        return 1;
+    }
+    fcntl(master_fd, F_SETFL, O_NONBLOCK);
+    if (!init_bsc_i2c_dev(ptsname(master_fd))) {
+        return 1;
+    }
+    bool ok = true;
+    printf("pty slave\n");
+    ok &= serve();
+    ok &= cancel_write();
+    shutdown_bsc_i2c_slv();
+    return ok ? 0 : 1;
+}
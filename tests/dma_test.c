@@ -0,0 +1,112 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Serves master reads from the DMA image and checks every byte, then checks
+ * bsc_i2c_write() refuses a tx_callback in DMA mode. Then cancels a
+ * bsc_i2c_write() while the DMA feeds the TX FIFO, and checks the TX
+ * channel and its DMA requests are stopped, the TX FIFO is empty, and the
+ * next reads are still right.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define IMAGE_LEN (256)
+#define RING_LEN  (64)
+#define CANCEL_US (20000)
+
+static const struct sim_traffic traffic = {
+    .transactions = 200,
+    .min_read = 1,
+    .max_read = 40,
+    .byte_gap_us = 20,
+};
+
+// Runs the traffic. The image holds the low byte of each address, wrapping
+// at the end like the master's reads do, so the harness can check it.
+static bool serve(const char * what)
+{
+    struct sim_result result;
+    sim_serve(&traffic, NULL, &result);
+    printf("  %s: %u reads, %u bytes, %u underruns, %u bad bytes\n",
+           what, result.reads, result.bytes_read, result.underruns, result.bad_bytes);
+    if (result.reads != traffic.transactions || result.bad_bytes != 0) {
+        fprintf(stderr, "FAIL: %s: %u of %u reads, %u bad bytes\n",
+                what, result.reads, traffic.transactions, result.bad_bytes);
+        return false;
+    }
+    return true;
+}
+
+static void * write_forever(void * arg)
+{
+    (void)arg;
+    bsc_i2c_write(NULL, 0);
+    return NULL;
+}
+
+static bool cancel_write()
+{
+    volatile uint32_t * bsc;
+    volatile uint32_t * gpio;
+    volatile uint32_t * dma;
+    pi2c_sim_map(&bsc, &gpio, &dma);
+
+    bsc_i2c_clear_stop();
+    pthread_t thread;
+    pthread_create(&thread, NULL, write_forever, NULL);
+    usleep(CANCEL_US);
+    pthread_cancel(thread);
+    void * status;
+    pthread_join(thread, &status);
+    if (status != PTHREAD_CANCELED) {
+        fprintf(stderr, "FAIL: bsc_i2c_write() returned before being canceled\n");
+        return false;
+    }
+
+    uint32_t dmacr = pi2c_sim_read(&bsc[BSC_DMACR]);
+    uint32_t cs = pi2c_sim_read(&dma[BSC_DMA_TX_CHANNEL * DMA_CHAN_LEN / sizeof(uint32_t) + DMA_CS]);
+    uint32_t fr = pi2c_sim_read(&bsc[BSC_FR]);
+    printf("  canceled write: TX DMA requests %s, TX channel %s, TX FIFO %s\n",
+           dmacr & DMACR_TXDMAE ? "on" : "off", cs & DMA_CS_ACTIVE ? "active" : "stopped",
+           fr & FR_TXFE ? "empty" : "not empty");
+    return !(dmacr & DMACR_TXDMAE) && !(cs & DMA_CS_ACTIVE) && (fr & FR_TXFE) && (dmacr & DMACR_RXDMAE);
+}
+
+int main()
+{
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return 1;
+    }
+    struct bsc_i2c_dma_config cfg = {BSC_DMA_TX_CHANNEL, BSC_DMA_RX_CHANNEL, IMAGE_LEN, RING_LEN};
+    if (!bsc_i2c_start_dma(&cfg)) {
+        return 1;
+    }
+    uint8_t image[IMAGE_LEN];
+    for (unsigned i = 0; i < IMAGE_LEN; i++) {
+        image[i] = i;
+    }
+    if (!bsc_i2c_dma_set_image(0, image, sizeof(image))) {
+        return 1;
+    }
+
+    bool ok = true;
+    printf("DMA mode\n");
+    ok &= serve("image");
+    if (bsc_i2c_write(sim_echo_cb, 0) != -1) {
+        fprintf(stderr, "FAIL: bsc_i2c_write() took a tx_callback in DMA mode\n");
+        ok = false;
+    }
+    ok &= cancel_write();
+    ok &= serve("after the cancel");
+
+    bsc_i2c_stop_dma();
+    shutdown_bsc_i2c_slv();
+    shutdown_bcm_reg_mem();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,78 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Counts how often the event thread wakes up on an idle bus for one second,
+ * with the default back off and with the RX interrupt. Reports the
+ * process' voluntary context switches, which the event thread's sleeps
+ * dominate. Then checks that short master writes still post BSC_EVENT_RX.
+ */
+#include <poll.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define IDLE_SECONDS  (1)
+#define EVENT_WAIT_MS (200)
+
+static long context_switches()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_nvcsw;
+}
+
+// Does a master write of len bytes post BSC_EVENT_RX?
+static bool write_posts_rx(unsigned len)
+{
+    pi2c_sim_master_start(SIM_SLAVE_ADDR >> 1, false);
+    for (unsigned i = 0; i < len; i++) {
+        pi2c_sim_master_write_byte(i);
+    }
+    pi2c_sim_master_stop();
+    struct pollfd pfd = {bsc_i2c_event_fd(), POLLIN, 0};
+    poll(&pfd, 1, EVENT_WAIT_MS);
+    unsigned events = bsc_i2c_take_events(NULL);
+    uint8_t buf[FIFO_LEN];
+    bsc_i2c_read_poll(buf, sizeof(buf));
+    return events & BSC_EVENT_RX;
+}
+
+static bool run(void * arg)
+{
+    bool irq = arg != NULL;
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return false;
+    }
+    if (irq && !bsc_i2c_enable_tx_irq(NULL, IFLS_1_8)) {
+        return false;
+    }
+    if (bsc_i2c_event_fd() < 0 || !bsc_i2c_start_event_thread()) {
+        return false;
+    }
+    long before = context_switches();
+    sleep(IDLE_SECONDS);
+    long wakeups = context_switches() - before;
+
+    unsigned missed = 0;
+    for (unsigned len = 1; len <= 8; len *= 2) {
+        missed += !write_posts_rx(len);
+    }
+    bsc_i2c_stop_event_thread();
+    printf("  %-9s %ld wakeups per second, %u of 4 writes without BSC_EVENT_RX\n",
+           irq ? "RX IRQ" : "back off", wakeups / IDLE_SECONDS, missed);
+    return missed == 0;
+}
+
+int main()
+{
+    bool ok = true;
+    printf("event thread, idle bus\n");
+    ok &= sim_isolated(run, NULL);
+    ok &= sim_isolated(run, (void *)1);
+    return ok ? 0 : 1;
+}
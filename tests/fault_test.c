@@ -0,0 +1,114 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Injects each simulated fault at random, alone and then all together, and
+ * checks the library recovers from every one once the faults stop. A run
+ * without faults must serve every read, with no byte from the wrong
+ * address. Underruns are only counted, they depend on the host's
+ * scheduling. Prints what the simulator measured of each recovery.
+ */
+#include <stdio.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define TRANSACTIONS (1000)
+#define FAULT_SEED   (42)
+
+static const char * const fault_names[PI2C_SIM_FAULT_COUNT] = {
+    [PI2C_SIM_FAULT_RX_OVERRUN] = "rx overrun",
+    [PI2C_SIM_FAULT_TX_UNDERRUN] = "tx underrun",
+    [PI2C_SIM_FAULT_ABORT] = "abort",
+    [PI2C_SIM_FAULT_NO_READBACK] = "no readback",
+    [PI2C_SIM_FAULT_STUCK_TX] = "stuck tx",
+};
+
+// Chances per opportunity giving each fault about 10 or more times a run
+static const uint32_t fault_ppm[PI2C_SIM_FAULT_COUNT] = {
+    [PI2C_SIM_FAULT_RX_OVERRUN] = 5000,
+    [PI2C_SIM_FAULT_TX_UNDERRUN] = 2000,
+    [PI2C_SIM_FAULT_ABORT] = 2000,
+    [PI2C_SIM_FAULT_NO_READBACK] = 10000,
+    [PI2C_SIM_FAULT_STUCK_TX] = 2000,
+};
+
+static const struct sim_traffic traffic = {
+    .transactions = TRANSACTIONS,
+    .min_read = 1,
+    .max_read = 20,
+    .byte_gap_us = 20,
+};
+
+// Clean traffic after the faults stop, to recover from one still active.
+static const struct sim_traffic settle = {
+    .transactions = 5,
+    .min_read = 1,
+    .max_read = 20,
+    .byte_gap_us = 20,
+};
+
+// Run the traffic with the faults in the mask injected, and check them.
+static bool run(unsigned mask)
+{
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return false;
+    }
+    for (unsigned kind = 0; kind < PI2C_SIM_FAULT_COUNT; kind++) {
+        if (mask & (1u << kind)) {
+            pi2c_sim_random_faults(kind, fault_ppm[kind], FAULT_SEED);
+        }
+    }
+
+    struct sim_result result;
+    sim_serve(&traffic, sim_echo_cb, &result);
+    struct sim_result settled;
+    for (unsigned kind = 0; kind < PI2C_SIM_FAULT_COUNT; kind++) {
+        pi2c_sim_random_faults(kind, 0, 0);
+    }
+    sim_serve(&settle, sim_echo_cb, &settled);
+
+    bool ok = true;
+    if (mask == 0) {
+        printf("  %u reads, %u bytes, %u underruns\n", result.reads, result.bytes_read, result.underruns);
+        if (result.reads != TRANSACTIONS || result.bad_bytes != 0) {
+            fprintf(stderr, "FAIL: without faults, %u of %u reads, %u bad bytes\n",
+                    result.reads, TRANSACTIONS, result.bad_bytes);
+            ok = false;
+        }
+    }
+    for (unsigned kind = 0; kind < PI2C_SIM_FAULT_COUNT; kind++) {
+        if (!(mask & (1u << kind))) {
+            continue;
+        }
+        struct pi2c_sim_fault_stats stats;
+        pi2c_sim_get_fault_stats(kind, &stats);
+        printf("  %-11s injected %3u recovered %3u avg %5llu us max %5llu us, %u bytes lost\n",
+               fault_names[kind], stats.injected, stats.recovered,
+               stats.recovered ? (unsigned long long)(stats.total_recovery_ns / stats.recovered / 1000) : 0ULL,
+               (unsigned long long)(stats.max_recovery_ns / 1000), stats.bytes_lost);
+        if (stats.injected == 0 || stats.recovered != stats.injected) {
+            fprintf(stderr, "FAIL: %s: %u injected, %u recovered\n",
+                    fault_names[kind], stats.injected, stats.recovered);
+            ok = false;
+        }
+    }
+    shutdown_bsc_i2c_slv();
+    shutdown_bcm_reg_mem();
+    return ok;
+}
+
+int main()
+{
+    bool ok = true;
+    printf("no faults\n");
+    ok &= run(0);
+    for (unsigned kind = 0; kind < PI2C_SIM_FAULT_COUNT; kind++) {
+        printf("%s\n", fault_names[kind]);
+        ok &= run(1u << kind);
+    }
+    printf("all faults\n");
+    ok &= run((1u << PI2C_SIM_FAULT_COUNT) - 1);
+    return ok ? 0 : 1;
+}
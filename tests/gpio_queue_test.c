@@ -0,0 +1,93 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Threads toggle their own GPIOs, several to a GPFSEL register, while the
+ * service thread drains the queue between FIFO services. When they are
+ * done, every pin must hold the last mode its thread asked for, and the
+ * BSC pins must still be in ALT3.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define CHANGES (200000) ///< Changes each thread makes
+
+static const uint8_t pins[] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 17, 20, 21};
+#define PIN_COUNT (sizeof(pins) / sizeof(pins[0]))
+
+static atomic_uint running;
+static atomic_uint failures;
+
+static enum gpio_state final_state(uint8_t pin)
+{
+    return (pin & 1) ? GPIO_STATE_LOW : GPIO_STATE_FLOAT;
+}
+
+static void * worker(void * arg)
+{
+    uint8_t pin = (uint8_t)(uintptr_t)arg;
+    for (unsigned i = 0; i < CHANGES; i++) {
+        enum gpio_state state = (i & 1) ? GPIO_STATE_FLOAT : GPIO_STATE_HIGH;
+        if (i % 3 == 0) {
+            while (!bcm_queue_gpio_out(pin, state)) {
+            }
+        } else if (!bcm_set_gpio_out(pin, state)) {
+            atomic_fetch_add(&failures, 1);
+        }
+    }
+    if (!bcm_set_gpio_out(pin, final_state(pin))) {
+        atomic_fetch_add(&failures, 1);
+    }
+    atomic_fetch_sub(&running, 1);
+    return NULL;
+}
+
+static unsigned fsel(volatile uint32_t * gpio, unsigned pin)
+{
+    return (gpio[pin / GPIO_FUN_PER_REG] >> ((pin % GPIO_FUN_PER_REG) * GPIO_FUN_SHIFT)) & GPIO_FUN_MASK;
+}
+
+int main()
+{
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return 1;
+    }
+    pthread_t threads[PIN_COUNT];
+    atomic_store(&running, PIN_COUNT);
+    for (unsigned i = 0; i < PIN_COUNT; i++) {
+        pthread_create(&threads[i], NULL, worker, (void *)(uintptr_t)pins[i]);
+    }
+    while (atomic_load(&running)) {
+        bsc_i2c_idle_wait();
+    }
+    for (unsigned i = 0; i < PIN_COUNT; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    bcm_gpio_sync();
+
+    volatile uint32_t * bsc;
+    volatile uint32_t * gpio;
+    volatile uint32_t * dma;
+    pi2c_sim_map(&bsc, &gpio, &dma);
+    unsigned bad = atomic_load(&failures);
+    for (unsigned i = 0; i < PIN_COUNT; i++) {
+        unsigned want = final_state(pins[i]) == GPIO_STATE_LOW ? GPIO_FUN_OUT : GPIO_FUN_IN;
+        if (fsel(gpio, pins[i]) != want) {
+            fprintf(stderr, "FAIL: GPIO %u in mode %u, not %u\n", pins[i], fsel(gpio, pins[i]), want);
+            bad++;
+        }
+    }
+    for (unsigned pin = 18; pin <= 19; pin++) {
+        if (fsel(gpio, pin) != GPIO_FUN_ALT3) {
+            fprintf(stderr, "FAIL: BSC pin %u in mode %u\n", pin, fsel(gpio, pin));
+            bad++;
+        }
+    }
+    printf("%zu threads, %u changes each, %u bad pins\n", PIN_COUNT, CHANGES, bad);
+    return bad ? 1 : 0;
+}
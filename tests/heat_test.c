@@ -0,0 +1,181 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Runs the master's traffic with the heat map on, while writer threads
+ * count writes to every page with bsc_i2c_heat_note_write() and a reporter
+ * thread takes reports. Every report must be sorted and never count more
+ * read starts or writes than there are. At the end each page must have
+ * exactly the writes, and without underruns the read starts and bytes
+ * read, that the traffic gives it.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define PAGE_LEN       (16)
+#define PAGES          ((0xFFFF + 1) / PAGE_LEN)
+#define WRITER_THREADS (2)
+#define WRITE_ROUNDS   (50) ///< Writes per thread to each address in WRITE_SPAN
+#define WRITE_SPAN     (256)
+#define REPORT_GAP_US  (100) ///< Reporter's pause between reports
+
+static const struct sim_traffic traffic = {
+    .transactions = 200,
+    .min_read = 1,
+    .max_read = 40,
+    .byte_gap_us = 10,
+};
+
+static uint32_t want_starts[PAGES];
+static uint32_t want_bytes[PAGES];
+static uint32_t want_writes[PAGES];
+static atomic_bool traffic_done;
+static atomic_uint reports;
+static atomic_uint bad_reports;
+
+static unsigned read_len(unsigned t)
+{
+    return traffic.min_read + t % (traffic.max_read - traffic.min_read + 1);
+}
+
+// What the traffic and the writers count, the master reading from address
+// 3t in transaction t.
+static void expect()
+{
+    for (unsigned t = 0; t < traffic.transactions; t++) {
+        unsigned addr = t * 3;
+        want_starts[addr / PAGE_LEN]++;
+        for (unsigned i = 0; i < read_len(t); i++) {
+            want_bytes[(addr + i) / PAGE_LEN]++;
+        }
+    }
+    for (unsigned addr = 0; addr < WRITE_SPAN; addr++) {
+        want_writes[addr / PAGE_LEN] += WRITER_THREADS * WRITE_ROUNDS;
+    }
+}
+
+static void * writer(void * arg)
+{
+    (void)arg;
+    for (unsigned r = 0; r < WRITE_ROUNDS; r++) {
+        for (unsigned addr = 0; addr < WRITE_SPAN; addr++) {
+            bsc_i2c_heat_note_write(addr);
+        }
+    }
+    return NULL;
+}
+
+static uint64_t key_value(const struct bsc_i2c_heat_page * page, enum bsc_i2c_heat_key key)
+{
+    switch (key) {
+        case BSC_HEAT_BY_READ_STARTS:
+            return page->read_starts;
+        case BSC_HEAT_BY_BYTES_READ:
+            return page->bytes_read;
+        case BSC_HEAT_BY_WRITES:
+            return page->writes;
+        case BSC_HEAT_BY_RECENT:
+            return page->last_access_ns;
+        default:
+            return PAGES - page->first / PAGE_LEN;
+    }
+}
+
+// Whether the report is sorted by key, ties by address, and counts no more
+// read starts and writes than the traffic and writers do in all
+static bool report_ok(const struct bsc_i2c_heat_page * pages, size_t used, enum bsc_i2c_heat_key key)
+{
+    for (size_t i = 0; i < used; i++) {
+        unsigned p = pages[i].first / PAGE_LEN;
+        if (pages[i].first % PAGE_LEN || pages[i].read_starts > want_starts[p] || pages[i].writes > want_writes[p]) {
+            return false;
+        }
+        if (i > 0) {
+            uint64_t prev = key_value(&pages[i - 1], key);
+            uint64_t cur = key_value(&pages[i], key);
+            if (prev < cur || (prev == cur && pages[i - 1].first >= pages[i].first)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+static void * reporter(void * arg)
+{
+    (void)arg;
+    static struct bsc_i2c_heat_page pages[PAGES];
+    for (unsigned n = 0; !atomic_load(&traffic_done); n++) {
+        enum bsc_i2c_heat_key key = n % (BSC_HEAT_BY_ADDR + 1);
+        size_t used = bsc_i2c_heat_report(pages, PAGES, key);
+        atomic_fetch_add(&reports, 1);
+        if (!report_ok(pages, used, key)) {
+            atomic_fetch_add(&bad_reports, 1);
+        }
+        usleep(REPORT_GAP_US);
+    }
+    return NULL;
+}
+
+int main()
+{
+    struct bsc_i2c_config cfg = {.heat_page_len = PAGE_LEN};
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_arena(&cfg) || !init_bsc_i2c_slv(SIM_SLAVE_ADDR) ||
+        !bsc_i2c_enable_heat_map()) {
+        return 1;
+    }
+    expect();
+    pthread_t threads[WRITER_THREADS + 1];
+    pthread_create(&threads[0], NULL, reporter, NULL);
+    for (unsigned i = 1; i <= WRITER_THREADS; i++) {
+        pthread_create(&threads[i], NULL, writer, NULL);
+    }
+
+    struct sim_result result;
+    sim_serve(&traffic, sim_echo_cb, &result);
+    for (unsigned i = 1; i <= WRITER_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    atomic_store(&traffic_done, true);
+    pthread_join(threads[0], NULL);
+
+    static struct bsc_i2c_heat_page pages[PAGES];
+    static struct bsc_i2c_heat_page by_page[PAGES]; ///< Zero for pages not reported
+    size_t used = bsc_i2c_heat_report(pages, PAGES, BSC_HEAT_BY_ADDR);
+    for (size_t i = 0; i < used; i++) {
+        by_page[pages[i].first / PAGE_LEN] = pages[i];
+    }
+    unsigned wrong = 0;
+    for (unsigned p = 0; p < PAGES; p++) {
+        const struct bsc_i2c_heat_page * got = &by_page[p];
+        // An underrun can leave a read with no byte sent, so no start.
+        bool reads_ok = result.underruns ? got->read_starts <= want_starts[p]
+                                         : got->read_starts == want_starts[p] && got->bytes_read == want_bytes[p];
+        wrong += !reads_ok || got->writes != want_writes[p];
+    }
+
+    printf("heat map, %u transactions, %u underruns, %u bad bytes, %zu pages, %u reports during traffic\n",
+           result.reads, result.underruns, result.bad_bytes, used, atomic_load(&reports));
+    printf("  %u pages with wrong counts, %u bad reports\n", wrong, atomic_load(&bad_reports));
+    bool ok = result.reads == traffic.transactions && result.bad_bytes == 0 && wrong == 0 &&
+              atomic_load(&bad_reports) == 0 && atomic_load(&reports) > 0;
+    if (!ok) {
+        fprintf(stderr, "FAIL: heat map counts\n");
+    }
+
+    bsc_i2c_reset_heat_map();
+    if (bsc_i2c_heat_report(pages, PAGES, BSC_HEAT_BY_ADDR) != 0) {
+        fprintf(stderr, "FAIL: pages left after reset\n");
+        ok = false;
+    }
+    bsc_i2c_disable_heat_map();
+    shutdown_bsc_i2c_slv();
+    shutdown_bcm_reg_mem();
+    return ok ? 0 : 1;
+}
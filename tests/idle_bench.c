@@ -0,0 +1,70 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Measures what the idle back off trades: the CPU the slave's thread uses
+ * on a mostly quiet bus, against the latency from the master's address
+ * write to the slave's first tx_callback call. Runs without the back off,
+ * then with the ceiling derived from the bus rate and with fixed ceilings.
+ */
+#include <stdio.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define CONFIGS (4)
+
+struct config {
+    const char * name;
+    bool backoff;
+    unsigned ceiling_us;
+};
+
+static const struct config configs[CONFIGS] = {
+    {"off", false, 0},
+    {"derived", true, 0},
+    {"1 ms", true, 1000},
+    {"5 ms", true, 5000},
+};
+
+// The master wakes up every 25 ms for a short read. It leaves the slave
+// more time than the longest ceiling between its write and its read, as
+// bsc_i2c_set_idle_backoff() asks.
+static const struct sim_traffic traffic = {
+    .transactions = 40,
+    .min_read = 1,
+    .max_read = 8,
+    .byte_gap_us = 20,
+    .hold_us = 25000,
+    .turnaround_us = 10000,
+};
+
+static bool run(void * arg)
+{
+    const struct config * config = arg;
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return false;
+    }
+    bsc_i2c_set_idle_backoff(config->backoff, config->ceiling_us);
+
+    struct sim_result result;
+    sim_serve(&traffic, sim_echo_cb, &result);
+    printf("  %-8s CPU %5.1f%%, latency avg %5llu us max %5llu us, %u bad bytes of %u\n",
+           config->name, 100.0 * result.slave_cpu_ns / result.wall_ns,
+           result.latencies ? (unsigned long long)(result.latency_sum_ns / result.latencies / 1000) : 0ULL,
+           (unsigned long long)(result.latency_max_ns / 1000), result.bad_bytes, result.bytes_read);
+    shutdown_bsc_i2c_slv();
+    shutdown_bcm_reg_mem();
+    return result.reads == traffic.transactions && result.bad_bytes == 0;
+}
+
+int main()
+{
+    bool ok = true;
+    printf("idle back off, a read every %u ms\n", traffic.hold_us / 1000);
+    for (unsigned i = 0; i < CONFIGS; i++) {
+        ok &= sim_isolated(run, (void *)&configs[i]);
+    }
+    return ok ? 0 : 1;
+}
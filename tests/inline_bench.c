@@ -0,0 +1,104 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Compares draining the RX FIFO with bsc_i2c_read_poll() to draining it
+ * with the pi2cslave_inline.h accessors, in bulk and a byte at a time. The
+ * master fills the RX FIFO, then each method drains it. Reports the time
+ * and register accesses per byte, and checks every byte drained. Each
+ * simulated register access takes a lock, which narrows the time gap
+ * compared to real registers.
+ */
+#include <stdio.h>
+
+#include "pi2c_sim.h"
+#include "pi2cslave_inline.h"
+#include "sim_harness.h"
+
+#define BURSTS  (20000)
+#define METHODS (3)
+
+static size_t read_poll(uint8_t * buf, size_t len)
+{
+    int got = bsc_i2c_read_poll(buf, len);
+    return got > 0 ? got : 0;
+}
+
+static size_t inline_drain(uint8_t * buf, size_t len)
+{
+    return bsc_fifo_drain(bsc_i2c_regs(), buf, len);
+}
+
+static size_t inline_pop(uint8_t * buf, size_t len)
+{
+    volatile uint32_t * regs = bsc_i2c_regs();
+    size_t got = 0;
+    while (got < len && !(bsc_fifo_status(regs) & FR_RXFE)) {
+        buf[got++] = bsc_fifo_pop(regs);
+    }
+    return got;
+}
+
+static const struct {
+    const char * name;
+    size_t (*drain)(uint8_t * buf, size_t len);
+} methods[METHODS] = {
+    {"bsc_i2c_read_poll()", read_poll},
+    {"bsc_fifo_drain()", inline_drain},
+    {"bsc_fifo_pop()", inline_pop},
+};
+
+static uint64_t accesses()
+{
+    struct pi2c_sim_access_stats stats;
+    pi2c_sim_get_access_stats(&stats);
+    return stats.reads + stats.writes;
+}
+
+static bool run(unsigned method)
+{
+    uint64_t ns = 0;
+    uint64_t accessed = 0;
+    uint64_t bytes = 0;
+    unsigned bad = 0;
+    for (unsigned b = 0; b < BURSTS; b++) {
+        pi2c_sim_master_start(SIM_SLAVE_ADDR >> 1, false);
+        for (unsigned i = 0; i < FIFO_LEN; i++) {
+            pi2c_sim_master_write_byte(i);
+        }
+        pi2c_sim_master_stop();
+
+        uint8_t buf[FIFO_LEN];
+        uint64_t before = accesses();
+        uint64_t start = sim_clock_ns(CLOCK_MONOTONIC);
+        size_t got = methods[method].drain(buf, sizeof(buf));
+        ns += sim_clock_ns(CLOCK_MONOTONIC) - start;
+        accessed += accesses() - before;
+        bytes += got;
+        for (size_t i = 0; i < got; i++) {
+            bad += buf[i] != i;
+        }
+        // Leave nothing behind for the next burst.
+        while (methods[method].drain(buf, sizeof(buf)) > 0) {
+        }
+    }
+    printf("  %-20s %6.1f ns, %5.2f register accesses per byte, %u bad bytes\n",
+           methods[method].name, (double)ns / bytes, (double)accessed / bytes, bad);
+    return bytes == (uint64_t)BURSTS * FIFO_LEN && bad == 0;
+}
+
+int main()
+{
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return 1;
+    }
+    bool ok = true;
+    printf("RX FIFO drain, %u bursts of %u bytes\n", BURSTS, FIFO_LEN);
+    for (unsigned m = 0; m < METHODS; m++) {
+        ok &= run(m);
+    }
+    shutdown_bsc_i2c_slv();
+    shutdown_bcm_reg_mem();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,137 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Compares the minimal service loop variant, with no feature on, to the
+ * full one, with timing, the diagnostic window and the tap on. The master
+ * fills the RX FIFO, then bsc_i2c_read_poll() drains it, and the bench
+ * reports per byte drained the time, the register accesses and, where
+ * perf_event_open() is allowed, the instructions. Instructions include the
+ * simulator's register model, so only their difference is the loop's.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define BURSTS    (5000)
+#define DIAG_BASE (0xF000)
+
+struct counts {
+    uint64_t ns;
+    uint64_t instructions;
+    uint64_t accesses;
+    uint64_t bytes;
+};
+
+// Count the calling thread's user space instructions, -1 if not allowed
+static int open_instructions()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static uint64_t read_instructions(int fd)
+{
+    uint64_t count = 0;
+    if (fd >= 0 && read(fd, &count, sizeof(count)) != sizeof(count)) {
+        count = 0;
+    }
+    return count;
+}
+
+static uint64_t accesses()
+{
+    struct pi2c_sim_access_stats stats;
+    pi2c_sim_get_access_stats(&stats);
+    return stats.reads + stats.writes;
+}
+
+// Fill the RX FIFO from the master, then time draining it.
+static void drain_bursts(int perf_fd, struct counts * out)
+{
+    *out = (struct counts){0};
+    for (unsigned b = 0; b < BURSTS; b++) {
+        pi2c_sim_master_start(SIM_SLAVE_ADDR >> 1, false);
+        for (unsigned i = 0; i < FIFO_LEN; i++) {
+            pi2c_sim_master_write_byte(i);
+        }
+        pi2c_sim_master_stop();
+
+        uint8_t buf[FIFO_LEN];
+        uint64_t instructions = read_instructions(perf_fd);
+        uint64_t before = accesses();
+        uint64_t start = sim_clock_ns(CLOCK_MONOTONIC);
+        int got = bsc_i2c_read_poll(buf, sizeof(buf));
+        out->ns += sim_clock_ns(CLOCK_MONOTONIC) - start;
+        out->accesses += accesses() - before;
+        out->instructions += read_instructions(perf_fd) - instructions;
+        out->bytes += got > 0 ? got : 0;
+    }
+}
+
+static bool run(void * arg)
+{
+    bool full = arg != NULL;
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return false;
+    }
+    if (full) {
+        bsc_i2c_set_timing(true);
+        if (!bsc_i2c_enable_diag(DIAG_BASE) || !bsc_i2c_enable_tap()) {
+            return false;
+        }
+    }
+
+    int perf_fd = open_instructions();
+    int perf_errno = errno;
+    if (perf_fd >= 0) {
+        ioctl(perf_fd, PERF_EVENT_IOC_ENABLE, 0);
+    }
+    struct counts counts;
+    drain_bursts(perf_fd, &counts);
+    if (counts.bytes == 0) {
+        fprintf(stderr, "FAIL: nothing drained\n");
+        return false;
+    }
+
+    printf("  %-7s %6.1f ns, %5.2f register accesses", full ? "full" : "minimal",
+           (double)counts.ns / counts.bytes, (double)counts.accesses / counts.bytes);
+    if (perf_fd >= 0) {
+        printf(", %6.1f instructions per byte\n", (double)counts.instructions / counts.bytes);
+        close(perf_fd);
+    } else {
+        printf(" per byte, instructions not counted: %s\n", strerror(perf_errno));
+    }
+    if (full) {
+        bsc_i2c_disable_tap();
+        bsc_i2c_disable_diag();
+    }
+    shutdown_bsc_i2c_slv();
+    shutdown_bcm_reg_mem();
+    return counts.bytes == (uint64_t)BURSTS * FIFO_LEN;
+}
+
+int main()
+{
+    bool ok = true;
+    printf("service loop variants, %u bursts of %u bytes\n", BURSTS, FIFO_LEN);
+    ok &= sim_isolated(run, NULL);
+    ok &= sim_isolated(run, (void *)1);
+    return ok ? 0 : 1;
+}
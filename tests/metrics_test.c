@@ -0,0 +1,195 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Runs the master's traffic, then scrapes the metrics socket both bare and
+ * with an HTTP GET. Each counter checked must be in the scrape with its
+ * type and the value the library reports, and the traffic's own counts
+ * where the master knows them. Also checks that a regular file at the
+ * socket path is refused and left alone, that a socket left by an earlier
+ * run is replaced, and that stopping removes the socket. Run from the
+ * tests directory.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "pi2c_metrics.h"
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define SOCK_PATH "build/metrics_test.sock"
+#define FILE_TEXT "not a socket\n"
+
+static const struct sim_traffic traffic = {
+    .transactions = 100,
+    .min_read = 1,
+    .max_read = 20,
+    .byte_gap_us = 10,
+};
+
+static int connect_path()
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, SOCK_PATH);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+// Read one scrape into buf, sending request first if there is one
+static size_t scrape(const char * request, char * buf, size_t len)
+{
+    int fd = connect_path();
+    if (fd < 0) {
+        perror("connect");
+        return 0;
+    }
+    if (request && send(fd, request, strlen(request), 0) < 0) {
+        perror("send");
+    }
+    size_t used = 0;
+    ssize_t n;
+    while (used < len - 1 && (n = recv(fd, buf + used, len - 1 - used, 0)) > 0) {
+        used += n;
+    }
+    buf[used] = '\0';
+    close(fd);
+    return used;
+}
+
+// Check a metric's type line, unless type is NULL, and its value in the
+// scrape text
+static bool metric(const char * text, const char * name, const char * type, double want)
+{
+    char line[128];
+    bool typed = true;
+    if (type != NULL) {
+        snprintf(line, sizeof(line), "# TYPE pi2cslave_%s %s\n", name, type);
+        typed = strstr(text, line) != NULL;
+    }
+    snprintf(line, sizeof(line), "\npi2cslave_%s ", name);
+    const char * at = strstr(text, line);
+    double got = at ? strtod(at + strlen(line), NULL) : -1;
+    printf("  %-26s %12.0f, expected %12.0f%s\n", name, got, want, typed ? "" : ", no TYPE line");
+    return typed && at && got == want;
+}
+
+static bool check_scrape(const char * text, const struct sim_result * result)
+{
+    struct bsc_i2c_metrics m;
+    struct bsc_i2c_diag diag;
+    struct bsc_i2c_tx_stats tx;
+    bsc_i2c_get_metrics(&m);
+    bsc_i2c_get_diag(&diag);
+    bsc_i2c_get_tx_stats(&tx);
+    unsigned histogram = 0;
+    for (unsigned i = 0; i < BSC_TURNAROUND_BUCKETS; i++) {
+        histogram += m.turnaround[i];
+    }
+
+    bool ok = m.write_calls == traffic.transactions && m.master_reads == traffic.transactions &&
+              m.rx_bytes == 2 * traffic.transactions;
+    ok &= result->underruns != 0 || tx.bytes == result->bytes_read;
+    ok &= metric(text, "write_calls_total", "counter", m.write_calls);
+    ok &= metric(text, "master_reads_total", "counter", m.master_reads);
+    ok &= metric(text, "rx_bytes_total", "counter", m.rx_bytes);
+    ok &= metric(text, "tx_bytes_total", "counter", tx.bytes);
+    ok &= metric(text, "underruns_total", "counter", diag.underruns);
+    ok &= metric(text, "tx_wakeups_total", "counter", tx.wakeups);
+    ok &= metric(text, "turnaround_seconds_count", NULL, histogram);
+    ok &= strstr(text, "# TYPE pi2cslave_turnaround_seconds histogram\n") != NULL &&
+          strstr(text, "pi2cslave_turnaround_seconds_bucket{le=\"+Inf\"} ") != NULL;
+    return ok;
+}
+
+static bool refuses_file()
+{
+    FILE * f = fopen(SOCK_PATH, "w");
+    if (f == NULL) {
+        perror(SOCK_PATH);
+        return false;
+    }
+    fputs(FILE_TEXT, f);
+    fclose(f);
+    bool started = pi2c_metrics_start(SOCK_PATH);
+    if (started) {
+        pi2c_metrics_stop();
+    }
+    char text[sizeof(FILE_TEXT)] = "";
+    f = fopen(SOCK_PATH, "r");
+    if (f != NULL) {
+        fgets(text, sizeof(text), f);
+        fclose(f);
+    }
+    unlink(SOCK_PATH);
+    printf("  regular file at the path: %s, %s\n", started ? "started" : "refused",
+           strcmp(text, FILE_TEXT) == 0 ? "kept" : "lost");
+    return !started && strcmp(text, FILE_TEXT) == 0;
+}
+
+// Leave a socket at the path as a crashed run would
+static bool leave_stale_socket()
+{
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    strcpy(addr.sun_path, SOCK_PATH);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    bool ok = fd >= 0 && bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0;
+    if (fd >= 0) {
+        close(fd);
+    }
+    return ok;
+}
+
+int main()
+{
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return 1;
+    }
+    struct sim_result result;
+    sim_serve(&traffic, sim_echo_cb, &result);
+    printf("metrics, %u transactions, %u bytes read, %u underruns\n", result.reads, result.bytes_read,
+           result.underruns);
+    bool ok = result.reads == traffic.transactions && result.bad_bytes == 0;
+
+    unlink(SOCK_PATH);
+    ok &= refuses_file();
+    if (!leave_stale_socket() || !pi2c_metrics_start(SOCK_PATH)) {
+        fprintf(stderr, "FAIL: exporter didn't replace a stale socket\n");
+        return 1;
+    }
+
+    static char text[16384];
+    printf(" bare scrape\n");
+    ok &= scrape(NULL, text, sizeof(text)) > 0 && check_scrape(text, &result);
+
+    printf(" HTTP scrape\n");
+    size_t len = scrape("GET /metrics HTTP/1.0\r\n\r\n", text, sizeof(text));
+    const char * body = strstr(text, "\r\n\r\n");
+    const char * length = strstr(text, "Content-Length: ");
+    bool http = strncmp(text, "HTTP/1.0 200 OK\r\n", 17) == 0 && body && length &&
+                strtoul(length + 16, NULL, 10) == len - (body + 4 - text);
+    printf("  %s\n", http ? "200 OK, Content-Length matches" : "bad HTTP response");
+    ok &= http && check_scrape(body + 4, &result);
+
+    pi2c_metrics_stop();
+    struct stat st;
+    if (lstat(SOCK_PATH, &st) == 0) {
+        fprintf(stderr, "FAIL: socket left after stop\n");
+        ok = false;
+    }
+    if (!ok) {
+        fprintf(stderr, "FAIL: metrics endpoint\n");
+    }
+    shutdown_bsc_i2c_slv();
+    shutdown_bcm_reg_mem();
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Counts the barriers and register accesses per byte the bus moves, on a
+ * quiet GPIO and with threads changing GPIOs throughout the traffic, whose
+ * changes the service thread applies between FIFO bursts. Barriers come
+ * from every thread, so they are also given per GPIO change. Every byte
+ * the master reads must be right, and every pin must end in the mode its
+ * thread last asked for, with the BSC pins still in ALT3.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define GPIO_THREADS  (4)
+#define CHANGE_GAP_US (50) ///< Each thread's pause between GPIO changes
+
+static const uint8_t pins[GPIO_THREADS] = {4, 5, 17, 22};
+
+static const struct sim_traffic traffic = {
+    .transactions = 1000,
+    .min_read = 1,
+    .max_read = 20,
+    .byte_gap_us = 20,
+};
+
+static atomic_bool traffic_done;
+static atomic_uint gpio_changes;
+static atomic_uint gpio_failures;
+
+static enum gpio_state final_state(uint8_t pin)
+{
+    return (pin & 1) ? GPIO_STATE_LOW : GPIO_STATE_FLOAT;
+}
+
+static void * toggler(void * arg)
+{
+    uint8_t pin = (uint8_t)(uintptr_t)arg;
+    for (unsigned i = 0; !atomic_load(&traffic_done); i++) {
+        enum gpio_state state = (i & 1) ? GPIO_STATE_FLOAT : GPIO_STATE_HIGH;
+        if (i % 3 == 0) {
+            while (!bcm_queue_gpio_out(pin, state)) {
+            }
+        } else if (!bcm_set_gpio_out(pin, state)) {
+            atomic_fetch_add(&gpio_failures, 1);
+        }
+        atomic_fetch_add(&gpio_changes, 1);
+        usleep(CHANGE_GAP_US);
+    }
+    if (!bcm_set_gpio_out(pin, final_state(pin))) {
+        atomic_fetch_add(&gpio_failures, 1);
+    }
+    return NULL;
+}
+
+static unsigned fsel(volatile uint32_t * gpio, unsigned pin)
+{
+    return (gpio[pin / GPIO_FUN_PER_REG] >> ((pin % GPIO_FUN_PER_REG) * GPIO_FUN_SHIFT)) & GPIO_FUN_MASK;
+}
+
+static unsigned bad_pins(unsigned threads)
+{
+    volatile uint32_t * bsc;
+    volatile uint32_t * gpio;
+    volatile uint32_t * dma;
+    pi2c_sim_map(&bsc, &gpio, &dma);
+    unsigned bad = 0;
+    for (unsigned i = 0; i < threads; i++) {
+        unsigned want = final_state(pins[i]) == GPIO_STATE_LOW ? GPIO_FUN_OUT : GPIO_FUN_IN;
+        bad += fsel(gpio, pins[i]) != want;
+    }
+    for (unsigned pin = 18; pin <= 19; pin++) {
+        bad += fsel(gpio, pin) != GPIO_FUN_ALT3;
+    }
+    return bad;
+}
+
+static bool run(void * arg)
+{
+    unsigned threads = arg != NULL ? GPIO_THREADS : 0;
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return false;
+    }
+    pthread_t thread[GPIO_THREADS];
+    for (unsigned i = 0; i < threads; i++) {
+        pthread_create(&thread[i], NULL, toggler, (void *)(uintptr_t)pins[i]);
+    }
+
+    struct pi2c_sim_access_stats before;
+    struct pi2c_sim_access_stats after;
+    struct sim_result result;
+    pi2c_sim_get_access_stats(&before);
+    sim_serve(&traffic, sim_echo_cb, &result);
+    pi2c_sim_get_access_stats(&after);
+    atomic_store(&traffic_done, true);
+    for (unsigned i = 0; i < threads; i++) {
+        pthread_join(thread[i], NULL);
+    }
+    bcm_gpio_sync();
+
+    // Two address bytes written per read, plus the bytes read
+    double bytes = result.bytes_read + 2.0 * traffic.transactions;
+    unsigned changes = atomic_load(&gpio_changes);
+    unsigned bad = bad_pins(threads) + atomic_load(&gpio_failures);
+    printf("  %u GPIO threads: %5.3f barriers, %6.1f register accesses per byte", threads,
+           (after.barriers - before.barriers) / bytes,
+           (after.reads + after.writes - before.reads - before.writes) / bytes);
+    if (changes) {
+        printf(", %4.2f barriers per GPIO change", (after.barriers - before.barriers) / (double)changes);
+    }
+    printf("\n  %u reads, %u bad bytes, %u GPIO changes, %u bad pins or failed changes\n",
+           result.reads, result.bad_bytes, changes, bad);
+    shutdown_bsc_i2c_slv();
+    shutdown_bcm_reg_mem();
+    return result.reads == traffic.transactions && result.bad_bytes == 0 && bad == 0;
+}
+
+int main()
+{
+    bool ok = true;
+    printf("MMIO barriers, %u transactions\n", traffic.transactions);
+    ok &= sim_isolated(run, NULL);
+    ok &= sim_isolated(run, (void *)1);
+    return ok ? 0 : 1;
+}
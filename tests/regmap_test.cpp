@@ -0,0 +1,202 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Instantiates pi2cslave_regmap.hpp maps of each address width and byte
+ * order and checks their reads and writes: reset values, access modes,
+ * unmapped gaps, and the window edges, the last byte in it and the first
+ * past it on either side. A 32 bit map also gets an address that would
+ * alias into the window if narrowed to 16 bits. Then serve() answers the
+ * master through the simulator, for a read running off the end of the
+ * window and for one outside it.
+ */
+#include <cstdio>
+#include <thread>
+#include <unistd.h>
+
+#include "pi2cslave_regmap.hpp"
+extern "C" {
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+}
+
+#define MASTER_WAIT_US (2000) ///< Master's pause before reading, so serve() is waiting
+
+using pi2c::Access;
+using pi2c::Endian;
+using pi2c::Reg;
+using pi2c::RegMap;
+
+static constexpr std::array<Reg<uint16_t>, 4> map16 = {{
+    {0x0100, 2, 0x1234, Access::RO},     // ID
+    {0x0102, 1, 0x00, Access::RW},       // CTRL
+    {0x0110, 4, 0xA1B2C3D4, Access::RW}, // after an unmapped gap
+    {0x0114, 2, 0xBEEF, Access::WO},
+}};
+static constexpr std::array<Reg<uint8_t>, 2> map8 = {{
+    {0x20, 2, 0x1234, Access::RW},
+    {0x22, 1, 0x56, Access::RO},
+}};
+static constexpr std::array<Reg<uint32_t>, 2> map32 = {{
+    {0x10000000, 4, 0x11223344, Access::RW},
+    {0x10000004, 2, 0x5566, Access::RO},
+}};
+
+using Map16 = RegMap<uint16_t, Endian::Big, map16>;
+using Map8 = RegMap<uint8_t, Endian::Little, map8>;
+using Map32 = RegMap<uint32_t, Endian::Big, map32>;
+
+static_assert(Map16::Base == 0x0100 && Map16::Span == 0x16, "16 bit window");
+static_assert(Map8::Base == 0x20 && Map8::Span == 3, "8 bit window");
+static_assert(Map32::Base == 0x10000000 && Map32::Span == 6, "32 bit window");
+
+static unsigned failed = 0;
+
+static void expect(bool ok, const char * what)
+{
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s\n", what);
+        failed++;
+    }
+}
+
+// Whether read_byte() at addr gives in and, if in, the byte want
+template <typename Map, typename Addr>
+static bool reads(const Map & map, Addr addr, bool in, uint8_t want)
+{
+    uint8_t byte = 0xFF;
+    bool got = map.read_byte(addr, &byte);
+    return got == in && (!in || byte == want);
+}
+
+static void check_map16()
+{
+    Map16 map;
+    expect(reads(map, 0x0100, true, 0x12) && reads(map, 0x0101, true, 0x34), "16 bit reset value, big endian");
+    expect(map.get<0x0110>() == 0xA1B2C3D4, "16 bit get()");
+    expect(reads(map, 0x0103, true, 0x00) && reads(map, 0x010F, true, 0x00), "unmapped gap reads as 0");
+    expect(reads(map, 0x0114, true, 0x00), "write only register reads as 0");
+    expect(reads(map, 0x0115, true, 0x00), "last byte in the window");
+    expect(reads(map, 0x0116, false, 0), "first byte past the window");
+    expect(reads(map, 0x00FF, false, 0), "byte before the window");
+
+    // Address, then CTRL, then a byte in the gap, which is dropped.
+    const uint8_t ctrl[] = {0x01, 0x02, 0x5A, 0x77};
+    uint16_t addr = 0;
+    expect(map.handle_write(ctrl, sizeof(ctrl), addr) && addr == 0x0102, "address decode");
+    expect(map.get<0x0102>() == 0x5A && reads(map, 0x0103, true, 0x00), "write to CTRL only");
+    const uint8_t id[] = {0x01, 0x00, 0xFF, 0xFF};
+    expect(map.handle_write(id, sizeof(id), addr) && map.get<0x0100>() == 0x1234, "read only register kept");
+    // The last two bytes of the write land past the window.
+    const uint8_t edge[] = {0x01, 0x14, 0xCA, 0xFE, 0x01, 0x02};
+    expect(map.handle_write(edge, sizeof(edge), addr) && map.get<0x0114>() == 0xCAFE,
+           "write up to the end of the window");
+    expect(reads(map, 0x0114, true, 0x00), "write only register still reads as 0");
+    // Starts a byte before the window, crosses ID and ends in CTRL.
+    const uint8_t before[] = {0x00, 0xFF, 0x11, 0x22, 0x33, 0x66};
+    expect(map.handle_write(before, sizeof(before), addr) && map.get<0x0100>() == 0x1234 &&
+           map.get<0x0102>() == 0x66, "write starting before the window");
+    const uint8_t short_req[] = {0x01};
+    expect(!map.handle_write(short_req, sizeof(short_req), addr), "write without a whole address");
+
+    map.set<0x0100>(0xABCD);
+    expect(reads(map, 0x0100, true, 0xAB) && reads(map, 0x0101, true, 0xCD), "set() a read only register");
+    map.reset();
+    expect(map.get<0x0100>() == 0x1234 && map.get<0x0102>() == 0 && map.get<0x0114>() == 0xBEEF, "reset()");
+}
+
+static void check_map8()
+{
+    Map8 map;
+    expect(reads(map, 0x20, true, 0x34) && reads(map, 0x21, true, 0x12), "8 bit reset value, little endian");
+    expect(reads(map, 0x22, true, 0x56) && reads(map, 0x23, false, 0), "8 bit window end");
+    expect(reads(map, 0x1F, false, 0), "8 bit byte before the window");
+    const uint8_t req[] = {0x21, 0x99, 0x42};
+    uint8_t addr = 0;
+    expect(map.handle_write(req, sizeof(req), addr) && addr == 0x21, "8 bit address decode");
+    expect(map.get<0x20>() == 0x9934 && map.get<0x22>() == 0x56, "8 bit write stops at the read only byte");
+}
+
+static void check_map32()
+{
+    Map32 map;
+    expect(reads(map, 0x10000000u, true, 0x11) && reads(map, 0x10000005u, true, 0x66), "32 bit window");
+    expect(reads(map, 0x10000006u, false, 0) && reads(map, 0x0FFFFFFFu, false, 0), "32 bit window edges");
+    expect(reads(map, 0x10020005u, false, 0), "32 bit address aliasing into the window");
+    const uint8_t req[] = {0x10, 0x00, 0x00, 0x02, 0xAA, 0xBB, 0xCC};
+    uint32_t addr = 0;
+    expect(map.handle_write(req, sizeof(req), addr) && addr == 0x10000002, "32 bit address decode");
+    expect(map.get<0x10000000>() == 0x1122AABB && map.get<0x10000004>() == 0x5566, "32 bit write");
+}
+
+// Master read of len bytes, then a write to end the slave's serve()
+static void master_read(unsigned len, uint8_t * out, unsigned * underrun_at)
+{
+    usleep(MASTER_WAIT_US);
+    *underrun_at = len;
+    pi2c_sim_master_start(SIM_SLAVE_ADDR >> 1, true);
+    for (unsigned i = 0; i < len; i++) {
+        bool underrun;
+        out[i] = pi2c_sim_master_read_byte(&underrun);
+        if (underrun && *underrun_at == len) {
+            *underrun_at = i;
+        }
+    }
+    pi2c_sim_master_stop();
+    pi2c_sim_master_start(SIM_SLAVE_ADDR >> 1, false);
+    pi2c_sim_master_write_byte(0);
+    pi2c_sim_master_stop();
+}
+
+// serve() addr while the master reads len bytes. Returns where the first
+// underrun was, len for none.
+template <typename Map, typename Addr>
+static unsigned serve(Map & map, Addr addr, unsigned len, uint8_t * out, int * sent)
+{
+    unsigned underrun_at;
+    std::thread master(master_read, len, out, &underrun_at);
+    *sent = map.serve(addr);
+    master.join();
+    uint8_t rx[8];
+    bsc_i2c_read_poll(rx, sizeof(rx));
+    return underrun_at;
+}
+
+static void check_serve()
+{
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        failed++;
+        return;
+    }
+    Map16 map16_dev;
+    uint8_t got[4];
+    int sent;
+    unsigned underrun_at = serve(map16_dev, (uint16_t)0x0112, 4, got, &sent);
+    printf("  16 bit map, read from 0x0112: underrun at byte %u, %d sent\n", underrun_at, sent);
+    expect(underrun_at == 4 && got[0] == 0xC3 && got[1] == 0xD4 && got[2] == 0 && got[3] == 0,
+           "serve() up to the end of the window");
+
+    underrun_at = serve(map16_dev, (uint16_t)0x0114, 4, got, &sent);
+    printf("  16 bit map, read from 0x0114: underrun at byte %u, %d sent\n", underrun_at, sent);
+    expect(underrun_at == 2 && got[0] == 0 && got[1] == 0, "serve() running off the end of the window");
+
+    Map32 map32_dev;
+    underrun_at = serve(map32_dev, (uint32_t)0x10020004, 2, got, &sent);
+    printf("  32 bit map, read from 0x10020004: underrun at byte %u, %d sent\n", underrun_at, sent);
+    expect(underrun_at == 0 && sent == 0, "serve() outside a 32 bit window");
+
+    shutdown_bsc_i2c_slv();
+    shutdown_bcm_reg_mem();
+}
+
+int main()
+{
+    printf("register maps\n");
+    check_map16();
+    check_map8();
+    check_map32();
+    check_serve();
+    printf("  %u failed checks\n", failed);
+    return failed ? 1 : 0;
+}
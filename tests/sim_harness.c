@@ -0,0 +1,177 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define TURNAROUND_US (200) ///< Master's default pause between its write and its read
+#define RETRY_US      (300) ///< Master's pause after a failed transaction
+
+struct master_args {
+    const struct sim_traffic * traffic;
+    struct sim_result * result;
+};
+
+// The callback being served, and when the master's last address write
+// ended, 0 once the slave's first callback call for it has been timed.
+static tx_callback served_cb;
+static struct sim_result * timed_result;
+static _Atomic uint16_t sent_addr;
+static _Atomic uint64_t sent_ns;
+
+uint64_t sim_clock_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Times the first call for the address the master just wrote. Calls still
+// serving the previous read are not counted.
+static bool timed_cb(addr_t addr, uint8_t * out)
+{
+    uint64_t sent = atomic_load_explicit(&sent_ns, memory_order_acquire);
+    if (sent && addr == atomic_load_explicit(&sent_addr, memory_order_relaxed)) {
+        uint64_t latency = sim_clock_ns(CLOCK_MONOTONIC) - sent;
+        atomic_store_explicit(&sent_ns, 0, memory_order_relaxed);
+        timed_result->latencies++;
+        timed_result->latency_sum_ns += latency;
+        if (latency > timed_result->latency_max_ns) {
+            timed_result->latency_max_ns = latency;
+        }
+    }
+    return served_cb(addr, out);
+}
+
+bool sim_echo_cb(addr_t addr, uint8_t * out)
+{
+    *out = (uint8_t)addr;
+    return true;
+}
+
+static unsigned read_len(const struct sim_traffic * traffic, unsigned t)
+{
+    return traffic->min_read + t % (traffic->max_read - traffic->min_read + 1);
+}
+
+static void * master(void * arg)
+{
+    const struct sim_traffic * traffic = ((struct master_args *)arg)->traffic;
+    struct sim_result * result = ((struct master_args *)arg)->result;
+
+    for (unsigned t = 0; t < traffic->transactions; t++) {
+        uint16_t addr = t * 3;
+        usleep(traffic->hold_us);
+        if (!pi2c_sim_master_start(SIM_SLAVE_ADDR >> 1, false)) {
+            usleep(RETRY_US);
+            continue;
+        }
+        bool sent = pi2c_sim_master_write_byte(addr >> 8);
+        usleep(traffic->byte_gap_us);
+        sent = sent && pi2c_sim_master_write_byte(addr & 0xFF);
+        pi2c_sim_master_stop();
+        if (sent) {
+            atomic_store_explicit(&sent_addr, addr, memory_order_relaxed);
+            atomic_store_explicit(&sent_ns, sim_clock_ns(CLOCK_MONOTONIC), memory_order_release);
+        } else {
+            usleep(RETRY_US);
+            continue;
+        }
+
+        usleep(traffic->turnaround_us ? traffic->turnaround_us : TURNAROUND_US);
+        if (!pi2c_sim_master_start(SIM_SLAVE_ADDR >> 1, true)) {
+            usleep(RETRY_US);
+            continue;
+        }
+        result->reads++;
+        // After an underrun, the slave's bytes come a byte late.
+        bool late = false;
+        unsigned len = read_len(traffic, t);
+        for (unsigned i = 0; i < len; i++) {
+            bool underrun;
+            uint8_t byte = pi2c_sim_master_read_byte(&underrun);
+            result->bytes_read++;
+            late = late || underrun;
+            if (late) {
+                result->underruns++;
+            } else if (byte != (uint8_t)(addr + i)) {
+                result->bad_bytes++;
+            }
+            usleep(traffic->byte_gap_us);
+        }
+        pi2c_sim_master_stop();
+        usleep(traffic->byte_gap_us);
+    }
+    bsc_i2c_request_stop();
+    return NULL;
+}
+
+void sim_serve(const struct sim_traffic * traffic, tx_callback cb, struct sim_result * result)
+{
+    struct master_args args = {traffic, result};
+    *result = (struct sim_result){0};
+    served_cb = cb;
+    timed_result = result;
+    atomic_store(&sent_ns, 0);
+    if (cb != NULL) {
+        cb = timed_cb;
+    }
+    bsc_i2c_clear_stop();
+    uint64_t wall = sim_clock_ns(CLOCK_MONOTONIC);
+    uint64_t cpu = sim_clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    pthread_t thread;
+    pthread_create(&thread, NULL, master, &args);
+
+    while (!bsc_i2c_stop_requested()) {
+        uint8_t buf[2];
+        int got = 0;
+        if (traffic->framed) {
+            while (!bsc_i2c_stop_requested() && (got = bsc_i2c_read_transaction(buf, sizeof(buf))) == 0) {
+                bsc_i2c_idle_wait();
+            }
+        } else {
+            while (got < 2 && !bsc_i2c_stop_requested()) {
+                int more = bsc_i2c_read_poll(buf + got, 2 - got);
+                if (more == 0) {
+                    bsc_i2c_idle_wait();
+                }
+                got += more;
+            }
+        }
+        if (got == 2) {
+            bsc_i2c_write(cb, buf[0] << 8 | buf[1]);
+        }
+    }
+    result->slave_cpu_ns = sim_clock_ns(CLOCK_THREAD_CPUTIME_ID) - cpu;
+    result->wall_ns = sim_clock_ns(CLOCK_MONOTONIC) - wall;
+    pthread_join(thread, NULL);
+}
+
+bool sim_isolated(bool (*fn)(void *), void * arg)
+{
+    fflush(stdout);
+    fflush(stderr);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return false;
+    }
+    if (pid == 0) {
+        bool ok = fn(arg);
+        fflush(stdout);
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        return false;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
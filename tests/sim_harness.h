@@ -0,0 +1,87 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/**
+ * @file sim_harness.h
+ * @brief Master traffic and a slave service loop for the simulator tests
+ *
+ * The simulated master writes a two byte big endian address, then reads
+ * bytes back from it. The slave reads the address and serves the read with
+ * bsc_i2c_write(). A tx_callback returning the low byte of its address,
+ * like sim_echo_cb(), lets the master check every byte it reads.
+ */
+#ifndef __SIM_HARNESS_H__
+#define __SIM_HARNESS_H__
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "pi2cslave.h"
+
+#define SIM_SLAVE_ADDR (0x54) ///< Address the slave is set up with, as init_bsc_i2c_slv() takes it
+
+/**
+ * @brief Shape of the master's traffic
+ */
+struct sim_traffic {
+    unsigned transactions;  ///< Write then read pairs the master runs
+    unsigned min_read;      ///< Bytes read by the first transaction
+    unsigned max_read;      ///< Reads grow by a byte per transaction up to this, then wrap
+    unsigned byte_gap_us;   ///< Master's pause after each byte
+    unsigned hold_us;       ///< Master's silence before each transaction
+    unsigned turnaround_us; ///< Master's pause between its write and its read, 0 for 200 us
+    bool framed;            ///< Slave reads addresses with bsc_i2c_read_transaction()
+};
+
+/**
+ * @brief What the master saw
+ */
+struct sim_result {
+    unsigned reads;          ///< Master reads the slave ACKed
+    unsigned bytes_read;     ///< Bytes clocked in by the master
+    unsigned underruns;      ///< Bytes from an empty TX FIFO, and those after it in the same read
+    unsigned bad_bytes;      ///< Other bytes than the low byte of their address
+    unsigned latencies;      ///< Transactions whose latency was timed
+    uint64_t latency_sum_ns; ///< Sum of the times from the master's address write to the first tx_callback call
+    uint64_t latency_max_ns; ///< Longest of those times
+    uint64_t slave_cpu_ns;   ///< CPU time of the thread serving the slave
+    uint64_t wall_ns;        ///< Time the traffic took
+};
+
+/**
+ * @brief tx_callback sending the low byte of each address
+ */
+bool sim_echo_cb(addr_t addr, uint8_t * out);
+
+/**
+ * @brief Run the master's traffic against the slave
+ *
+ * The master runs in its own thread and the slave in the calling one.
+ * The peripherals and the slave must already be set up. The master calls
+ * bsc_i2c_request_stop() when it is done, and the next call clears it.
+ * cb may be NULL in DMA mode, in which case latencies aren't timed.
+ *
+ * @param traffic What the master does
+ * @param cb Serves the master's reads
+ * @param result Filled in with what the master saw
+ */
+void sim_serve(const struct sim_traffic * traffic, tx_callback cb, struct sim_result * result);
+
+/**
+ * @brief Run a function in a child process
+ *
+ * Library state such as the tuning and the interrupt setup can't all be
+ * undone, so each configuration a bench compares runs in its own child.
+ *
+ * @return true if the child exited with status 0
+ */
+bool sim_isolated(bool (*fn)(void *), void * arg);
+
+/**
+ * @brief Read a clock in nanoseconds
+ */
+uint64_t sim_clock_ns(clockid_t clock);
+
+#endif // ! __SIM_HARNESS_H__
@@ -0,0 +1,52 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Runs bcm_detect_soc() on the fake device trees in fixtures/dt. Their
+ * soc/ranges have the one cell parent addresses of the BCM2835 and BCM2837
+ * and the two cell ones of the BCM2711. Also checks the guess from the
+ * peripheral base when compatible is missing or names no known SoC, and the
+ * failure without soc/ranges. Run from the tests directory.
+ */
+#include <stdio.h>
+#include <string.h>
+
+#include "pi2cslave.h"
+
+#define FIXTURES "fixtures/dt/"
+
+static const struct {
+    const char * dir;
+    bool ok;
+    enum bcm_soc soc;
+    const char * name;
+    uint32_t io_base;
+} cases[] = {
+    {"pi1", true, BCM_SOC_2835, "bcm2835", BCM2835_IO_BASE},
+    {"pi3", true, BCM_SOC_2837, "bcm2837", BCM2837_IO_BASE},
+    {"pi4", true, BCM_SOC_2711, "bcm2711", BCM2711_IO_BASE},
+    {"pi3-no-compat", true, BCM_SOC_2837, "bcm2837", BCM2837_IO_BASE},
+    {"unknown", true, BCM_SOC_UNKNOWN, "unknown", 0x12000000},
+    {"no-ranges", false, BCM_SOC_UNKNOWN, NULL, 0},
+};
+
+int main()
+{
+    unsigned failed = 0;
+    for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+        char dir[64];
+        snprintf(dir, sizeof(dir), FIXTURES "%s", cases[i].dir);
+        struct bcm_soc_info info = {BCM_SOC_UNKNOWN, NULL, 0};
+        bool ok = bcm_detect_soc(dir, &info);
+        printf("  %-14s %s %-8s 0x%08x\n", cases[i].dir, ok ? "found" : "failed",
+               info.name ? info.name : "-", info.io_base);
+        if (ok != cases[i].ok ||
+            (ok && (info.soc != cases[i].soc || strcmp(info.name, cases[i].name) != 0 || info.io_base != cases[i].io_base))) {
+            fprintf(stderr, "FAIL: %s: expected %s 0x%08x\n", cases[i].dir,
+                    cases[i].ok ? cases[i].name : "no SoC", cases[i].io_base);
+            failed++;
+        }
+    }
+    return failed ? 1 : 0;
+}
@@ -0,0 +1,91 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Compares the cost of the stop flag check bsc_i2c_read_poll() and
+ * bsc_i2c_write() make once per burst with that of the pthread_testcancel()
+ * they used to make per byte. Then stops bsc_i2c_write() while it keeps
+ * the TX FIFO full for a master that isn't reading, and reports how long it
+ * takes to return. The TX FIFO must be empty every time it does.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define CHECKS (10000000)
+#define STOPS  (100)
+#define STOP_AFTER_US (2000)
+
+static volatile uint64_t stop_ns;
+static volatile unsigned stops_seen; ///< Keeps the flag checks from being optimized out
+
+static void * stopper(void * arg)
+{
+    (void)arg;
+    usleep(STOP_AFTER_US);
+    stop_ns = sim_clock_ns(CLOCK_MONOTONIC);
+    bsc_i2c_request_stop();
+    return NULL;
+}
+
+static void check_costs()
+{
+    uint64_t start = sim_clock_ns(CLOCK_MONOTONIC);
+    for (unsigned i = 0; i < CHECKS; i++) {
+        pthread_testcancel();
+    }
+    uint64_t testcancel = sim_clock_ns(CLOCK_MONOTONIC) - start;
+
+    unsigned stops = 0;
+    start = sim_clock_ns(CLOCK_MONOTONIC);
+    for (unsigned i = 0; i < CHECKS; i++) {
+        stops += bsc_i2c_stop_requested();
+    }
+    uint64_t flag = sim_clock_ns(CLOCK_MONOTONIC) - start;
+    stops_seen = stops;
+    printf("  pthread_testcancel() %5.2f ns, stop flag %5.2f ns per check\n",
+           (double)testcancel / CHECKS, (double)flag / CHECKS);
+}
+
+static bool stop_writes()
+{
+    volatile uint32_t * bsc;
+    volatile uint32_t * gpio;
+    volatile uint32_t * dma;
+    pi2c_sim_map(&bsc, &gpio, &dma);
+
+    uint64_t sum = 0;
+    uint64_t max = 0;
+    unsigned not_flushed = 0;
+    for (unsigned i = 0; i < STOPS; i++) {
+        bsc_i2c_clear_stop();
+        pthread_t thread;
+        pthread_create(&thread, NULL, stopper, NULL);
+        bsc_i2c_write(sim_echo_cb, i);
+        uint64_t latency = sim_clock_ns(CLOCK_MONOTONIC) - stop_ns;
+        pthread_join(thread, NULL);
+        not_flushed += !(pi2c_sim_read(&bsc[BSC_FR]) & FR_TXFE);
+        sum += latency;
+        max = latency > max ? latency : max;
+    }
+    printf("  stop to return avg %llu us max %llu us, TX FIFO left filled %u of %u times\n",
+           (unsigned long long)(sum / STOPS / 1000), (unsigned long long)(max / 1000), not_flushed, STOPS);
+    return not_flushed == 0;
+}
+
+int main()
+{
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return 1;
+    }
+    printf("stop token\n");
+    check_costs();
+    bool ok = stop_writes();
+    shutdown_bsc_i2c_slv();
+    shutdown_bcm_reg_mem();
+    return ok ? 0 : 1;
+}
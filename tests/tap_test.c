@@ -0,0 +1,170 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Follows the tap with two subscribers while the master runs its traffic.
+ * The fast one must see every master write and read in order, with the
+ * address written, the bytes read, the byte counts and truncation flags
+ * matching the traffic, and no overrun. The slow one sleeps while holding
+ * each record, so the service thread laps it. Every record it releases
+ * must still be whole, and it must count an overrun exactly when it skips
+ * records.
+ */
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define TAP_LEN      (1024) ///< Ring bytes, room for about 25 records
+#define RECORD_MAX   (16)
+#define SLOW_HOLD_US (5000) ///< Slow subscriber's sleep while holding a record
+#define POLL_US      (50)
+
+// Addresses stay below 256, so a read's first byte tells which it was.
+static const struct sim_traffic traffic = {
+    .transactions = 80,
+    .min_read = 1,
+    .max_read = 40,
+    .byte_gap_us = 20,
+};
+
+struct subscriber {
+    struct bsc_i2c_tap tap;
+    unsigned hold_us;       ///< Sleep while holding each record
+    unsigned records;       ///< Records released
+    unsigned gaps;          ///< Jumps in the sequence of released records
+    unsigned unflagged;     ///< Gaps without an overrun counted, or overruns without a gap
+    unsigned bad;           ///< Released records whose length, flags or times disagree
+    unsigned torn;          ///< Released records not from the traffic
+    unsigned tx_miscounted; ///< Read records whose count is not what the master read
+};
+
+static atomic_bool traffic_done;
+
+static unsigned read_len(unsigned t)
+{
+    return traffic.min_read + t % (traffic.max_read - traffic.min_read + 1);
+}
+
+// Position of a record in the traffic, 2t for the write of transaction t
+// and 2t + 1 for its read, or -1 if it can't be a record of the traffic.
+static int sequence(const struct bsc_i2c_tap_record * rec, const uint8_t * data)
+{
+    if (rec->dir == BSC_TAP_RX) {
+        unsigned addr = rec->len == 2 ? data[0] << 8 | data[1] : 1;
+        return addr % 3 == 0 && addr / 3 < traffic.transactions ? (int)(addr / 3 * 2) : -1;
+    }
+    if (rec->len == 0 || data[0] % 3 != 0) {
+        return -1;
+    }
+    for (unsigned i = 1; i < rec->len; i++) {
+        if (data[i] != (uint8_t)(data[0] + i)) {
+            return -1;
+        }
+    }
+    return data[0] / 3 * 2 + 1;
+}
+
+// Whether the record's length, flags and times agree with its count
+static bool consistent(const struct bsc_i2c_tap_record * rec)
+{
+    bool truncated = rec->count > RECORD_MAX;
+    return rec->len == (truncated ? RECORD_MAX : rec->count) &&
+           !(rec->flags & BSC_TAP_TRUNCATED) == !truncated && rec->start_ns <= rec->end_ns;
+}
+
+static void * follow(void * arg)
+{
+    struct subscriber * sub = arg;
+    struct bsc_i2c_tap * tap = &sub->tap;
+    int last = -1;
+    uint32_t overruns = 0;
+    for (;;) {
+        bool done = atomic_load(&traffic_done);
+        struct bsc_i2c_tap_record rec;
+        const uint8_t * data;
+        if (!bsc_i2c_tap_peek(tap, &rec, &data)) {
+            if (done) {
+                break;
+            }
+            usleep(POLL_US);
+            continue;
+        }
+        usleep(sub->hold_us);
+        // Read the data after the sleep, while the writer may be lapping us.
+        int seq = sequence(&rec, data);
+        bool ok = consistent(&rec);
+        if (!bsc_i2c_tap_release(tap)) {
+            continue;
+        }
+        sub->records++;
+        if (seq < 0) {
+            sub->torn++;
+            continue;
+        }
+        sub->bad += !ok;
+        // An underrun shifts what the slave counts as sent.
+        sub->tx_miscounted += rec.dir == BSC_TAP_TX && rec.count != read_len(seq / 2);
+        bool gap = seq != last + 1;
+        sub->gaps += gap;
+        sub->unflagged += gap != (tap->overruns != overruns);
+        overruns = tap->overruns;
+        last = seq;
+    }
+    return NULL;
+}
+
+static bool check(const char * name, const struct subscriber * sub, bool lapped)
+{
+    printf("  %-4s %3u records, %2u gaps, %2u overruns, %u gaps and overruns apart, %u bad, %u torn, %u miscounted reads\n",
+           name, sub->records, sub->gaps, sub->tap.overruns, sub->unflagged, sub->bad, sub->torn, sub->tx_miscounted);
+    bool ok = sub->unflagged == 0 && sub->bad == 0 && sub->torn == 0;
+    if (lapped) {
+        ok &= sub->tap.overruns > 0;
+    } else {
+        ok &= sub->records == 2 * traffic.transactions && sub->tap.overruns == 0;
+    }
+    if (!ok) {
+        fprintf(stderr, "FAIL: %s subscriber\n", name);
+    }
+    return ok;
+}
+
+int main()
+{
+    struct bsc_i2c_config cfg = {.tap_len = TAP_LEN, .tap_record_max = RECORD_MAX};
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_arena(&cfg) || !init_bsc_i2c_slv(SIM_SLAVE_ADDR) ||
+        !bsc_i2c_enable_tap()) {
+        return 1;
+    }
+    struct subscriber fast = {0};
+    struct subscriber slow = {.hold_us = SLOW_HOLD_US};
+    bsc_i2c_tap_subscribe(&fast.tap);
+    bsc_i2c_tap_subscribe(&slow.tap);
+    pthread_t threads[2];
+    pthread_create(&threads[0], NULL, follow, &fast);
+    pthread_create(&threads[1], NULL, follow, &slow);
+
+    struct sim_result result;
+    sim_serve(&traffic, sim_echo_cb, &result);
+    bsc_i2c_disable_tap();
+    atomic_store(&traffic_done, true);
+    pthread_join(threads[0], NULL);
+    pthread_join(threads[1], NULL);
+
+    printf("tap, %u transactions, %u underruns\n", result.reads, result.underruns);
+    bool ok = result.reads == traffic.transactions && result.bad_bytes == 0;
+    ok &= check("fast", &fast, false);
+    ok &= check("slow", &slow, true);
+    if (result.underruns == 0 && fast.tx_miscounted != 0) {
+        fprintf(stderr, "FAIL: read byte counts differ from the master's without underruns\n");
+        ok = false;
+    }
+    shutdown_bsc_i2c_slv();
+    shutdown_bcm_reg_mem();
+    return ok ? 0 : 1;
+}
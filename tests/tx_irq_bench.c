@@ -0,0 +1,63 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Counts how often bsc_i2c_write() wakes up in the simulator. Masters read
+ * 1 to 20 bytes, a byte every 90 us, while it polls the TX FIFO or waits
+ * for its interrupt at two IFLS levels. Reports bsc_i2c_get_tx_stats()
+ * wakeups per byte sent.
+ */
+#include <stdio.h>
+
+#include "sim_harness.h"
+
+#define TX_LEVEL_NONE (-1) ///< Poll the TX FIFO instead of using its interrupt
+
+struct tx_config {
+    const char * name;
+    int tx_level;
+};
+
+static const struct tx_config tx_configs[] = {
+    {"polling", TX_LEVEL_NONE},
+    {"IFLS_1_8", IFLS_1_8},
+    {"IFLS_3_4", IFLS_3_4},
+};
+
+static const struct sim_traffic traffic = {
+    .transactions = 200,
+    .min_read = 1,
+    .max_read = 20,
+    .byte_gap_us = 90,
+};
+
+static bool run(void * arg)
+{
+    const struct tx_config * cfg = arg;
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return false;
+    }
+    if (cfg->tx_level != TX_LEVEL_NONE && !bsc_i2c_enable_tx_irq(NULL, cfg->tx_level)) {
+        return false;
+    }
+    struct sim_result result;
+    sim_serve(&traffic, sim_echo_cb, &result);
+
+    struct bsc_i2c_tx_stats stats;
+    bsc_i2c_get_tx_stats(&stats);
+    printf("  %-9s %5u wakeups %5u interrupts %5u bytes: %.2f wakeups per byte, %u underruns, %u bad bytes\n",
+           cfg->name, stats.wakeups, stats.interrupts, stats.bytes,
+           stats.bytes ? (double)stats.wakeups / stats.bytes : 0.0, result.underruns, result.bad_bytes);
+    return true;
+}
+
+int main()
+{
+    bool ok = true;
+    printf("bsc_i2c_write(), reads of 1 to 20 bytes\n");
+    for (unsigned i = 0; i < sizeof(tx_configs) / sizeof(tx_configs[0]); i++) {
+        ok &= sim_isolated(run, (void *)&tx_configs[i]);
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,131 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Checks bsc_i2c_read_transaction() against random RX overruns: writes
+ * that lost a byte must be dropped rather than returned short. Writes the
+ * library saw no end between come back, or are dropped, as one, which is
+ * allowed. So every other write must come back whole, exactly once.
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define WRITES      (5000)
+#define WRITE_LEN   (12)
+#define OVERRUN_PPM (100)
+#define FAULT_SEED  (7)
+#define SETTLE_US   (1000) ///< Time the slave gets to collect the last write
+
+static bool hit[WRITES];  ///< Writes that lost a byte to an overrun
+static bool seen[WRITES]; ///< Writes the slave got back
+
+// Each write starts with its number, followed by bytes counting up from it.
+static uint8_t write_byte(unsigned t, unsigned i)
+{
+    return i == 0 ? t >> 8 : i == 1 ? t & 0xFF : (uint8_t)(t * 13 + i);
+}
+
+// Mark the writes in buf seen. Returns false if any is broken.
+static bool check_writes(const uint8_t * buf, int len)
+{
+    if (len % WRITE_LEN != 0) {
+        return false;
+    }
+    for (int start = 0; start < len; start += WRITE_LEN) {
+        unsigned t = buf[start] << 8 | buf[start + 1];
+        if (t >= WRITES || seen[t]) {
+            return false;
+        }
+        for (unsigned i = 2; i < WRITE_LEN; i++) {
+            if (buf[start + i] != write_byte(t, i)) {
+                return false;
+            }
+        }
+        seen[t] = true;
+    }
+    return true;
+}
+
+static void * master(void * arg)
+{
+    (void)arg;
+    for (unsigned t = 0; t < WRITES; t++) {
+        if (!pi2c_sim_master_start(SIM_SLAVE_ADDR >> 1, false)) {
+            continue;
+        }
+        for (unsigned i = 0; i < WRITE_LEN; i++) {
+            if (!pi2c_sim_master_write_byte(write_byte(t, i))) {
+                hit[t] = true;
+            }
+        }
+        pi2c_sim_master_stop();
+        usleep(40);
+    }
+    usleep(SETTLE_US);
+    bsc_i2c_request_stop();
+    return NULL;
+}
+
+// Count the writes lost in runs of lost writes that no overrun hit.
+static unsigned unexplained_losses()
+{
+    unsigned lost = 0;
+    for (unsigned t = 0; t < WRITES;) {
+        if (seen[t]) {
+            t++;
+            continue;
+        }
+        unsigned run = 0;
+        bool explained = false;
+        for (; t < WRITES && !seen[t]; t++, run++) {
+            explained = explained || hit[t];
+        }
+        lost += explained ? 0 : run;
+    }
+    return lost;
+}
+
+int main()
+{
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return 1;
+    }
+    pi2c_sim_random_faults(PI2C_SIM_FAULT_RX_OVERRUN, OVERRUN_PPM, FAULT_SEED);
+    pthread_t thread;
+    pthread_create(&thread, NULL, master, NULL);
+
+    unsigned returned = 0;
+    unsigned bad = 0;
+    uint8_t buf[64];
+    while (!bsc_i2c_stop_requested()) {
+        int len = bsc_i2c_read_transaction(buf, sizeof(buf));
+        if (len == 0) {
+            continue;
+        }
+        returned++;
+        if (!check_writes(buf, len)) {
+            bad++;
+        }
+    }
+    pthread_join(thread, NULL);
+
+    unsigned whole = 0;
+    unsigned hits = 0;
+    for (unsigned t = 0; t < WRITES; t++) {
+        whole += seen[t];
+        hits += hit[t];
+    }
+    unsigned unexplained = unexplained_losses();
+    printf("%u writes, %u hit by overruns, %u returned whole in %u transactions, %u broken, %u lost unexplained\n",
+           WRITES, hits, whole, returned, bad, unexplained);
+    if (bad != 0 || hits == 0 || unexplained != 0) {
+        fprintf(stderr, "FAIL: broken writes returned, or writes lost without an overrun\n");
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,61 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Measures how long the bus stays hung after a master aborts mid byte and
+ * then stays silent for 10 ms, with and without bsc_i2c_set_watchdog().
+ */
+#include <stdio.h>
+
+#include "pi2c_sim.h"
+#include "sim_harness.h"
+
+#define ABORT_PPM  (20000)
+#define FAULT_SEED (42)
+
+static const struct sim_traffic traffic = {
+    .transactions = 300,
+    .min_read = 1,
+    .max_read = 20,
+    .byte_gap_us = 20,
+    .hold_us = 10000,
+};
+
+static bool run(void * arg)
+{
+    uint32_t timeout_us = (uint32_t)(uintptr_t)arg;
+    if (!init_bcm_reg_mem() || !init_bsc_i2c_slv(SIM_SLAVE_ADDR)) {
+        return false;
+    }
+    bsc_i2c_set_watchdog(timeout_us);
+    pi2c_sim_random_faults(PI2C_SIM_FAULT_ABORT, ABORT_PPM, FAULT_SEED);
+
+    struct sim_result result;
+    sim_serve(&traffic, sim_echo_cb, &result);
+
+    struct pi2c_sim_fault_stats stats;
+    pi2c_sim_get_fault_stats(PI2C_SIM_FAULT_ABORT, &stats);
+    struct bsc_i2c_watchdog_stats wd;
+    bsc_i2c_get_watchdog_stats(&wd);
+    char name[32];
+    if (timeout_us) {
+        snprintf(name, sizeof(name), "%u us", timeout_us);
+    } else {
+        snprintf(name, sizeof(name), "off");
+    }
+    printf("  watchdog %-8s %3u aborts, %3u recovered: avg %5llu us, max %5llu us, %u resets\n",
+           name, stats.injected, stats.recovered,
+           stats.recovered ? (unsigned long long)(stats.total_recovery_ns / stats.recovered / 1000) : 0ULL,
+           (unsigned long long)(stats.max_recovery_ns / 1000), wd.resets);
+    return stats.recovered == stats.injected;
+}
+
+int main()
+{
+    bool ok = true;
+    printf("aborted transactions, then 10 ms of silence\n");
+    ok &= sim_isolated(run, (void *)0);
+    ok &= sim_isolated(run, (void *)2000);
+    return ok ? 0 : 1;
+}
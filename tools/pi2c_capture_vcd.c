@@ -0,0 +1,225 @@
+/*
+ * Copyright 2020 EQware Engineering Inc.
+ * SPDX-License-Identifier: BSD-3-Clause
+ */
+/*
+ * Convert a capture written by bsc_i2c_capture_save() into a VCD file that
+ * PulseView opens with File > Import Value Change Dump, and decodes with its
+ * I2C decoder on the scl and sda channels.
+ *
+ * The library only sees the FIFOs, so the bus is synthesized: each record
+ * becomes START, address, data, ACK/NACK and STOP at the estimated bus rate,
+ * timed to end when the library saw the transfer end. Records are converted
+ * one at a time, so memory use doesn't depend on the length of the capture.
+ *
+ * Build: gcc -O2 -o pi2c_capture_vcd tools/pi2c_capture_vcd.c -Isrc
+ * Usage: pi2c_capture_vcd [-r bus_hz] [capture [out.vcd]]
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pi2cslave.h"
+
+#define DEFAULT_BUS_HZ (100000)     ///< When the capture has no byte time
+#define MIN_BIT_NS     (4)          ///< Shortest bit, so every edge has its own time
+#define RECORD_MAX     (UINT16_MAX) ///< Longest record data, from the width of len
+#define TAG            "pi2c_capture_vcd"
+
+struct vcd {
+    FILE * out;
+    int64_t now;  ///< Time of the last change written
+    bool scl;
+    bool sda;
+};
+
+static void set(struct vcd * vcd, int64_t t, bool scl, bool sda)
+{
+    if (scl == vcd->scl && sda == vcd->sda) {
+        return;
+    }
+    if (t > vcd->now) {
+        fprintf(vcd->out, "#%" PRId64 "\n", t);
+        vcd->now = t;
+    }
+    if (scl != vcd->scl) {
+        fprintf(vcd->out, "%d!\n", scl);
+    }
+    if (sda != vcd->sda) {
+        fprintf(vcd->out, "%d\"\n", sda);
+    }
+    vcd->scl = scl;
+    vcd->sda = sda;
+}
+
+// One clock with SCL starting low at t. SDA changes a quarter bit in, and
+// SCL is high for the second half.
+static int64_t bit(struct vcd * vcd, int64_t t, int64_t bit_ns, bool val)
+{
+    set(vcd, t + bit_ns / 4, false, val);
+    set(vcd, t + bit_ns / 2, true, val);
+    set(vcd, t + bit_ns, false, val);
+    return t + bit_ns;
+}
+
+static int64_t byte(struct vcd * vcd, int64_t t, int64_t bit_ns, uint8_t val, bool ack)
+{
+    for (int i = 7; i >= 0; i--) {
+        t = bit(vcd, t, bit_ns, (val >> i) & 1);
+    }
+    return bit(vcd, t, bit_ns, !ack);
+}
+
+// Time on the bus of a transfer of len data bytes.
+static int64_t transfer_ns(int64_t bit_ns, uint32_t len)
+{
+    return bit_ns / 2 + (int64_t)(len + 1) * 9 * bit_ns + bit_ns;
+}
+
+static int64_t transfer(struct vcd * vcd, int64_t t, int64_t bit_ns, uint8_t addr,
+                        const struct bsc_i2c_tap_record * rec, const uint8_t * data)
+{
+    bool read = rec->dir == BSC_TAP_TX;
+    // START: SDA falls while SCL is high.
+    set(vcd, t, true, false);
+    t += bit_ns / 2;
+    set(vcd, t, false, false);
+    t = byte(vcd, t, bit_ns, (addr << 1) | read, true);
+    for (uint32_t i = 0; i < rec->len; i++) {
+        // The slave ACKs what the master writes. The master ACKs what it
+        // reads, except the last byte.
+        bool ack = !read || i + 1 < rec->len;
+        t = byte(vcd, t, bit_ns, data[i], ack);
+    }
+    // STOP: SDA rises while SCL is high.
+    set(vcd, t + bit_ns / 4, false, false);
+    set(vcd, t + bit_ns / 2, true, false);
+    t += bit_ns;
+    set(vcd, t, true, true);
+    return t;
+}
+
+static void usage()
+{
+    fprintf(stderr, "Usage: " TAG " [-r bus_hz] [capture [out.vcd]]\n");
+}
+
+int main(int argc, char ** argv)
+{
+    unsigned long bus_hz = 0;
+    int opt;
+    while ((opt = getopt(argc, argv, "r:h")) != -1) {
+        switch (opt) {
+        case 'r':
+            bus_hz = strtoul(optarg, NULL, 0);
+            if (bus_hz == 0) {
+                usage();
+                return 2;
+            }
+            break;
+        default:
+            usage();
+            return 2;
+        }
+    }
+    if (argc - optind > 2) {
+        usage();
+        return 2;
+    }
+    FILE * in = stdin;
+    if (optind < argc && strcmp(argv[optind], "-") != 0) {
+        in = fopen(argv[optind], "rb");
+        if (in == NULL) {
+            fprintf(stderr, TAG ": Unable to open %s: %s\n", argv[optind], strerror(errno));
+            return 1;
+        }
+    }
+    struct vcd vcd = {stdout, 0, true, true};
+    if (optind + 1 < argc) {
+        vcd.out = fopen(argv[optind + 1], "w");
+        if (vcd.out == NULL) {
+            fprintf(stderr, TAG ": Unable to open %s: %s\n", argv[optind + 1], strerror(errno));
+            return 1;
+        }
+    }
+
+    struct bsc_i2c_capture_header head;
+    if (fread(&head, sizeof(head), 1, in) != 1 ||
+        memcmp(head.magic, BSC_CAPTURE_MAGIC, sizeof(head.magic)) != 0) {
+        fprintf(stderr, TAG ": Not a capture file\n");
+        return 1;
+    }
+    if (head.version != BSC_CAPTURE_VERSION) {
+        fprintf(stderr, TAG ": Unsupported capture version %" PRIu32 "\n", head.version);
+        return 1;
+    }
+    int64_t bit_ns;
+    if (bus_hz) {
+        bit_ns = 1000000000 / bus_hz;
+    } else if (head.byte_time_ns) {
+        bit_ns = head.byte_time_ns / 9;
+    } else {
+        bit_ns = 1000000000 / DEFAULT_BUS_HZ;
+    }
+    if (bit_ns < MIN_BIT_NS) {
+        bit_ns = MIN_BIT_NS;
+    }
+
+    fprintf(vcd.out,
+            "$comment pi2cslave capture, slave 0x%02x, %" PRId64 " ns per bit $end\n"
+            "$timescale 1 ns $end\n"
+            "$scope module i2c $end\n"
+            "$var wire 1 ! scl $end\n"
+            "$var wire 1 \" sda $end\n"
+            "$upscope $end\n"
+            "$enddefinitions $end\n"
+            "#0\n"
+            "$dumpvars\n1!\n1\"\n$end\n",
+            head.slave_addr, bit_ns);
+
+    static uint8_t data[RECORD_MAX];
+    struct bsc_i2c_tap_record rec;
+    bool have_origin = false;
+    int64_t origin = 0;   ///< Capture time of VCD time 0
+    int64_t bus_free = 0; ///< Earliest start of the next transfer
+    unsigned long records = 0;
+    unsigned long truncated = 0;
+    unsigned long moved = 0;
+    while (fread(&rec, sizeof(rec), 1, in) == 1) {
+        if (rec.len && fread(data, rec.len, 1, in) != 1) {
+            fprintf(stderr, TAG ": Capture cut short in record %lu\n", records);
+            break;
+        }
+        int64_t len_ns = transfer_ns(bit_ns, rec.len);
+        if (!have_origin) {
+            // Leave one bit of idle bus before the first transfer.
+            origin = (int64_t)rec.end_ns - len_ns - bit_ns;
+            have_origin = true;
+        }
+        // End the transfer when the library saw it end. Estimates can make
+        // transfers overlap, so push them back to keep the bus sane.
+        int64_t start = (int64_t)rec.end_ns - origin - len_ns;
+        if (start < bus_free) {
+            start = bus_free;
+            moved++;
+        }
+        bus_free = transfer(&vcd, start, bit_ns, head.slave_addr, &rec, data) + bit_ns;
+        records++;
+        if (rec.flags & BSC_TAP_TRUNCATED) {
+            truncated++;
+        }
+    }
+    fprintf(vcd.out, "#%" PRId64 "\n", bus_free);
+    if (ferror(in) || fflush(vcd.out) != 0 || ferror(vcd.out)) {
+        fprintf(stderr, TAG ": I/O error\n");
+        return 1;
+    }
+    fprintf(stderr, TAG ": %lu records, %lu truncated, %lu moved later to fit the bus\n",
+            records, truncated, moved);
+    return 0;
+}